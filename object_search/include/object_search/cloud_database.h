@@ -4,30 +4,112 @@
 #include <string>
 #include <vector>
 
+#include "boost/function.hpp"
+#include "boost/shared_ptr.hpp"
 #include "ros/ros.h"
 
 #include "rapid_msgs/StaticCloud.h"
 #include "rapid_msgs/StaticCloudInfo.h"
+#include "static_cloud_db_msgs/StaticCloudMetadata.h"
+
+#include "object_search/service_client_pool.h"
+#include "object_search/write_behind_queue.h"
 
 namespace object_search {
+struct AsyncCalls;
+struct PendingSaves;
+
+// Client for the static cloud database services.
+//
+// Each service is called over a small pool of persistent connections, which
+// is shared by all copies of the database.
+//
+// The Async methods make the service call on one of a few background threads,
+// which are shared by all copies of the database, and pass the result to a
+// callback on that thread, so that the caller can do other work while the
+// database responds. The callback must be thread-safe, and since the caller
+// may stop waiting for it, it should only hold shared state rather than
+// pointers to the caller. When the last copy of the database is destroyed,
+// calls that are running are finished and calls that are still queued are
+// dropped without calling back.
+//
+// SaveBehind returns a provisional ID right away and writes the cloud in the
+// background. Until the write finishes, GetById returns the cloud from memory,
+// and afterwards the provisional ID keeps working for the life of the process.
+// Provisional IDs mean nothing to other processes, so anything that hands an
+// ID out should first resolve it with WaitForSave. If the write fails, the
+// cloud is dropped and WaitForSave returns false. Since the write may have
+// gone through anyway, it is not retried.
 class Database {
  public:
-  Database(const std::string& db, const std::string& collection,
-           const ros::ServiceClient& get, const ros::ServiceClient& list,
-           const ros::ServiceClient& remove, const ros::ServiceClient& save);
+  typedef boost::function<void(bool success, const std::string& id,
+                               const rapid_msgs::StaticCloud& cloud)>
+      GetCallback;
+  typedef boost::function<void(
+      const std::vector<rapid_msgs::StaticCloudInfo>& clouds)>
+      ListCallback;
+
+  Database(const ros::NodeHandle& nh, const std::string& db,
+           const std::string& collection);
   bool Get(const std::string& name, rapid_msgs::StaticCloud* cloud);
   bool GetById(const std::string& id, rapid_msgs::StaticCloud* cloud);
+  // Gets a cloud that has been voxelized server-side, at the coarsest stored
+  // level of detail that is no coarser than leaf_size. The cloud should still
+  // be voxelized at leaf_size by the caller, but it will have far fewer points.
+  // If cloud_id is not NULL, it is set to the cloud's ID, which is the
+  // database ID unless the cloud is still being written by SaveBehind.
+  bool Get(const std::string& name, const double leaf_size,
+           rapid_msgs::StaticCloud* cloud, std::string* cloud_id);
+  bool GetById(const std::string& id, const double leaf_size,
+               rapid_msgs::StaticCloud* cloud, std::string* cloud_id);
+  // Gets many clouds in one service call. The clouds for ids are returned
+  // first, in order, followed by the clouds for names. Returns false if any
+  // cloud was not found.
+  bool GetMany(const std::vector<std::string>& ids,
+               const std::vector<std::string>& names,
+               std::vector<rapid_msgs::StaticCloud>* clouds);
+  // Gets everything about a cloud except its points.
+  bool GetInfo(const std::string& name,
+               static_cloud_db_msgs::StaticCloudMetadata* info);
+  bool GetInfoById(const std::string& id,
+                   static_cloud_db_msgs::StaticCloudMetadata* info);
   void List(std::vector<rapid_msgs::StaticCloudInfo>* clouds);
+  void GetAsync(const std::string& name, const double leaf_size,
+                const GetCallback& done);
+  void GetByIdAsync(const std::string& id, const double leaf_size,
+                    const GetCallback& done);
+  void ListAsync(const ListCallback& done);
+  // Removes the first cloud with the given name. Unlike RemoveById, this is
+  // not retried if the call fails, since the retry would remove the next cloud
+  // with the same name if the first call had gone through.
   bool Remove(const std::string& name);
+  bool RemoveById(const std::string& id);
   std::string Save(const rapid_msgs::StaticCloud& cloud);
+  std::string SaveBehind(const rapid_msgs::StaticCloud& cloud);
+  // Waits up to timeout for a cloud saved with SaveBehind to be written, and
+  // gets its database ID. Database IDs are returned as they are. Returns false
+  // if the write failed or timed out.
+  bool WaitForSave(const std::string& id, const ros::WallDuration& timeout,
+                   std::string* saved_id);
 
  private:
+  bool FindPending(std::string* id, rapid_msgs::StaticCloud* cloud);
+  // Returns a copy of the database for a background call to use. The copy
+  // doesn't share the background threads, so they are never joined from one
+  // of their own calls.
+  Database Detached() const;
+
   std::string db_;
   std::string collection_;
-  ros::ServiceClient get_;
-  ros::ServiceClient list_;
-  ros::ServiceClient remove_;
-  ros::ServiceClient save_;
+  boost::shared_ptr<ServiceClientPool> get_;
+  boost::shared_ptr<ServiceClientPool> get_many_;
+  boost::shared_ptr<ServiceClientPool> get_info_;
+  boost::shared_ptr<ServiceClientPool> list_;
+  boost::shared_ptr<ServiceClientPool> remove_;
+  boost::shared_ptr<ServiceClientPool> save_;
+  boost::shared_ptr<PendingSaves> pending_;
+  boost::shared_ptr<WriteBehindQueue> writes_;
+  boost::shared_ptr<AsyncCalls> async_;
 };
 }  // namespace object_search
 
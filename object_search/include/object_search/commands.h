@@ -30,6 +30,23 @@ class PoseEstimationMatch;
 namespace object_search {
 class CaptureRoi;
 class Database;  // Forward declaration
+class FrameAverager;
+class WriteBehindQueue;
+
+// Runs another command once the writes queued so far have finished, so that
+// commands that read scenes see the ones that are still being saved.
+class AfterWritesCommand : public rapid::utils::CommandInterface {
+ public:
+  AfterWritesCommand(rapid::utils::CommandInterface* command,
+                     WriteBehindQueue* writes);
+  void Execute(const std::vector<std::string>& args);
+  std::string name() const;
+  std::string description() const;
+
+ private:
+  rapid::utils::CommandInterface* command_;
+  WriteBehindQueue* writes_;
+};
 
 // Command that runs an embedded command line interface.
 class CliCommand : public rapid::utils::CommandInterface {
@@ -78,7 +95,11 @@ class ListCommand : public rapid::utils::CommandInterface {
 
 class RecordObjectCommand : public rapid::utils::CommandInterface {
  public:
-  RecordObjectCommand(Database* db, CaptureRoi* capture, const ros::Publisher& name_request);
+  // If averager is not NULL, it is used to smooth the captured cloud and is
+  // started as soon as the command runs.
+  RecordObjectCommand(Database* db, CaptureRoi* capture,
+                      const ros::Publisher& name_request,
+                      FrameAverager* averager);
   void Execute(const std::vector<std::string>& args);
   std::string name() const;
   std::string description() const;
@@ -89,6 +110,7 @@ class RecordObjectCommand : public rapid::utils::CommandInterface {
  private:
   Database* db_;
   CaptureRoi* capture_;
+  FrameAverager* averager_;
   std::string last_id_;    // MongoDB ID of most recent object saved.
   std::string last_name_;  // Name of most recent object saved.
   rapid_msgs::Roi3D last_roi_;
@@ -173,8 +195,10 @@ class EditLandmarkCommand : public rapid::utils::CommandInterface {
 
 class RecordSceneCommand : public rapid::utils::CommandInterface {
  public:
-  explicit RecordSceneCommand(rapid::db::NameDb* info_db,
-                              rapid::db::NameDb* cloud_db);
+  // If writes is not NULL, the scene is saved in the background. If averager
+  // is not NULL, it is used to smooth the captured cloud.
+  RecordSceneCommand(rapid::db::NameDb* info_db, rapid::db::NameDb* cloud_db,
+                     WriteBehindQueue* writes, FrameAverager* averager);
   void Execute(const std::vector<std::string>& args);
   std::string name() const;
   std::string description() const;
@@ -182,6 +206,8 @@ class RecordSceneCommand : public rapid::utils::CommandInterface {
  private:
   rapid::db::NameDb* info_db_;
   rapid::db::NameDb* cloud_db_;
+  WriteBehindQueue* writes_;
+  FrameAverager* averager_;
   tf::TransformListener tf_listener_;
 };
 
@@ -0,0 +1,53 @@
+#ifndef _OBJECT_SEARCH_DEPTH_IMAGE_H_
+#define _OBJECT_SEARCH_DEPTH_IMAGE_H_
+
+#include <string>
+
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+#include "geometry_msgs/Transform.h"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "sensor_msgs/CameraInfo.h"
+#include "sensor_msgs/Image.h"
+
+#include "object_search/organized_cloud.h"
+
+namespace object_search {
+// Reads the intrinsics from the camera's projection matrix.
+CameraIntrinsics IntrinsicsFromCameraInfo(const sensor_msgs::CameraInfo& info);
+
+// Returns true if the depth image has an encoding we can read (16UC1 in
+// millimeters or 32FC1 in meters), and the color image, if given, is rgb8,
+// bgr8, rgba8 or bgra8 and the same size as the depth image. Also checks that
+// each image's step and buffer are large enough for its width and height.
+bool CanReadDepthImage(const sensor_msgs::Image& depth,
+                       const sensor_msgs::Image* rgb);
+
+// Converts a whole depth image into an organized cloud in the camera frame.
+// Pixels with no depth are NaN. rgb may be NULL, in which case the points are
+// black. Returns false if the images can't be read.
+bool DepthImageToCloud(const sensor_msgs::Image& depth,
+                       const sensor_msgs::Image* rgb,
+                       const sensor_msgs::CameraInfo& info,
+                       pcl::PointCloud<pcl::PointXYZRGB>* cloud);
+
+// Generates points from a depth image only inside a box, and outputs them in
+// the base frame. This is the depth image equivalent of CropSceneToBox, and
+// takes the same arguments.
+//
+// Only the pixels that the box projects to are visited, so points outside the
+// box are never generated. The output is unorganized. Returns false if the
+// images can't be read.
+bool CropDepthImageToBox(const sensor_msgs::Image& depth,
+                         const sensor_msgs::Image* rgb,
+                         const sensor_msgs::CameraInfo& info,
+                         const std::string& parent_frame_id,
+                         const geometry_msgs::Transform& base_to_camera,
+                         const Eigen::Affine3f& box_pose,
+                         const Eigen::Vector3f& min_pt,
+                         const Eigen::Vector3f& max_pt,
+                         pcl::PointCloud<pcl::PointXYZRGB>::Ptr cropped);
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_DEPTH_IMAGE_H_
@@ -0,0 +1,88 @@
+#ifndef _OBJECT_SEARCH_FRAME_AVERAGER_H_
+#define _OBJECT_SEARCH_FRAME_AVERAGER_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/condition_variable.hpp"
+#include "boost/thread/mutex.hpp"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "ros/ros.h"
+#include "sensor_msgs/PointCloud2.h"
+
+namespace object_search {
+// Keeps a running per-pixel average of the last N frames of an organized point
+// cloud topic, as a non-blocking replacement for GetSmoothedKinectCloud.
+//
+// Each pixel is averaged over the frames in which it is valid, and is NaN if
+// it is invalid in all of them. A running sum is kept, so each frame costs one
+// pass to add it and one pass to drop the frame that falls out of the window.
+// If the frame size changes, the window starts over.
+//
+// Averaging only runs between Start and Stop. Start it ahead of time, e.g.,
+// while the user is still adjusting an ROI, and the smoothed cloud is ready as
+// soon as it's needed.
+//
+// Usage:
+//  FrameAverager averager(nh, "cloud_in", 15);
+//  averager.Start();
+//  ...
+//  pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud =
+//      averager.Average(ros::Duration(10));
+//  averager.Stop();
+class FrameAverager {
+ public:
+  FrameAverager(const ros::NodeHandle& nh, const std::string& topic,
+                const int num_frames);
+  ~FrameAverager();
+
+  // Subscribes to the topic and starts a new window. Does nothing if already
+  // running.
+  void Start();
+  // Unsubscribes and discards the window.
+  void Stop();
+  bool running();
+
+  // Returns the average of the last num_frames frames, waiting up to timeout
+  // for the window to fill. Returns a null pointer if it is not running or the
+  // window is not full by the timeout.
+  pcl::PointCloud<pcl::PointXYZRGB>::Ptr Average(const ros::Duration& timeout);
+
+ private:
+  // One frame, stored compactly so that the window is cheap to keep.
+  struct Frame {
+    std::vector<float> xyz;     // 3 values per pixel, NaN if invalid.
+    std::vector<uint32_t> rgb;  // Packed color per pixel.
+  };
+
+  void Callback(const sensor_msgs::PointCloud2::ConstPtr& cloud);
+  // Adds (sign = 1) or removes (sign = -1) a frame from the running sums.
+  void Accumulate(const Frame& frame, const int sign);
+  void Reset(const int width, const int height);
+
+  ros::NodeHandle nh_;
+  std::string topic_;
+  int num_frames_;
+  ros::Subscriber sub_;
+
+  // Everything below is guarded by mutex_.
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  bool running_;
+  std::string frame_id_;
+  uint64_t stamp_;  // PCL stamp of the newest frame.
+  int width_;
+  int height_;
+  std::deque<boost::shared_ptr<Frame> > frames_;
+  std::vector<double> xyz_sum_;
+  std::vector<uint32_t> rgb_sum_;  // 3 channels per pixel.
+  std::vector<uint16_t> counts_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_FRAME_AVERAGER_H_
@@ -0,0 +1,59 @@
+#ifndef _OBJECT_SEARCH_OBJECT_CACHE_H_
+#define _OBJECT_SEARCH_OBJECT_CACHE_H_
+
+#include <map>
+#include <string>
+
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "rapid_msgs/StaticCloud.h"
+
+namespace object_search {
+// An object model, transformed into the base frame and voxelized for search.
+struct PreparedObject {
+  PreparedObject();
+
+  // The model's database ID, or empty if the model didn't come from the
+  // database. Identifies the object however it was requested.
+  std::string id;
+  rapid_msgs::StaticCloud model;
+  pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed;
+  pcl::PointCloud<pcl::PointXYZRGB>::Ptr sampled;
+  double leaf_size;
+};
+
+// Thread-safe cache of prepared objects, looked up by database ID or by name.
+// Inserting replaces whatever was cached under the same ID or name, so an
+// object that is prepared again with new parameters replaces the old copy.
+class ObjectCache {
+ public:
+  ObjectCache();
+
+  // Either id or name may be empty, in which case the object can't be found
+  // by it. The name should only be given if the database would return this
+  // object when asked for that name.
+  void Insert(const std::string& id, const std::string& name,
+              const boost::shared_ptr<const PreparedObject>& object);
+  // Removes the object cached under id and the object cached under name,
+  // including any other entries for those objects. Either may be empty.
+  void Erase(const std::string& id, const std::string& name);
+  // Looks up by id if it is given, otherwise by name. Returns a null pointer
+  // if the object is not cached.
+  boost::shared_ptr<const PreparedObject> Find(const std::string& id,
+                                               const std::string& name);
+  void Clear();
+  size_t size();
+
+ private:
+  typedef std::map<std::string, boost::shared_ptr<const PreparedObject> >
+      ObjectMap;
+
+  boost::mutex mutex_;
+  ObjectMap by_id_;
+  ObjectMap by_name_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_OBJECT_CACHE_H_
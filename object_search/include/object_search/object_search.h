@@ -1,21 +1,109 @@
 #ifndef _OBJECT_SEARCH_OBJECT_SEARCH_H_
 #define _OBJECT_SEARCH_OBJECT_SEARCH_H_
 
+#include <string>
+
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+#include "geometry_msgs/Transform.h"
+#include "geometry_msgs/Vector3.h"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "rapid_msgs/Roi3D.h"
 //#include "rapid_perception/grouping_pose_estimator.h"
 #include "rapid_perception/pose_estimation.h"
 //#include "rapid_perception/ransac_pose_estimator.h"
 
 namespace object_search {
+// Search parameters for a PoseEstimator with a RandomHeatMapper.
+struct EstimatorParams {
+  EstimatorParams();
+
+  double sample_ratio;
+  int max_samples;
+  int num_candidates;
+  double fitness_threshold;
+  double sigma_threshold;
+  double nms_radius;
+  int min_results;
+};
+
+// Applies the parameters to the estimator and its heat mapper, which must be a
+// RandomHeatMapper.
+void ConfigureEstimator(const EstimatorParams& params,
+                        rapid::perception::PoseEstimator* estimator);
+
+// The number of candidate poses an estimator configured with params evaluates
+// in a scene with num_points points. The heat mapper samples sample_ratio of
+// the points, up to max_samples, and at most num_candidates of those become
+// candidates.
+int NumCandidates(const EstimatorParams& params, const size_t num_points);
+
 void UpdateEstimatorParams(rapid::perception::PoseEstimator* custom);
 // void UpdateEstimatorParams(rapid::perception::RansacPoseEstimator* ransac);
 // void UpdateEstimatorParams(rapid::perception::GroupingPoseEstimator*
 // grouping);
 
-void CropScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr scene,
-               pcl::PointCloud<pcl::PointXYZRGB>::Ptr cropped);
+// The preprocessing functions below are templated on the point type. They are
+// instantiated for pcl::PointXYZRGB, and for pcl::PointXYZ for searches that
+// only use geometry, which carry half the data per point.
+template <typename PointT>
+void CropScene(typename pcl::PointCloud<PointT>::Ptr scene,
+               typename pcl::PointCloud<PointT>::Ptr cropped);
+template <typename PointT>
 void Downsample(const double leaf_size,
-                pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_in,
-                pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_out);
+                typename pcl::PointCloud<PointT>::Ptr cloud_in,
+                typename pcl::PointCloud<PointT>::Ptr cloud_out);
+
+// Transforms a scene from its camera frame into the base frame, keeping only
+// the points inside a box. The box is given by its pose in the base frame and
+// its min/max corners in the box frame. If use_organized is true, organized
+// scenes are cropped with CropOrganized, which only visits the pixels that the
+// box projects to.
+template <typename PointT>
+void CropSceneToBox(typename pcl::PointCloud<PointT>::ConstPtr scene,
+                    const std::string& parent_frame_id,
+                    const geometry_msgs::Transform& base_to_camera,
+                    const Eigen::Affine3f& box_pose,
+                    const Eigen::Vector3f& min_pt,
+                    const Eigen::Vector3f& max_pt, const bool use_organized,
+                    typename pcl::PointCloud<PointT>::Ptr cropped);
+
+// Crops the cloud to the points inside the given ROI, grown by margin on each
+// side.
+template <typename PointT>
+void CropToRoi(typename pcl::PointCloud<PointT>::ConstPtr cloud,
+               const rapid_msgs::Roi3D& roi, const double margin,
+               typename pcl::PointCloud<PointT>::Ptr cropped);
+
+// Returns true if the given ROI, grown by margin on each side, lies entirely
+// inside the axis-aligned box from min_pt to max_pt. The ROI and the box must
+// be in the same frame.
+bool RoiInsideBox(const rapid_msgs::Roi3D& roi, const double margin,
+                  const Eigen::Vector3f& min_pt, const Eigen::Vector3f& max_pt);
+
+// Returns true if the cluster is large enough to be a view of an object with
+// the given ROI dimensions. Each extent of the cluster's bounding box, sorted
+// by length, must be at least min_ratio times the corresponding sorted ROI
+// dimension. min_ratio < 1 allows for partially occluded objects.
+template <typename PointT>
+bool CanContainRoi(const pcl::PointCloud<PointT>& cluster,
+                   const geometry_msgs::Vector3& dimensions,
+                   const double min_ratio);
+// Like CanContainRoi, for a cluster with the given bounding box.
+bool BoxCanContainRoi(const Eigen::Vector3f& min_pt,
+                      const Eigen::Vector3f& max_pt,
+                      const geometry_msgs::Vector3& dimensions,
+                      const double min_ratio);
+
+// Returns a voxel leaf size that reduces an object with the given bounding box
+// dimensions to roughly target_points points. A depth camera sees about half
+// of the box's surface, so the leaf size is chosen such that
+// (xy + yz + xz) / leaf_size^2 = target_points. The result is clamped to
+// [min_leaf_size, max_leaf_size].
+double AdaptiveLeafSize(const geometry_msgs::Vector3& dimensions,
+                        const int target_points, const double min_leaf_size,
+                        const double max_leaf_size);
 }  // namespace object_search
 
 #endif  // _OBJECT_SEARCH_OBJECT_SEARCH_H_
@@ -1,78 +1,332 @@
 #ifndef _OBJECT_SEARCH_OBJECT_SEARCH_NODE_H_
 #define _OBJECT_SEARCH_OBJECT_SEARCH_NODE_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+#include "actionlib/server/simple_action_server.h"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/future.hpp"
+#include "boost/thread/mutex.hpp"
+#include "geometry_msgs/Pose.h"
 #include "geometry_msgs/Transform.h"
 #include "pcl/point_cloud.h"
 #include "pcl/point_types.h"
 #include "rapid_perception/pose_estimation.h"
+#include "rapid_perception/pose_estimation_match.h"
+#include "rapid_msgs/Roi3D.h"
 #include "rapid_msgs/StaticCloud.h"
+#include "rapid_msgs/StaticCloudInfo.h"
+#include "ros/ros.h"
 
 #include "object_search/cloud_database.h"
 #include "object_search/commands.h"
+#include "object_search/object_cache.h"
+#include "object_search/object_search.h"
+#include "object_search/parallel_search.h"
+#include "object_search/scene_buffer.h"
+#include "object_search/scene_diff.h"
+#include "object_search/scene_registry.h"
+#include "object_search/scene_tiles.h"
+#include "object_search/search_cache.h"
+#include "object_search/search_progress.h"
+#include "object_search/search_scheduler.h"
+#include "object_search/tabletop_extractor.h"
 #include "object_search_msgs/GetObjectInfo.h"
 #include "object_search_msgs/Match.h"
 #include "object_search_msgs/RecordObject.h"
+#include "object_search_msgs/RegisterScene.h"
+#include "object_search_msgs/ReleaseScene.h"
 #include "object_search_msgs/Search.h"
 #include "object_search_msgs/SearchFromDb.h"
+#include "object_search_msgs/SearchFromDbAction.h"
 
 namespace object_search {
+// Per-request options, shared by the Search and SearchFromDb services.
+struct SearchOptions {
+  SearchOptions();
+  template <class Request>
+  explicit SearchOptions(const Request& req)
+      : is_tabletop(req.is_tabletop),
+        max_error(req.max_error),
+        min_results(req.min_results),
+        region(req.region),
+        region_margin(req.region_margin),
+        near_last_match(req.near_last_match),
+        geometry_only(req.geometry_only) {}
+
+  bool is_tabletop;
+  double max_error;
+  int min_results;
+  rapid_msgs::Roi3D region;  // Search region, unused if dimensions are 0.
+  double region_margin;
+  bool near_last_match;
+  // Preprocess the scene as pcl::PointXYZ. This is chosen per request rather
+  // than per object because the scene is preprocessed once for the request,
+  // and the caller is the one who knows whether color matters. Ignored for
+  // tabletop searches, depth images, and prepared scenes whose crop box
+  // contains the search region.
+  bool geometry_only;
+};
+
+// Parameters that decide how objects are voxelized. Objects may be prepared on
+// the database's background thread while a service call runs UpdateParams, so
+// PrepareObject is given a copy instead of reading the node's members.
+struct VoxelParams {
+  VoxelParams();
+
+  double leaf_size;
+  bool adaptive_leaf_size;
+  int object_point_budget;
+  double min_leaf_size;
+  double max_leaf_size;
+};
+
+// The node's parameters. Every service call runs UpdateParams, on whichever
+// spinner thread it is served on, so the parameters are read into a new
+// NodeParams and swapped in under a mutex. Each request works from its own
+// copy, taken with CurrentParams, for its whole duration.
+struct NodeParams {
+  NodeParams();
+
+  VoxelParams voxel;
+
+  // Scene cropping
+  double min_x;
+  double min_y;
+  double min_z;
+  double max_x;
+  double max_y;
+  double max_z;
+  double region_margin;  // Default margin when searching near the last match
+  bool organized_crop;   // Use the fast path for organized scenes
+  // Wait for depth_in and camera_info_in instead of cloud_in when there is no
+  // scene buffer, and for rgb_in if depth_input_rgb is set.
+  bool depth_input;
+  bool depth_input_rgb;
+  // Oldest scene buffer frame a search may use, in seconds. 0 accepts any.
+  double max_scene_age;
+
+  // Registered scenes
+  double scene_ttl;  // Default TTL, in seconds
+  int max_registered_scenes;
+
+  // Search result cache
+  double search_cache_ttl;        // In seconds, 0 disables the cache
+  double search_cache_leaf_size;  // Voxel size for hashing the scene
+  int search_cache_size;
+
+  // Change-aware search
+  bool change_aware_search;
+  double change_leaf_size;
+  int change_min_points;     // Points for a voxel to count as occupied
+  int change_min_voxels;     // Changed voxels for a region to be searched
+  double max_changed_ratio;  // Search everything if more than this changed
+  int max_change_references;  // Least recently used are dropped past this
+
+  // Tiled search
+  bool tiled_search;
+  double tile_size_ratio;  // Tile size as a multiple of the object's size
+
+  // Search
+  double sample_ratio;
+  int max_samples;
+  double fitness_threshold;
+  double sigma_threshold;
+  double nms_radius;
+
+  // Tabletop search
+  std::string tabletop_mode;  // "merged" or "clusters"
+  int num_threads;
+  double min_cluster_extent_ratio;
+  int min_cluster_samples;
+  bool cache_table_plane;
+  double table_max_angle_change;
+  double table_max_offset_change;
+  double table_min_inlier_ratio;
+  double table_distance_threshold;
+  double table_max_object_height;
+  double table_cluster_tolerance;
+  int table_min_cluster_size;
+};
+
+typedef actionlib::SimpleActionServer<object_search_msgs::SearchFromDbAction>
+    SearchActionServer;
+
+// The scene an object was last searched for in, and the matches found, for
+// change-aware search.
+struct ChangeReference {
+  // Cropped to the crop box or search region, and in the base frame.
+  pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr scene;
+  // Only the matches under the fitness threshold.
+  std::vector<object_search_msgs::Match> matches;
+  ros::WallTime last_used;
+};
+
 class ObjectSearchNode {
  public:
+  // max_search_queue is the number of searches that may wait before more are
+  // rejected. It is fixed at startup, since it must match the number of
+  // threads serving searches.
   ObjectSearchNode(const rapid::perception::PoseEstimator& estimator,
                    const RecordObjectCommand& record_object,
-                   const Database& object_db);
+                   const Database& object_db, SceneBuffer* scene_buffer,
+                   const int max_search_queue);
   bool ServeGetObjectInfo(object_search_msgs::GetObjectInfoRequest& req,
                           object_search_msgs::GetObjectInfoResponse& resp);
   bool ServeRecordObject(object_search_msgs::RecordObjectRequest& req,
                          object_search_msgs::RecordObjectResponse& resp);
+  bool ServeRegisterScene(object_search_msgs::RegisterSceneRequest& req,
+                          object_search_msgs::RegisterSceneResponse& resp);
+  bool ServeReleaseScene(object_search_msgs::ReleaseSceneRequest& req,
+                         object_search_msgs::ReleaseSceneResponse& resp);
   bool ServeSearch(object_search_msgs::SearchRequest& req,
                    object_search_msgs::SearchResponse& resp);
   bool ServeSearchFromDb(object_search_msgs::SearchFromDbRequest& req,
                          object_search_msgs::SearchFromDbResponse& resp);
+  void ExecuteSearchAction(
+      const object_search_msgs::SearchFromDbGoalConstPtr& goal);
+  void PreemptSearchAction();
+  void set_action_server(SearchActionServer* action_server);
+  // Drops a cloud that was removed from the database from the object cache.
+  void OnObjectRemoved(const rapid_msgs::StaticCloudInfo::ConstPtr& info);
+
+  // Fetches every object in the database and prepares them all in parallel,
+  // so the first search for each object is as fast as later ones.
+  void Preload();
 
  private:
   void UpdateParams();
-  void Search(const rapid_msgs::StaticCloud& scene,
-              const rapid_msgs::StaticCloud& object, const bool is_tabletop,
-              const double max_error, const int min_results,
+  NodeParams CurrentParams();
+  bool WaitForScene(const NodeParams& config, PreparedScene* scene);
+  void PrepareScene(const NodeParams& config, PreparedScene* scene);
+  // Objects are prepared on the database's background thread, which may still
+  // be running after the request that started it has given up, so the
+  // functions that prepare them don't touch the node.
+  static void PrepareObject(const rapid_msgs::StaticCloud& model,
+                            const VoxelParams& voxel, PreparedObject* object);
+  void PreloadWorker(const std::vector<std::string>* ids,
+                     const VoxelParams* voxel,
+                     std::vector<boost::shared_ptr<PreparedObject> >* objects,
+                     size_t* next, boost::mutex* mutex);
+  static void OnObjectFetched(boost::shared_ptr<PreparedObject> object,
+                              const VoxelParams& voxel,
+                              boost::shared_ptr<boost::promise<bool> > ready,
+                              bool success, const std::string& id,
+                              const rapid_msgs::StaticCloud& model);
+  bool ScheduleSearch(const std::string& key, const int priority,
+                      const SearchScheduler::Work& work,
+                      SearchProgress* progress,
+                      std::vector<object_search_msgs::Match>* matches);
+  void PublishSearchFeedback(const std::string& stage, const int candidates,
+                             const double best_fitness);
+  void CacheObject(const object_search_msgs::SearchFromDbRequest& req,
+                   const boost::shared_ptr<const PreparedObject>& object);
+  bool SearchFromDb(const object_search_msgs::SearchFromDbRequest& req,
+                    SearchProgress* progress,
+                    std::vector<object_search_msgs::Match>* matches);
+  void Search(const NodeParams& config, const PreparedScene& scene,
+              const PreparedObject& object, const SearchOptions& options,
+              SearchProgress* progress,
               std::vector<object_search_msgs::Match>* matches);
-  void Downsample(pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr in,
-                  pcl::PointCloud<pcl::PointXYZRGB>::Ptr out);
-  void TransformToBase(pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr in,
-                       const std::string& parent_frame_id,
-                       const geometry_msgs::Transform& base_to_camera,
-                       pcl::PointCloud<pcl::PointXYZRGB>::Ptr out);
-  void ExtractTabletop(pcl::PointCloud<pcl::PointXYZRGB>::Ptr in,
+  bool SearchChanges(
+      const NodeParams& config,
+      pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr scene,
+      const std::string& key, const PreparedObject& object,
+      const EstimatorParams& params,
+      SearchProgress* progress,
+      std::vector<rapid::perception::PoseEstimationMatch>* new_matches,
+      std::vector<object_search_msgs::Match>* kept_matches);
+  void SearchTiles(
+      const NodeParams& config,
+      pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr scene, const bool sampled,
+      const PreparedObject& object, const EstimatorParams& params,
+      SearchProgress* progress,
+      std::vector<rapid::perception::PoseEstimationMatch>* matches);
+  pcl::PointCloud<pcl::PointXYZRGB>::Ptr LoadTile(
+      const SceneTiles& tiles, const std::vector<size_t>& searched,
+      const bool sampled, const PreparedObject& object, const size_t index);
+  bool SearchRegion(const NodeParams& config,
+                    const rapid_msgs::StaticCloud& object,
+                    const SearchOptions& options, rapid_msgs::Roi3D* region,
+                    double* margin);
+  static double ObjectLeafSize(const rapid_msgs::StaticCloud& object,
+                               const VoxelParams& voxel);
+  std::string SearchCacheKey(const NodeParams& config,
+                             const PreparedScene& scene,
+                             const PreparedObject& object,
+                             const SearchOptions& options);
+  template <typename PointT>
+  static void Downsample(const double leaf_size,
+                         typename pcl::PointCloud<PointT>::ConstPtr in,
+                         typename pcl::PointCloud<PointT>::Ptr out);
+  template <typename PointT>
+  static void TransformToBase(typename pcl::PointCloud<PointT>::ConstPtr in,
+                              const std::string& parent_frame_id,
+                              const geometry_msgs::Transform& base_to_camera,
+                              typename pcl::PointCloud<PointT>::Ptr out);
+  EstimatorParams CurrentEstimatorParams(const NodeParams& config,
+                                         const double max_error,
+                                         const int min_results);
+  void SearchClusters(
+      const NodeParams& config,
+      const std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr>& clusters,
+      pcl::PointCloud<pcl::PointXYZRGB>::Ptr object,
+      const rapid_msgs::Roi3D& roi, const double leaf_size,
+      const EstimatorParams& params, SearchProgress* progress,
+      std::vector<rapid::perception::PoseEstimationMatch>* matches);
+  void ExtractTabletopClusters(
+      const NodeParams& config, pcl::PointCloud<pcl::PointXYZRGB>::Ptr in,
+      std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr>* clusters);
+  void SceneCropBox(const NodeParams& config, const rapid_msgs::Roi3D* region,
+                    const double region_margin, Eigen::Affine3f* box_pose,
+                    Eigen::Vector3f* min_pt, Eigen::Vector3f* max_pt);
+  void CropSceneToBase(const NodeParams& config, const PreparedScene& scene,
+                       const rapid_msgs::Roi3D* region,
+                       const double region_margin,
                        pcl::PointCloud<pcl::PointXYZRGB>::Ptr out);
-  void CropScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr in,
-                 pcl::PointCloud<pcl::PointXYZRGB>::Ptr out);
+  void CropSceneGeometryToBase(const NodeParams& config,
+                               const PreparedScene& scene,
+                               const rapid_msgs::Roi3D* region,
+                               const double region_margin,
+                               pcl::PointCloud<pcl::PointXYZ>::Ptr out);
 
   tf::TransformListener tf_listener_;
   rapid::perception::PoseEstimator estimator_;
   RecordObjectCommand record_object_;
   Database object_db_;
+  SceneBuffer* scene_buffer_;  // May be NULL.
+  ParallelSearch parallel_search_;
+  TabletopExtractor tabletop_;
+  // Service callbacks run on several spinner threads, but the estimators and
+  // the tabletop extractor's cached plane can only be used by one at a time.
+  boost::mutex estimator_mutex_;  // Guards estimator_ and parallel_search_
+  boost::mutex tabletop_mutex_;   // Guards tabletop_
+  ObjectCache object_cache_;
+  SceneRegistry scene_registry_;
+  SearchCache search_cache_;
+  SearchScheduler scheduler_;
 
-  // Parameters
-  // Voxelization
-  double leaf_size_;
+  // The search action, and the progress of its current goal, if any.
+  SearchActionServer* action_server_;
+  boost::mutex action_mutex_;
+  SearchProgress* action_progress_;
 
-  // Scene cropping
-  double min_x_;
-  double min_y_;
-  double min_z_;
-  double max_x_;
-  double max_y_;
-  double max_z_;
+  // Pose of the best match the last time each object was found, by name.
+  std::map<std::string, geometry_msgs::Pose> last_match_poses_;
+  boost::mutex last_match_mutex_;
 
-  // Search
-  double sample_ratio_;
-  int max_samples_;
-  double fitness_threshold_;
-  double sigma_threshold_;
-  double nms_radius_;
+  // Reference scenes for change-aware search, by everything that determines
+  // which part of the scene is searched and which matches are kept.
+  std::map<std::string, ChangeReference> change_refs_;
+  boost::mutex change_refs_mutex_;
+
+  // Parameters, guarded by params_mutex_. Read with CurrentParams.
+  NodeParams params_;
+  boost::mutex params_mutex_;
 };
 }  // namespace object_search
 
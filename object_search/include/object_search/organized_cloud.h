@@ -0,0 +1,70 @@
+#ifndef _OBJECT_SEARCH_ORGANIZED_CLOUD_H_
+#define _OBJECT_SEARCH_ORGANIZED_CLOUD_H_
+
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+
+namespace object_search {
+// Pinhole camera intrinsics.
+struct CameraIntrinsics {
+  CameraIntrinsics();
+
+  double fx;
+  double fy;
+  double cx;
+  double cy;
+};
+
+// A rectangle of pixels, inclusive of both ends.
+struct PixelWindow {
+  PixelWindow();
+  int Area() const;
+
+  int min_col;
+  int max_col;
+  int min_row;
+  int max_row;
+};
+
+// Recovers the intrinsics of the camera that produced an organized cloud, which
+// must still be in the camera's optical frame. A grid of valid pixels is
+// sampled and col = fx * x / z + cx, row = fy * y / z + cy is solved by least
+// squares. Returns false if there are too few valid pixels, or if the fit has
+// a non-positive focal length or is off by more than half a pixel at any of
+// the sampled pixels.
+template <typename PointT>
+bool EstimateIntrinsics(const pcl::PointCloud<PointT>& cloud,
+                        CameraIntrinsics* intrinsics);
+
+// Computes the window of pixels that a box projects to. The box is given by
+// its pose in the camera frame and its min/max corners in the box frame.
+// Returns false if the box is partly behind the camera, in which case the
+// whole image should be used.
+bool ProjectBox(const CameraIntrinsics& intrinsics, const int width,
+                const int height, const Eigen::Affine3f& box_in_camera,
+                const Eigen::Vector3f& min_pt, const Eigen::Vector3f& max_pt,
+                PixelWindow* window);
+
+// Crops an organized cloud in the camera frame to a box, and transforms the
+// points inside the box into the base frame.
+//
+// The box is given by its pose in the base frame and its min/max corners in
+// the box frame. Only the pixels that the box projects to are visited, and NaN
+// pixels are skipped, so the cost scales with the size of the box in the image
+// rather than the size of the image. The output is unorganized.
+//
+// Returns false if the cloud is not organized or its intrinsics can't be
+// estimated, in which case the output is not set and the caller should crop
+// the whole cloud instead. Instantiated for pcl::PointXYZRGB and pcl::PointXYZ.
+template <typename PointT>
+bool CropOrganized(const pcl::PointCloud<PointT>& cloud,
+                   const Eigen::Affine3f& camera_to_base,
+                   const Eigen::Affine3f& box_pose,
+                   const Eigen::Vector3f& min_pt,
+                   const Eigen::Vector3f& max_pt,
+                   pcl::PointCloud<PointT>* cropped);
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_ORGANIZED_CLOUD_H_
@@ -0,0 +1,115 @@
+#ifndef _OBJECT_SEARCH_PARALLEL_SEARCH_H_
+#define _OBJECT_SEARCH_PARALLEL_SEARCH_H_
+
+#include <vector>
+
+#include "boost/function.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "rapid_msgs/Roi3D.h"
+#include "rapid_perception/pose_estimation.h"
+#include "rapid_perception/pose_estimation_match.h"
+#include "rapid_perception/random_heat_mapper.h"
+
+#include "object_search/object_search.h"
+#include "object_search/search_progress.h"
+#include "object_search_msgs/Match.h"
+
+namespace object_search {
+// Searches several regions of a scene for the same object in parallel.
+//
+// PoseEstimator is not thread-safe, so each thread gets its own estimator and
+// heat mapper. Each region gets its own candidate budget, so that small regions
+// are not oversampled.
+//
+// Regions can also be loaded by the workers as they get to them, so that only
+// the regions being searched are held in memory at once.
+//
+// Usage:
+//  ParallelSearch search(4);
+//  search.set_object(object, roi);
+//  search.set_params(params);
+//  std::vector<PoseEstimationMatch> matches;
+//  search.Find(regions, budgets, &matches);
+class ParallelSearch {
+ public:
+  // Returns region i, or a null pointer if the region should be skipped. It is
+  // called on the worker threads, so it must be thread-safe.
+  typedef boost::function<pcl::PointCloud<pcl::PointXYZRGB>::Ptr(size_t i)>
+      RegionLoader;
+
+  explicit ParallelSearch(const int num_threads);
+  void set_num_threads(const int num_threads);
+  int num_threads() const;
+  void set_object(pcl::PointCloud<pcl::PointXYZRGB>::Ptr object,
+                  const rapid_msgs::Roi3D& roi);
+  // Parameters shared by all regions. max_samples and num_candidates are
+  // overridden by the per-region budgets passed to Find.
+  void set_params(const EstimatorParams& params);
+  // If progress is not NULL, each region's candidates are reported to it, and
+  // regions that haven't started are skipped once it is cancelled.
+  void set_progress(SearchProgress* progress);
+  // If the regions overlap, the same object may be found in several of them.
+  // With a radius greater than 0, matches within the radius of a better match
+  // from any region are dropped. 0 by default.
+  void set_nms_radius(const double radius);
+
+  // Searches each region for the object. num_samples[i] is the candidate
+  // budget for regions[i]. The matches from all regions are returned sorted by
+  // fitness, keeping those under the fitness threshold plus enough others to
+  // make min_results.
+  void Find(const std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr>& regions,
+            const std::vector<int>& num_samples,
+            std::vector<rapid::perception::PoseEstimationMatch>* matches);
+  // Same as above, but each region is loaded when a worker gets to it, and
+  // dropped once it has been searched. Regions with no samples aren't loaded.
+  void Find(const size_t num_regions, const RegionLoader& load,
+            const std::vector<int>& num_samples,
+            std::vector<rapid::perception::PoseEstimationMatch>* matches);
+
+ private:
+  void Worker(const int thread_index);
+
+  std::vector<boost::shared_ptr<rapid::perception::RandomHeatMapper> >
+      heat_mappers_;
+  std::vector<boost::shared_ptr<rapid::perception::PoseEstimator> >
+      estimators_;
+  pcl::PointCloud<pcl::PointXYZRGB>::Ptr object_;
+  rapid_msgs::Roi3D roi_;
+  EstimatorParams params_;
+  SearchProgress* progress_;
+  double nms_radius_;
+
+  // State shared with the workers during a call to Find.
+  boost::mutex mutex_;
+  size_t num_regions_;
+  RegionLoader load_;
+  const std::vector<int>* num_samples_;
+  size_t next_region_;
+  std::vector<rapid::perception::PoseEstimationMatch> results_;
+};
+
+// Returns the number of candidates to sample in each region. Each region gets
+// min_samples, and the rest of total_samples is split in proportion to the
+// number of points in each region. If there are too many regions to give each
+// of them min_samples, the minimum is lowered so that the total is kept.
+void SplitSampleBudget(
+    const std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr>& regions,
+    const int total_samples, const int min_samples,
+    std::vector<int>* num_samples);
+void SplitSampleBudget(const std::vector<int>& num_points,
+                       const int total_samples, const int min_samples,
+                       std::vector<int>* num_samples);
+
+// Drops matches whose positions are within radius of a better match. The
+// matches must be sorted by fitness, best first.
+void SuppressNonMaxima(
+    const double radius,
+    std::vector<rapid::perception::PoseEstimationMatch>* matches);
+void SuppressNonMaxima(const double radius,
+                       std::vector<object_search_msgs::Match>* matches);
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_PARALLEL_SEARCH_H_
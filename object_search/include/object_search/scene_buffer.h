@@ -0,0 +1,127 @@
+#ifndef _OBJECT_SEARCH_SCENE_BUFFER_H_
+#define _OBJECT_SEARCH_SCENE_BUFFER_H_
+
+#include <deque>
+#include <string>
+#include <utility>
+
+#include "Eigen/Core"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/condition_variable.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread.hpp"
+#include "geometry_msgs/Transform.h"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "ros/ros.h"
+#include "sensor_msgs/CameraInfo.h"
+#include "sensor_msgs/Image.h"
+#include "sensor_msgs/PointCloud2.h"
+#include "tf/transform_listener.h"
+
+namespace object_search {
+// A scene, along with whatever preprocessing has been done on it.
+struct PreparedScene {
+  PreparedScene();
+
+  // Returns cropped voxelized with the given leaf size. Leaf sizes other than
+  // leaf_size are voxelized on first use, and the last few are kept, so that
+  // repeated searches for objects with different leaf sizes don't voxelize the
+  // scene each time. Thread-safe. cropped must be set.
+  pcl::PointCloud<pcl::PointXYZRGB>::Ptr DownsampledAt(
+      const double leaf_size) const;
+
+  sensor_msgs::PointCloud2::ConstPtr cloud;  // Raw cloud, in the camera frame.
+  // Instead of a cloud, the scene may be given as a depth image with an
+  // optional registered color image. Null if cloud is set.
+  sensor_msgs::Image::ConstPtr depth;
+  sensor_msgs::Image::ConstPtr rgb;  // May be null.
+  sensor_msgs::CameraInfo::ConstPtr camera_info;
+  std::string parent_frame_id;  // The base frame.
+  geometry_msgs::Transform base_to_camera;
+
+  // The scene in the base frame, cropped to the crop box. Null if the scene
+  // has not been preprocessed.
+  pcl::PointCloud<pcl::PointXYZRGB>::Ptr cropped;
+  // The cropped scene, voxelized with leaf_size. Null if not voxelized.
+  pcl::PointCloud<pcl::PointXYZRGB>::Ptr downsampled;
+  double leaf_size;
+  // The crop box that cropped was cropped to, in the base frame.
+  Eigen::Vector3f crop_min;
+  Eigen::Vector3f crop_max;
+
+  // Voxelizations made by DownsampledAt, oldest first.
+  mutable boost::mutex resampled_mutex;
+  mutable std::deque<
+      std::pair<double, pcl::PointCloud<pcl::PointXYZRGB>::Ptr> >
+      resampled;
+};
+
+// Keeps a persistent subscription to a point cloud topic and preprocesses the
+// newest frame on a background thread.
+//
+// Each frame is transformed into the base frame, cropped, and voxelized. The
+// result is published into a double buffer, so readers always get the newest
+// fully prepared scene without waiting, and frames that arrive while the
+// previous one is being processed are dropped in favor of the newest.
+//
+// Usage:
+//  SceneBuffer buffer(nh, "cloud_in", "base_link");
+//  buffer.Start();
+//  boost::shared_ptr<const PreparedScene> scene =
+//      buffer.Latest(ros::Duration(10), ros::Duration(2));
+class SceneBuffer {
+ public:
+  SceneBuffer(const ros::NodeHandle& nh, const std::string& topic,
+              const std::string& base_frame);
+  ~SceneBuffer();
+  void Start();
+  void Stop();
+
+  void set_crop_box(const Eigen::Vector3f& min_pt,
+                    const Eigen::Vector3f& max_pt);
+  void set_leaf_size(double leaf_size);
+  void set_use_organized(bool use_organized);
+
+  // Returns the newest prepared scene, waiting up to timeout for one that was
+  // captured no more than max_age ago. A zero max_age accepts any scene.
+  // Returns a null pointer on timeout, so a stalled camera is reported rather
+  // than searched with an old frame.
+  boost::shared_ptr<const PreparedScene> Latest(const ros::Duration& timeout,
+                                                const ros::Duration& max_age);
+
+ private:
+  void Callback(const sensor_msgs::PointCloud2::ConstPtr& cloud);
+  void ProcessLoop();
+  bool Prepare(const sensor_msgs::PointCloud2::ConstPtr& cloud,
+               PreparedScene* scene);
+
+  ros::NodeHandle nh_;
+  std::string topic_;
+  std::string base_frame_;
+  ros::Subscriber sub_;
+  tf::TransformListener tf_listener_;
+  boost::thread thread_;
+  bool running_;
+
+  // Preprocessing settings, guarded by settings_mutex_.
+  boost::mutex settings_mutex_;
+  Eigen::Vector3f min_pt_;
+  Eigen::Vector3f max_pt_;
+  double leaf_size_;
+  bool use_organized_;
+
+  // Newest unprocessed frame, guarded by pending_mutex_.
+  boost::mutex pending_mutex_;
+  boost::condition_variable pending_cond_;
+  sensor_msgs::PointCloud2::ConstPtr pending_;
+
+  // Front buffer, guarded by ready_mutex_. The back buffer is owned by the
+  // processing thread until it is swapped in.
+  boost::mutex ready_mutex_;
+  boost::condition_variable ready_cond_;
+  boost::shared_ptr<const PreparedScene> ready_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SCENE_BUFFER_H_
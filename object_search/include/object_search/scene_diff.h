@@ -0,0 +1,83 @@
+#ifndef _OBJECT_SEARCH_SCENE_DIFF_H_
+#define _OBJECT_SEARCH_SCENE_DIFF_H_
+
+#include <vector>
+
+#include "Eigen/Core"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+
+namespace object_search {
+// An axis-aligned box of changed space, in the frame of the compared clouds.
+struct ChangedRegion {
+  ChangedRegion();
+
+  bool Contains(const Eigen::Vector3f& point) const;
+
+  Eigen::Vector3f min_pt;
+  Eigen::Vector3f max_pt;
+  int num_voxels;  // Number of changed voxels in the region.
+};
+
+// Finds where a scene has changed since a reference scene was captured.
+//
+// Both clouds are voxelized, and a voxel is occupied if it has at least
+// min_points points, which keeps single noisy points from counting as
+// changes. Voxels that are occupied in only one of the clouds are changed.
+// Changed voxels that touch (including diagonally) are grouped into one
+// region, and regions with fewer than min_voxels voxels are dropped as noise.
+//
+// The clouds must be in the same fixed frame, e.g., the robot's base frame
+// for a robot that hasn't moved. If the viewpoint changed, most of the scene
+// will appear changed.
+//
+// Usage:
+//  SceneDiff diff;
+//  diff.set_leaf_size(0.01);
+//  std::vector<ChangedRegion> regions;
+//  diff.Compare(*reference, *current, &regions);
+//  if (diff.changed_ratio() < 0.5) {
+//    GrowRegions(object_size, &regions);
+//    // Search only inside the regions.
+//  }
+class SceneDiff {
+ public:
+  SceneDiff();
+  void set_leaf_size(const double leaf_size);
+  void set_min_points(const int min_points);
+  void set_min_voxels(const int min_voxels);
+
+  void Compare(const pcl::PointCloud<pcl::PointXYZRGB>& reference,
+               const pcl::PointCloud<pcl::PointXYZRGB>& current,
+               std::vector<ChangedRegion>* regions);
+
+  // Statistics for the last call to Compare. The changed ratio is the number
+  // of changed voxels over the number of voxels occupied in either cloud.
+  int num_changed_voxels() const;
+  double changed_ratio() const;
+
+ private:
+  double leaf_size_;
+  int min_points_;
+  int min_voxels_;
+  int num_changed_voxels_;
+  double changed_ratio_;
+};
+
+// Grows each region by margin on each side, then merges regions that overlap,
+// so that no point is searched twice.
+void GrowRegions(const double margin, std::vector<ChangedRegion>* regions);
+
+// Returns true if the point is inside any of the regions.
+bool InAnyRegion(const Eigen::Vector3f& point,
+                 const std::vector<ChangedRegion>& regions);
+
+// Splits off the points of the cloud inside each region. The regions should
+// not overlap.
+void CropToRegions(
+    const pcl::PointCloud<pcl::PointXYZRGB>& cloud,
+    const std::vector<ChangedRegion>& regions,
+    std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr>* cropped);
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SCENE_DIFF_H_
@@ -0,0 +1,83 @@
+#ifndef _OBJECT_SEARCH_SCENE_OCTREE_H_
+#define _OBJECT_SEARCH_SCENE_OCTREE_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "Eigen/Core"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "rapid_db/name_db.hpp"
+#include "sensor_msgs/PointCloud2.h"
+
+namespace object_search {
+// Options for writing a scene octree.
+struct SceneOctreeOptions {
+  SceneOctreeOptions();
+
+  int max_leaf_points;  // Nodes with more points than this are split.
+  int max_depth;
+};
+
+// Writes a scene to a file as an octree, for opening with SceneOctree. The
+// file's directory is created if it doesn't exist. Returns false if the file
+// could not be written. Leaf nodes hold the scene's points at full resolution.
+bool WriteSceneOctree(const pcl::PointCloud<pcl::PointXYZRGB>& scene,
+                      const SceneOctreeOptions& options,
+                      const std::string& path);
+
+// Returns the path of the octree file for the named scene in the given
+// directory. Characters that can't be in a file name are replaced.
+std::string SceneOctreePath(const std::string& dir, const std::string& name);
+
+// Returns the octree file for the named scene in the scene_octree_dir param,
+// or "" if the param is not set.
+std::string SceneOctreePathParam(const std::string& name);
+
+// Gets the named scene's cloud. If the scene was also saved as an octree, all
+// of its points are read from the file at full resolution, instead of
+// fetching the whole cloud message from the database. The cloud is then
+// unorganized and has no NaN points. Otherwise the cloud is read from
+// cloud_db. Returns false if the scene was not found.
+bool GetSceneCloud(rapid::db::NameDb* cloud_db, const std::string& name,
+                   sensor_msgs::PointCloud2* cloud);
+
+// A scene octree file, memory-mapped for reading.
+//
+// Opening a scene only maps the file, and a query only touches the nodes that
+// intersect its box. So a small crop of a large scene is cheap, and the OS
+// pages in only what is read.
+//
+// Usage:
+//  SceneOctree octree;
+//  if (octree.Open(path)) {
+//    PointCloudC::Ptr cropped(new PointCloudC);
+//    octree.Query(min_pt, max_pt, cropped.get());
+//  }
+class SceneOctree {
+ public:
+  SceneOctree();
+  ~SceneOctree();
+
+  // Returns false if the file doesn't exist or isn't a scene octree.
+  bool Open(const std::string& path);
+  void Close();
+  bool is_open() const;
+  uint64_t num_points() const;
+
+  // Gets the points inside the box. Returns the number of nodes read.
+  int Query(const Eigen::Vector3f& min_pt, const Eigen::Vector3f& max_pt,
+            pcl::PointCloud<pcl::PointXYZRGB>* cloud) const;
+
+ private:
+  SceneOctree(const SceneOctree&);
+  SceneOctree& operator=(const SceneOctree&);
+
+  int fd_;
+  char* data_;
+  size_t size_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SCENE_OCTREE_H_
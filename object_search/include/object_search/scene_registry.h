@@ -0,0 +1,58 @@
+#ifndef _OBJECT_SEARCH_SCENE_REGISTRY_H_
+#define _OBJECT_SEARCH_SCENE_REGISTRY_H_
+
+#include <map>
+#include <string>
+
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "ros/ros.h"
+
+#include "object_search/scene_buffer.h"
+
+namespace object_search {
+// Thread-safe store of prepared scenes that clients have uploaded once and
+// search by handle.
+//
+// Each scene expires once it hasn't been looked up for its TTL. Expired scenes
+// are dropped lazily, on the next call. At most max_scenes are kept, and the
+// scene closest to expiring is dropped to make room for a new one.
+//
+// Usage:
+//  SceneRegistry registry(8);
+//  std::string handle = registry.Register(scene, ros::WallDuration(60));
+//  boost::shared_ptr<const PreparedScene> scene = registry.Find(handle);
+class SceneRegistry {
+ public:
+  explicit SceneRegistry(const int max_scenes);
+
+  // Returns the handle of the new scene.
+  std::string Register(const boost::shared_ptr<const PreparedScene>& scene,
+                       const ros::WallDuration& ttl);
+  // Returns a null pointer if the handle is unknown or expired. Otherwise,
+  // the scene's TTL starts over.
+  boost::shared_ptr<const PreparedScene> Find(const std::string& handle);
+  // Returns false if the handle is unknown or expired.
+  bool Release(const std::string& handle);
+  size_t size();
+  // Takes effect on the next Register.
+  void set_max_scenes(const int max_scenes);
+
+ private:
+  struct Entry {
+    boost::shared_ptr<const PreparedScene> scene;
+    ros::WallDuration ttl;
+    ros::WallTime expires;
+  };
+  typedef std::map<std::string, Entry> EntryMap;
+
+  void RemoveExpired(const ros::WallTime& now);
+
+  int max_scenes_;
+  boost::mutex mutex_;
+  EntryMap entries_;
+  int next_id_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SCENE_REGISTRY_H_
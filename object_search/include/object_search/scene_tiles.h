@@ -0,0 +1,75 @@
+#ifndef _OBJECT_SEARCH_SCENE_TILES_H_
+#define _OBJECT_SEARCH_SCENE_TILES_H_
+
+#include <utility>
+#include <vector>
+
+#include "Eigen/Core"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+
+namespace object_search {
+// Partitions a scene into tiles on a grid in the xy plane, for searching
+// scenes that are too large to voxelize or search at once. Each tile is
+// tile_size on a side, and is grown by overlap on each side, so that an object
+// up to overlap in size is entirely inside at least one tile. Tiles span the
+// scene's full height. Tiles with no points are omitted.
+//
+// The scene's point indices are sorted by grid cell once, and a tile's points
+// are only gathered from the nearby cells when it is extracted. This way the
+// scene isn't copied several times over in the overlaps, and only the tiles
+// being searched are held in memory. The scene must outlive the tiles.
+// Extract may be called from several threads at once.
+//
+// Usage:
+//  SceneTiles tiles(scene, tile_size, overlap);
+//  for (size_t i = 0; i < tiles.size(); ++i) {
+//    PointCloudC::Ptr tile(new PointCloudC);
+//    tiles.Extract(i, tile.get());
+//  }
+class SceneTiles {
+ public:
+  SceneTiles(const pcl::PointCloud<pcl::PointXYZRGB>& scene,
+             const double tile_size, const double overlap);
+
+  // The number of tiles with points in them.
+  size_t size() const;
+  // The number of points in tile i, including its overlap.
+  int num_points(const size_t i) const;
+  // The number of points in each tile.
+  std::vector<int> num_points() const;
+  // The bounding box of the points in tile i, including its overlap. Lets
+  // tiles be skipped without extracting them.
+  void Bounds(const size_t i, Eigen::Vector3f* min_pt,
+              Eigen::Vector3f* max_pt) const;
+  // Copies the points of tile i into tile.
+  void Extract(const size_t i, pcl::PointCloud<pcl::PointXYZRGB>* tile) const;
+
+ private:
+  // Returns true if the point is inside the tile at grid position (tx, ty),
+  // including its overlap.
+  bool InTile(const pcl::PointXYZRGB& pt, const int tx, const int ty) const;
+
+  const pcl::PointCloud<pcl::PointXYZRGB>& scene_;
+  double tile_size_;
+  double overlap_;
+  // A point can only be in tiles within this many cells of its own.
+  int reach_;
+  // The grid cells spanned by the scene's finite points.
+  int min_cell_x_;
+  int min_cell_y_;
+  int num_cells_x_;
+  int num_cells_y_;
+  // The scene indices of the points in cell c are
+  // cell_points_[cell_start_[c]] to cell_points_[cell_start_[c + 1] - 1].
+  std::vector<int> cell_start_;
+  std::vector<int> cell_points_;
+  // The grid position, point count and bounding box of each non-empty tile.
+  std::vector<std::pair<int, int> > tiles_;
+  std::vector<int> tile_points_;
+  std::vector<Eigen::Vector3f> tile_min_;
+  std::vector<Eigen::Vector3f> tile_max_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SCENE_TILES_H_
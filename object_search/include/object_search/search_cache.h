@@ -0,0 +1,77 @@
+#ifndef _OBJECT_SEARCH_SEARCH_CACHE_H_
+#define _OBJECT_SEARCH_SEARCH_CACHE_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "boost/thread/mutex.hpp"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "ros/ros.h"
+
+#include "object_search_msgs/Match.h"
+
+namespace object_search {
+// Hashes which voxels of the given size contain at least one point. The hash
+// doesn't depend on the order of the points or on where in each voxel they
+// are, so two captures of an unchanged scene usually hash the same, as long as
+// sensor noise doesn't move points across voxel boundaries.
+uint64_t HashVoxelOccupancy(const pcl::PointCloud<pcl::PointXYZRGB>& cloud,
+                            const double leaf_size);
+
+// Thread-safe cache of search results, keyed by a description of the scene,
+// the object, and the search parameters.
+//
+// Results expire ttl after they were computed, and are dropped lazily. When
+// the cache is full, the oldest result is dropped to make room.
+//
+// Usage:
+//  SearchCache cache;
+//  cache.set_ttl(ros::WallDuration(10));
+//  if (!cache.Find(key, &matches)) {
+//    Search(..., &matches);
+//    cache.Insert(key, matches);
+//  }
+class SearchCache {
+ public:
+  SearchCache();
+
+  // Returns false if there is no unexpired result for the key.
+  bool Find(const std::string& key,
+            std::vector<object_search_msgs::Match>* matches);
+  void Insert(const std::string& key,
+              const std::vector<object_search_msgs::Match>& matches);
+  void Clear();
+  size_t size();
+
+  void set_ttl(const ros::WallDuration& ttl);
+  void set_max_entries(const int max_entries);
+
+  // Statistics since the cache was created.
+  int num_hits();
+  int num_misses();
+  int num_expired();  // Misses due to an expired result.
+
+ private:
+  struct Entry {
+    std::vector<object_search_msgs::Match> matches;
+    ros::WallTime created;
+  };
+  typedef std::map<std::string, Entry> EntryMap;
+
+  void RemoveExpired(const ros::WallTime& now);
+
+  boost::mutex mutex_;
+  EntryMap entries_;
+  ros::WallDuration ttl_;
+  int max_entries_;
+  int num_hits_;
+  int num_misses_;
+  int num_expired_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SEARCH_CACHE_H_
@@ -0,0 +1,57 @@
+#ifndef _OBJECT_SEARCH_SEARCH_PROGRESS_H_
+#define _OBJECT_SEARCH_SEARCH_PROGRESS_H_
+
+#include <string>
+
+#include "boost/function.hpp"
+#include "boost/thread/mutex.hpp"
+
+namespace object_search {
+// Tracks the progress of one search and lets it be cancelled. Thread-safe, so
+// that parallel workers can report to it and another thread can cancel it.
+//
+// The search checks cancelled() between steps, such as pipeline stages and
+// tabletop clusters. A PoseEstimator call that is already running is not
+// interrupted, so cancellation takes effect at the next step.
+//
+// Usage:
+//  SearchProgress progress(boost::bind(&PublishFeedback, _1, _2, _3));
+//  progress.SetStage("estimating");
+//  progress.AddCandidates(num_samples, best_fitness);
+//  if (progress.cancelled()) {
+//    return;
+//  }
+class SearchProgress {
+ public:
+  // Called with the current stage, the number of candidates evaluated so
+  // far, and the best fitness so far (-1 if there are no matches yet). It is
+  // called on whichever thread made the update.
+  typedef boost::function<void(const std::string& stage, int candidates,
+                               double best_fitness)>
+      Callback;
+
+  SearchProgress();
+  explicit SearchProgress(const Callback& callback);
+
+  void SetStage(const std::string& stage);
+  // Records that num_candidates more candidates were evaluated, the best of
+  // which had the given fitness (-1 if none matched).
+  void AddCandidates(const int num_candidates, const double best_fitness);
+
+  void Cancel();
+  bool cancelled();
+
+ private:
+  void Notify(const std::string& stage, const int candidates,
+              const double best_fitness);
+
+  Callback callback_;
+  boost::mutex mutex_;
+  std::string stage_;
+  int candidates_;
+  double best_fitness_;
+  bool cancelled_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SEARCH_PROGRESS_H_
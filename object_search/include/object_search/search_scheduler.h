@@ -0,0 +1,98 @@
+#ifndef _OBJECT_SEARCH_SEARCH_SCHEDULER_H_
+#define _OBJECT_SEARCH_SEARCH_SCHEDULER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "boost/function.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/condition_variable.hpp"
+#include "boost/thread/mutex.hpp"
+
+#include "object_search_msgs/Match.h"
+
+namespace object_search {
+// Runs searches one at a time, highest priority first, on the threads of the
+// service calls that requested them.
+//
+// Requests with the same non-empty key are coalesced: a request whose key
+// matches one that is already queued or running waits for that search and
+// gets a copy of its matches. The waiting request's priority is given to the
+// queued one if it is higher. Requests with equal priority run in the order
+// they arrived. At most max_queued requests may wait, and further requests
+// are rejected right away rather than waiting behind a long queue.
+//
+// A request may also be given a cancellation check, which is polled while the
+// request waits in the queue. Once it returns true, the request leaves the
+// queue without running. Requests that can be cancelled should have an empty
+// key, or the requests that joined them would get no matches.
+//
+// Since requests wait on the calling thread, the services must be served by
+// more spinner threads than max_queued, or requests will queue up inside ROS
+// instead, where they can't be prioritized or rejected.
+//
+// Usage:
+//  SearchScheduler scheduler(8);
+//  if (!scheduler.Run(key, priority, boost::bind(&Search, ..., _1),
+//                     SearchScheduler::Cancelled(), &matches)) {
+//    // Rejected.
+//  }
+class SearchScheduler {
+ public:
+  typedef boost::function<void(std::vector<object_search_msgs::Match>*)>
+      Work;
+  typedef boost::function<bool()> Cancelled;
+
+  explicit SearchScheduler(const int max_queued);
+
+  // Returns false if the request was rejected because the queue was full. If
+  // cancelled is not empty and returns true while the request is queued, the
+  // work is not run, and Run returns true with no matches.
+  bool Run(const std::string& key, const int priority, const Work& work,
+           const Cancelled& cancelled,
+           std::vector<object_search_msgs::Match>* matches);
+
+  // Statistics since the scheduler was created.
+  int num_run();
+  int num_coalesced();
+  int num_rejected();
+  int num_cancelled();
+
+ private:
+  struct Request {
+    Request();
+
+    std::string key;
+    int priority;
+    int sequence;
+    bool done;
+    std::vector<object_search_msgs::Match> matches;
+  };
+
+  // Returns the queued request that should run next. The queue must not be
+  // empty.
+  boost::shared_ptr<Request> Next() const;
+  // Marks the running request as done and wakes the requests waiting on it.
+  // Must be called with mutex_ held.
+  void Finish(const boost::shared_ptr<Request>& request);
+  // Removes a cancelled request from the queue. Must be called with mutex_
+  // held.
+  void Drop(const boost::shared_ptr<Request>& request);
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  int max_queued_;
+  std::vector<boost::shared_ptr<Request> > queue_;
+  // Queued and running requests, by key.
+  std::map<std::string, boost::shared_ptr<Request> > by_key_;
+  bool busy_;
+  int next_sequence_;
+  int num_run_;
+  int num_coalesced_;
+  int num_rejected_;
+  int num_cancelled_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SEARCH_SCHEDULER_H_
@@ -0,0 +1,94 @@
+#ifndef _OBJECT_SEARCH_SERVICE_CLIENT_POOL_H_
+#define _OBJECT_SEARCH_SERVICE_CLIENT_POOL_H_
+
+#include <string>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "boost/function.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/condition_variable.hpp"
+#include "boost/thread/mutex.hpp"
+#include "ros/ros.h"
+
+namespace object_search {
+// A small pool of persistent connections to one ROS service.
+//
+// Persistent connections skip the master lookup and TCP handshake on every
+// call, but a persistent ros::ServiceClient can't be shared by concurrent
+// callers, so each caller borrows a connection from the pool for the length
+// of its call. Dropped connections are reopened on the next call. Calls to
+// idempotent services are also retried once on a fresh connection if they
+// fail.
+//
+// Usage:
+//  boost::shared_ptr<ServiceClientPool> pool =
+//      ServiceClientPool::Create<static_cloud_db_msgs::GetStaticCloud>(
+//          nh, "get_static_cloud", 4, true);
+//  pool->Call(req, res);
+class ServiceClientPool {
+ public:
+  template <class Service>
+  static boost::shared_ptr<ServiceClientPool> Create(
+      const ros::NodeHandle& nh, const std::string& service, const int size,
+      const bool idempotent) {
+    boost::function<ros::ServiceClient()> connect =
+        boost::bind(&ServiceClientPool::Connect<Service>, nh, service);
+    return boost::shared_ptr<ServiceClientPool>(
+        new ServiceClientPool(connect, service, size, idempotent));
+  }
+
+  template <class Request, class Response>
+  bool Call(Request& req, Response& res) {
+    return Call(req, res, idempotent_);
+  }
+
+  // Like Call, but only retries if retry is true. For services that are only
+  // idempotent for some requests.
+  template <class Request, class Response>
+  bool Call(Request& req, Response& res, const bool retry) {
+    ros::ServiceClient client = Acquire();
+    if (!client.isValid()) {
+      client = connect_();
+    }
+    bool success = client.call(req, res);
+    if (!success) {
+      client.shutdown();
+      client = connect_();
+      if (retry) {
+        ROS_WARN("Call to %s failed, retrying on a new connection.",
+                 service_.c_str());
+        success = client.call(req, res);
+      }
+    }
+    Release(client);
+    return success;
+  }
+
+ private:
+  ServiceClientPool(const boost::function<ros::ServiceClient()>& connect,
+                    const std::string& service, const int size,
+                    const bool idempotent);
+
+  template <class Service>
+  static ros::ServiceClient Connect(ros::NodeHandle nh,
+                                    const std::string& service) {
+    return nh.serviceClient<Service>(service, true);
+  }
+
+  // Waits until a connection is free. The returned client may be invalid if
+  // it has not been opened yet.
+  ros::ServiceClient Acquire();
+  void Release(const ros::ServiceClient& client);
+
+  boost::function<ros::ServiceClient()> connect_;
+  std::string service_;
+  bool idempotent_;
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  std::vector<ros::ServiceClient> idle_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_SERVICE_CLIENT_POOL_H_
@@ -0,0 +1,91 @@
+#ifndef _OBJECT_SEARCH_TABLETOP_EXTRACTOR_H_
+#define _OBJECT_SEARCH_TABLETOP_EXTRACTOR_H_
+
+#include <vector>
+
+#include "Eigen/Core"
+#include "pcl/PointIndices.h"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+
+namespace object_search {
+// Extracts the clusters of points on top of a table.
+//
+// The first call runs rapid::perception::ParseScene and caches the plane of
+// the primary surface. Later calls check the cached plane against the new
+// cloud and refine it with a least-squares fit to its inliers. The full scene
+// parse is only re-run if the plane has lost too many inliers or moved by more
+// than the given tolerances, which happens when the robot or the table moves.
+//
+// Either way, the objects are found by clustering the points above the plane
+// with the same parameters, so the clusters don't depend on whether the plane
+// was cached. The parser's own objects are only used if no plane can be fit to
+// its surface. With the cache off, every call returns the parser's objects, as
+// ParseScene alone would.
+//
+// Clouds must be in a frame whose z axis points up, such as base_link. The
+// extractor is not thread-safe.
+//
+// Usage:
+//  TabletopExtractor extractor;
+//  std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> clusters;
+//  extractor.Extract(cloud, &clusters);
+class TabletopExtractor {
+ public:
+  TabletopExtractor();
+  // If false, every call does a full scene parse.
+  void set_use_cache(bool use_cache);
+  // Maximum change in the plane normal, in radians, before re-parsing.
+  void set_max_angle_change(double max_angle_change);
+  // Maximum change in the plane height, in meters, before re-parsing.
+  void set_max_offset_change(double max_offset_change);
+  // Minimum fraction of the cached plane's inliers that must still be present.
+  void set_min_inlier_ratio(double min_inlier_ratio);
+  // Maximum distance from the plane, in meters, of the plane's inliers. Points
+  // further above it may be part of an object.
+  void set_distance_threshold(double distance_threshold);
+  // Height above the table, in meters, to look for objects.
+  void set_max_object_height(double max_object_height);
+  // Distance between points, in meters, for them to be in the same cluster.
+  void set_cluster_tolerance(double cluster_tolerance);
+  // Clusters with fewer points than this are dropped.
+  void set_min_cluster_size(int min_cluster_size);
+
+  void Extract(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud,
+               std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr>* clusters);
+  // Forgets the cached plane.
+  void Reset();
+
+ private:
+  void ParseAndCache(
+      pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud,
+      std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr>* clusters);
+  bool FitPlane(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud,
+                pcl::PointCloud<pcl::PointXYZRGB>::Ptr surface);
+  bool Refine(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud,
+              pcl::PointIndices::Ptr inliers);
+  void ClusterAbovePlane(
+      pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud,
+      std::vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr>* clusters);
+  void UpdateTableBounds(const pcl::PointCloud<pcl::PointXYZRGB>& cloud,
+                         const std::vector<int>& inliers);
+
+  bool use_cache_;
+  double max_angle_change_;
+  double max_offset_change_;
+  double min_inlier_ratio_;
+  double distance_threshold_;  // Plane inlier distance.
+  double max_object_height_;   // Height above the table to look for objects.
+  double cluster_tolerance_;
+  int min_cluster_size_;
+
+  // Cached plane.
+  bool has_plane_;
+  Eigen::VectorXf plane_;  // ax + by + cz + d = 0, with the normal pointing up.
+  size_t num_inliers_;
+  Eigen::Vector3f table_min_;
+  Eigen::Vector3f table_max_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_TABLETOP_EXTRACTOR_H_
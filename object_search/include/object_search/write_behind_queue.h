@@ -0,0 +1,58 @@
+#ifndef _OBJECT_SEARCH_WRITE_BEHIND_QUEUE_H_
+#define _OBJECT_SEARCH_WRITE_BEHIND_QUEUE_H_
+
+#include <deque>
+#include <string>
+#include <utility>
+
+#include "boost/function.hpp"
+#include "boost/thread/condition_variable.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread.hpp"
+#include "ros/ros.h"
+
+namespace object_search {
+// Runs database writes in order on a background thread, so that the caller
+// doesn't wait for them.
+//
+// A write that fails is retried, waiting twice as long after each attempt, up
+// to max_attempts times, so writes must be safe to repeat unless max_attempts
+// is 1. If the write still fails, its give_up callback is run. Writes still
+// queued when the queue is destroyed are finished first.
+//
+// Usage:
+//  WriteBehindQueue writes("scenes", 5, ros::WallDuration(0.5));
+//  writes.Push(boost::bind(&InsertScene, name, cloud));
+class WriteBehindQueue {
+ public:
+  // A write returns true if it succeeded.
+  typedef boost::function<bool()> Write;
+  typedef boost::function<void()> GiveUp;
+
+  WriteBehindQueue(const std::string& name, const int max_attempts,
+                   const ros::WallDuration& retry_delay);
+  ~WriteBehindQueue();
+
+  void Push(const Write& write);
+  void Push(const Write& write, const GiveUp& give_up);
+  // Blocks until every queued write has finished or failed.
+  void Flush();
+  size_t num_pending();
+
+ private:
+  void Run();
+
+  std::string name_;
+  int max_attempts_;
+  ros::WallDuration retry_delay_;
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  std::deque<std::pair<Write, GiveUp> > writes_;
+  bool busy_;  // True while a write is in progress.
+  bool stopping_;
+  boost::thread thread_;
+};
+}  // namespace object_search
+
+#endif  // _OBJECT_SEARCH_WRITE_BEHIND_QUEUE_H_
@@ -1,34 +1,237 @@
 #include "object_search/cloud_database.h"
 
+#include <deque>
+#include <map>
+#include <set>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include "boost/bind.hpp"
+#include "boost/function.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/condition_variable.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread.hpp"
 #include "rapid_msgs/StaticCloud.h"
 #include "rapid_msgs/StaticCloudInfo.h"
 #include "static_cloud_db_msgs/GetStaticCloud.h"
+#include "static_cloud_db_msgs/GetStaticCloudInfo.h"
+#include "static_cloud_db_msgs/GetStaticClouds.h"
 #include "static_cloud_db_msgs/ListStaticClouds.h"
 #include "static_cloud_db_msgs/RemoveStaticCloud.h"
 #include "static_cloud_db_msgs/SaveStaticCloud.h"
 
 namespace object_search {
-Database::Database(const std::string& db, const std::string& collection,
-                   const ros::ServiceClient& get,
-                   const ros::ServiceClient& list,
-                   const ros::ServiceClient& remove,
-                   const ros::ServiceClient& save)
+// Clouds saved with SaveBehind, shared by all copies of a database.
+struct PendingSaves {
+  PendingSaves()
+      : mutex(), cond(), next_id(0), clouds(), saved_ids(), failed_ids() {}
+
+  boost::mutex mutex;
+  boost::condition_variable cond;  // Notified when a write finishes or fails.
+  int next_id;
+  // Clouds that haven't been written yet, by provisional ID.
+  std::map<std::string, rapid_msgs::StaticCloud> clouds;
+  // Database IDs of the clouds that have been written, by provisional ID.
+  std::map<std::string, std::string> saved_ids;
+  // Provisional IDs of the clouds that couldn't be written.
+  std::set<std::string> failed_ids;
+};
+
+// Runs the Async calls on a fixed number of threads, shared by all copies of a
+// database.
+struct AsyncCalls {
+  explicit AsyncCalls(const int num_threads);
+  ~AsyncCalls();
+  void Push(const boost::function<void()>& call);
+  void Run();
+
+  boost::mutex mutex;
+  boost::condition_variable cond;
+  std::deque<boost::function<void()> > calls;
+  bool stopping;
+  boost::thread_group threads;
+};
+
+AsyncCalls::AsyncCalls(const int num_threads)
+    : mutex(), cond(), calls(), stopping(false), threads() {
+  for (int i = 0; i < num_threads; ++i) {
+    threads.create_thread(boost::bind(&AsyncCalls::Run, this));
+  }
+}
+
+AsyncCalls::~AsyncCalls() {
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    if (!calls.empty()) {
+      ROS_WARN("Dropping %d queued database calls",
+               static_cast<int>(calls.size()));
+    }
+    calls.clear();
+    stopping = true;
+  }
+  cond.notify_all();
+  threads.join_all();
+}
+
+void AsyncCalls::Push(const boost::function<void()>& call) {
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    calls.push_back(call);
+  }
+  cond.notify_one();
+}
+
+void AsyncCalls::Run() {
+  while (true) {
+    boost::function<void()> call;
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      while (calls.empty() && !stopping) {
+        cond.wait(lock);
+      }
+      if (stopping) {
+        return;
+      }
+      call = calls.front();
+      calls.pop_front();
+    }
+    call();
+  }
+}
+
+namespace {
+// Enough connections for each of the node's spinner threads. The Async calls
+// run on as many threads.
+const int kPoolSize = 4;
+// Saves aren't idempotent, and a save whose call failed may still have been
+// written, so a retry could insert the cloud twice. Like Save, SaveBehind
+// makes one attempt.
+const int kMaxSaveAttempts = 1;
+
+std::string CallSave(ServiceClientPool* save, const std::string& db,
+                     const std::string& collection,
+                     const rapid_msgs::StaticCloud& cloud) {
+  static_cloud_db_msgs::SaveStaticCloudRequest req;
+  req.collection.db = db;
+  req.collection.collection = collection;
+  req.cloud = cloud;
+  static_cloud_db_msgs::SaveStaticCloudResponse res;
+  bool success = save->Call(req, res);
+  if (!success) {
+    ROS_ERROR("Save call failed.");
+  }
+  return res.id;
+}
+
+// Writes a cloud saved with SaveBehind. This doesn't hold a copy of the
+// database, since the database owns the queue that runs it.
+bool SaveInBackground(boost::shared_ptr<ServiceClientPool> save,
+                      const std::string& db, const std::string& collection,
+                      boost::shared_ptr<PendingSaves> pending,
+                      const std::string& provisional_id) {
+  rapid_msgs::StaticCloud cloud;
+  {
+    boost::mutex::scoped_lock lock(pending->mutex);
+    std::map<std::string, rapid_msgs::StaticCloud>::const_iterator it =
+        pending->clouds.find(provisional_id);
+    if (it == pending->clouds.end()) {
+      return false;
+    }
+    cloud = it->second;
+  }
+  std::string id = CallSave(save.get(), db, collection, cloud);
+  if (id == "") {
+    return false;
+  }
+  {
+    boost::mutex::scoped_lock lock(pending->mutex);
+    pending->clouds.erase(provisional_id);
+    pending->saved_ids[provisional_id] = id;
+  }
+  pending->cond.notify_all();
+  ROS_INFO("Saved %s as %s", provisional_id.c_str(), id.c_str());
+  return true;
+}
+
+// Drops a cloud whose write has failed for good.
+void SaveFailed(boost::shared_ptr<PendingSaves> pending,
+                const std::string& provisional_id) {
+  {
+    boost::mutex::scoped_lock lock(pending->mutex);
+    std::map<std::string, rapid_msgs::StaticCloud>::iterator it =
+        pending->clouds.find(provisional_id);
+    if (it != pending->clouds.end()) {
+      ROS_ERROR("Failed to save %s, it has been discarded",
+                it->second.name.c_str());
+      pending->clouds.erase(it);
+    }
+    pending->failed_ids.insert(provisional_id);
+  }
+  pending->cond.notify_all();
+}
+
+// Each background call works on its own detached copy of the database, so it
+// remains valid even if the caller's copy goes away.
+void GetInBackground(Database db, const std::string& key, const bool by_id,
+                     const double leaf_size,
+                     const Database::GetCallback& done) {
+  rapid_msgs::StaticCloud cloud;
+  std::string id;
+  bool success = by_id ? db.GetById(key, leaf_size, &cloud, &id)
+                       : db.Get(key, leaf_size, &cloud, &id);
+  done(success, id, cloud);
+}
+
+void ListInBackground(Database db, const Database::ListCallback& done) {
+  std::vector<rapid_msgs::StaticCloudInfo> clouds;
+  db.List(&clouds);
+  done(clouds);
+}
+}  // namespace
+
+Database::Database(const ros::NodeHandle& nh, const std::string& db,
+                   const std::string& collection)
     : db_(db),
       collection_(collection),
-      get_(get),
-      list_(list),
-      remove_(remove),
-      save_(save) {}
+      get_(ServiceClientPool::Create<static_cloud_db_msgs::GetStaticCloud>(
+          nh, "get_static_cloud", kPoolSize, true)),
+      get_many_(
+          ServiceClientPool::Create<static_cloud_db_msgs::GetStaticClouds>(
+              nh, "get_static_clouds", kPoolSize, true)),
+      get_info_(
+          ServiceClientPool::Create<static_cloud_db_msgs::GetStaticCloudInfo>(
+              nh, "get_static_cloud_info", kPoolSize, true)),
+      list_(ServiceClientPool::Create<static_cloud_db_msgs::ListStaticClouds>(
+          nh, "list_static_clouds", kPoolSize, true)),
+      remove_(
+          ServiceClientPool::Create<static_cloud_db_msgs::RemoveStaticCloud>(
+              nh, "remove_static_cloud", kPoolSize, true)),
+      save_(ServiceClientPool::Create<static_cloud_db_msgs::SaveStaticCloud>(
+          nh, "save_static_cloud", kPoolSize, false)),
+      pending_(new PendingSaves),
+      writes_(new WriteBehindQueue(collection, kMaxSaveAttempts,
+                                   ros::WallDuration(0))),
+      async_(new AsyncCalls(kPoolSize)) {}
 
 bool Database::Get(const std::string& name, rapid_msgs::StaticCloud* cloud) {
+  return Get(name, 0, cloud, NULL);
+}
+
+bool Database::GetById(const std::string& id, rapid_msgs::StaticCloud* cloud) {
+  return GetById(id, 0, cloud, NULL);
+}
+
+bool Database::Get(const std::string& name, const double leaf_size,
+                   rapid_msgs::StaticCloud* cloud, std::string* cloud_id) {
   static_cloud_db_msgs::GetStaticCloudRequest req;
   req.collection.db = db_;
   req.collection.collection = collection_;
   req.name = name;
+  req.leaf_size = leaf_size;
   static_cloud_db_msgs::GetStaticCloudResponse res;
-  bool success = get_.call(req, res);
+  bool success = get_->Call(req, res);
   if (!success) {
     ROS_ERROR("Get call failed.");
     return false;
@@ -38,18 +241,32 @@ bool Database::Get(const std::string& name, rapid_msgs::StaticCloud* cloud) {
     return false;
   }
   *cloud = res.cloud;
+  if (cloud_id != NULL) {
+    *cloud_id = res.id;
+  }
   return true;
 }
 
-bool Database::GetById(const std::string& id, rapid_msgs::StaticCloud* cloud) {
+bool Database::GetById(const std::string& id, const double leaf_size,
+                       rapid_msgs::StaticCloud* cloud, std::string* cloud_id) {
+  std::string db_id(id);
+  const bool pending = FindPending(&db_id, cloud);
+  if (cloud_id != NULL) {
+    *cloud_id = db_id;
+  }
+  if (pending) {
+    return true;
+  }
   static_cloud_db_msgs::GetStaticCloudRequest req;
   req.collection.db = db_;
   req.collection.collection = collection_;
-  req.id = id;
+  req.id = db_id;
+  req.leaf_size = leaf_size;
   static_cloud_db_msgs::GetStaticCloudResponse res;
-  bool success = get_.call(req, res);
+  bool success = get_->Call(req, res);
   if (!success) {
     ROS_ERROR("Get call failed.");
+    return false;
   }
   if (res.error != "") {
     ROS_ERROR("%s", res.error.c_str());
@@ -59,27 +276,117 @@ bool Database::GetById(const std::string& id, rapid_msgs::StaticCloud* cloud) {
   return true;
 }
 
+bool Database::GetMany(const std::vector<std::string>& ids,
+                       const std::vector<std::string>& names,
+                       std::vector<rapid_msgs::StaticCloud>* clouds) {
+  static_cloud_db_msgs::GetStaticCloudsRequest req;
+  req.collection.db = db_;
+  req.collection.collection = collection_;
+  req.ids = ids;
+  req.names = names;
+  static_cloud_db_msgs::GetStaticCloudsResponse res;
+  bool success = get_many_->Call(req, res);
+  if (!success) {
+    ROS_ERROR("GetMany call failed.");
+    return false;
+  }
+  if (res.error != "") {
+    ROS_ERROR("%s", res.error.c_str());
+    return false;
+  }
+  *clouds = res.clouds;
+  return true;
+}
+
+bool Database::GetInfo(const std::string& name,
+                       static_cloud_db_msgs::StaticCloudMetadata* info) {
+  static_cloud_db_msgs::GetStaticCloudInfoRequest req;
+  req.collection.db = db_;
+  req.collection.collection = collection_;
+  req.name = name;
+  static_cloud_db_msgs::GetStaticCloudInfoResponse res;
+  bool success = get_info_->Call(req, res);
+  if (!success) {
+    ROS_ERROR("GetInfo call failed.");
+    return false;
+  }
+  if (res.error != "") {
+    ROS_ERROR("%s", res.error.c_str());
+    return false;
+  }
+  *info = res.info;
+  return true;
+}
+
+bool Database::GetInfoById(const std::string& id,
+                           static_cloud_db_msgs::StaticCloudMetadata* info) {
+  std::string db_id(id);
+  rapid_msgs::StaticCloud cloud;
+  if (FindPending(&db_id, &cloud)) {
+    info->id = id;
+    info->name = cloud.name;
+    info->parent_frame_id = cloud.parent_frame_id;
+    info->roi = cloud.roi;
+    info->point_count = cloud.cloud.width * cloud.cloud.height;
+    info->stamp = cloud.cloud.header.stamp;
+    return true;
+  }
+  static_cloud_db_msgs::GetStaticCloudInfoRequest req;
+  req.collection.db = db_;
+  req.collection.collection = collection_;
+  req.id = db_id;
+  static_cloud_db_msgs::GetStaticCloudInfoResponse res;
+  bool success = get_info_->Call(req, res);
+  if (!success) {
+    ROS_ERROR("GetInfo call failed.");
+    return false;
+  }
+  if (res.error != "") {
+    ROS_ERROR("%s", res.error.c_str());
+    return false;
+  }
+  *info = res.info;
+  return true;
+}
+
 void Database::List(std::vector<rapid_msgs::StaticCloudInfo>* clouds) {
   static_cloud_db_msgs::ListStaticCloudsRequest req;
   req.collection.db = db_;
   req.collection.collection = collection_;
   static_cloud_db_msgs::ListStaticCloudsResponse res;
-  bool success = list_.call(req, res);
+  bool success = list_->Call(req, res);
   if (!success) {
     ROS_ERROR("List call failed.");
   }
   *clouds = res.clouds;
 }
 
+void Database::GetAsync(const std::string& name, const double leaf_size,
+                        const GetCallback& done) {
+  async_->Push(
+      boost::bind(&GetInBackground, Detached(), name, false, leaf_size, done));
+}
+
+void Database::GetByIdAsync(const std::string& id, const double leaf_size,
+                            const GetCallback& done) {
+  async_->Push(
+      boost::bind(&GetInBackground, Detached(), id, true, leaf_size, done));
+}
+
+void Database::ListAsync(const ListCallback& done) {
+  async_->Push(boost::bind(&ListInBackground, Detached(), done));
+}
+
 bool Database::Remove(const std::string& name) {
   static_cloud_db_msgs::RemoveStaticCloudRequest req;
   req.collection.db = db_;
   req.collection.collection = collection_;
   req.name = name;
   static_cloud_db_msgs::RemoveStaticCloudResponse res;
-  bool success = remove_.call(req, res);
+  bool success = remove_->Call(req, res, false);
   if (!success) {
     ROS_ERROR("Remove call failed.");
+    return false;
   }
   if (res.error != "") {
     ROS_ERROR("%s", res.error.c_str());
@@ -88,16 +395,88 @@ bool Database::Remove(const std::string& name) {
   return true;
 }
 
-std::string Database::Save(const rapid_msgs::StaticCloud& cloud) {
-  static_cloud_db_msgs::SaveStaticCloudRequest req;
+bool Database::RemoveById(const std::string& id) {
+  static_cloud_db_msgs::RemoveStaticCloudRequest req;
   req.collection.db = db_;
   req.collection.collection = collection_;
-  req.cloud = cloud;
-  static_cloud_db_msgs::SaveStaticCloudResponse res;
-  bool success = save_.call(req, res);
+  req.id = id;
+  static_cloud_db_msgs::RemoveStaticCloudResponse res;
+  bool success = remove_->Call(req, res);
   if (!success) {
-    ROS_ERROR("Save call failed.");
+    ROS_ERROR("Remove call failed.");
+    return false;
   }
-  return res.id;
+  if (res.error != "") {
+    ROS_ERROR("%s", res.error.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::string Database::Save(const rapid_msgs::StaticCloud& cloud) {
+  return CallSave(save_.get(), db_, collection_, cloud);
+}
+
+std::string Database::SaveBehind(const rapid_msgs::StaticCloud& cloud) {
+  std::string provisional_id;
+  {
+    boost::mutex::scoped_lock lock(pending_->mutex);
+    std::stringstream ss;
+    ss << "pending-" << ros::WallTime::now().toNSec() << "-"
+       << pending_->next_id++;
+    provisional_id = ss.str();
+    pending_->clouds[provisional_id] = cloud;
+  }
+  writes_->Push(boost::bind(&SaveInBackground, save_, db_, collection_,
+                            pending_, provisional_id),
+                boost::bind(&SaveFailed, pending_, provisional_id));
+  return provisional_id;
+}
+
+bool Database::WaitForSave(const std::string& id,
+                           const ros::WallDuration& timeout,
+                           std::string* saved_id) {
+  boost::system_time deadline =
+      boost::get_system_time() +
+      boost::posix_time::milliseconds(timeout.toSec() * 1000);
+  boost::mutex::scoped_lock lock(pending_->mutex);
+  while (pending_->clouds.find(id) != pending_->clouds.end()) {
+    if (!pending_->cond.timed_wait(lock, deadline)) {
+      ROS_ERROR("Timed out waiting for %s to be saved", id.c_str());
+      return false;
+    }
+  }
+  if (pending_->failed_ids.count(id) > 0) {
+    return false;
+  }
+  std::map<std::string, std::string>::const_iterator saved =
+      pending_->saved_ids.find(id);
+  *saved_id = saved != pending_->saved_ids.end() ? saved->second : id;
+  return true;
+}
+
+// If id is a provisional ID whose cloud hasn't been written yet, gets the
+// cloud and returns true. If it has been written, replaces id with the
+// database ID.
+bool Database::FindPending(std::string* id, rapid_msgs::StaticCloud* cloud) {
+  boost::mutex::scoped_lock lock(pending_->mutex);
+  std::map<std::string, rapid_msgs::StaticCloud>::const_iterator it =
+      pending_->clouds.find(*id);
+  if (it != pending_->clouds.end()) {
+    *cloud = it->second;
+    return true;
+  }
+  std::map<std::string, std::string>::const_iterator saved =
+      pending_->saved_ids.find(*id);
+  if (saved != pending_->saved_ids.end()) {
+    *id = saved->second;
+  }
+  return false;
+}
+
+Database Database::Detached() const {
+  Database db(*this);
+  db.async_.reset();
+  return db;
 }
 }  // namespace object_search
@@ -1,11 +1,14 @@
 #include "object_search/commands.h"
 
+#include <cstdio>
 #include <iostream>
 #include <string>
 #include <vector>
 
 #include "Eigen/Core"
 #include "boost/algorithm/string.hpp"
+#include "boost/bind.hpp"
+#include "boost/shared_ptr.hpp"
 #include "pcl/PointIndices.h"
 #include "pcl/common/time.h"
 #include "pcl/filters/crop_box.h"
@@ -39,7 +42,10 @@
 #include "object_search/capture_roi.h"
 #include "object_search/cloud_database.h"
 #include "object_search/estimators.h"
+#include "object_search/frame_averager.h"
 #include "object_search/object_search.h"
+#include "object_search/scene_octree.h"
+#include "object_search/write_behind_queue.h"
 
 using pcl::PointCloud;
 using pcl::PointXYZRGB;
@@ -56,6 +62,23 @@ using rapid::viz::SceneViz;
 
 namespace object_search {
 
+AfterWritesCommand::AfterWritesCommand(
+    rapid::utils::CommandInterface* command, WriteBehindQueue* writes)
+    : command_(command), writes_(writes) {}
+
+void AfterWritesCommand::Execute(const vector<string>& args) {
+  size_t pending = writes_->num_pending();
+  if (pending > 0) {
+    cout << "Waiting for " << pending << " queued writes..." << endl;
+    writes_->Flush();
+  }
+  command_->Execute(args);
+}
+string AfterWritesCommand::name() const { return command_->name(); }
+string AfterWritesCommand::description() const {
+  return command_->description();
+}
+
 CliCommand::CliCommand(const rapid::utils::CommandLine& cli, const string& name,
                        const string& description)
     : cli_(cli), name_(name), description_(description) {}
@@ -76,7 +99,7 @@ void ShowSceneCommand::Execute(const vector<string>& args) {
   }
   string name = boost::algorithm::join(args, " ");
   PointCloud2 cloud;
-  bool success = db_->Get(name, &cloud);
+  bool success = GetSceneCloud(db_, name, &cloud);
   if (!success) {
     ROS_ERROR("Error: scene %s was not found.", name.c_str());
     return;
@@ -115,10 +138,38 @@ string ListCommand::description() const { return description_; }
 const char ListCommand::kLandmarks[] = "landmark";
 const char ListCommand::kScenes[] = "scene";
 
+namespace {
+// Reads a smoothed cloud from cloud_in. If averager is given, its window is
+// used, which is instant if it has been running for a while. Otherwise,
+// num_clouds new frames are averaged. Returns a null pointer on failure.
+PointCloud2::Ptr GetSmoothedCloud(FrameAverager* averager) {
+  if (averager == NULL) {
+    int num_clouds = 15;
+    ros::param::param<int>("num_clouds", num_clouds, 15);
+    return rapid::perception::RosFromPcl(
+        rapid::perception::GetSmoothedKinectCloud("cloud_in", num_clouds));
+  }
+  bool started = !averager->running();
+  if (started) {
+    averager->Start();
+  }
+  PointCloud<PointXYZRGB>::Ptr cloud = averager->Average(ros::Duration(10));
+  if (started) {
+    averager->Stop();
+  }
+  if (!cloud) {
+    return PointCloud2::Ptr();
+  }
+  return rapid::perception::RosFromPcl(cloud);
+}
+}  // namespace
+
 RecordObjectCommand::RecordObjectCommand(Database* db, CaptureRoi* capture,
-                                         const ros::Publisher& name_request)
+                                         const ros::Publisher& name_request,
+                                         FrameAverager* averager)
     : db_(db),
       capture_(capture),
+      averager_(averager),
       last_id_(""),
       last_name_(""),
       name_request_(name_request) {}
@@ -129,6 +180,13 @@ void RecordObjectCommand::Execute(const vector<string>& args) {
   rapid_msgs::Roi3D roi;
   last_roi_ = roi;
 
+  // Fill the averaging window while the user adjusts the ROI and names the
+  // object, so the smoothed cloud is ready when they are done.
+  bool started_averaging = averager_ != NULL && !averager_->running();
+  if (started_averaging) {
+    averager_->Start();
+  }
+
   // Start server and wait for input
   capture_->ShowMarker();
   cout << "Adjust the ROI marker in rviz." << endl;
@@ -151,17 +209,23 @@ void RecordObjectCommand::Execute(const vector<string>& args) {
 
   capture_->HideMarker();
   if (input == "cancel") {
+    if (started_averaging) {
+      averager_->Stop();
+    }
     return;
   } else {
     name = input;
   }
 
   // Read cloud and saved region
-  int num_clouds = 15;
-  ros::param::param<int>("num_clouds", num_clouds, 15);
-  // Read cloud
-  PointCloud2::Ptr cloud_in = rapid::perception::RosFromPcl(
-      rapid::perception::GetSmoothedKinectCloud("cloud_in", num_clouds));
+  PointCloud2::Ptr cloud_in = GetSmoothedCloud(averager_);
+  if (started_averaging) {
+    averager_->Stop();
+  }
+  if (!cloud_in) {
+    ROS_ERROR("Error: Failed to read a smoothed point cloud.");
+    return;
+  }
   capture_->set_cloud(cloud_in);
   StaticCloud static_cloud;
   capture_->Capture(&static_cloud.cloud);
@@ -173,11 +237,19 @@ void RecordObjectCommand::Execute(const vector<string>& args) {
   static_cloud.roi = capture_->roi();
   last_roi_ = static_cloud.roi;
 
-  // Save static cloud
+  // Save static cloud. With write_behind, the cloud is written in the
+  // background and last_id_ is a provisional ID until the process exits.
   static_cloud.name = name;
-  last_id_ = db_->Save(static_cloud);
+  bool write_behind = true;
+  ros::param::param<bool>("write_behind", write_behind, true);
+  if (write_behind) {
+    last_id_ = db_->SaveBehind(static_cloud);
+    cout << "Saving " << static_cloud.name << " with ID " << last_id_ << endl;
+  } else {
+    last_id_ = db_->Save(static_cloud);
+    cout << "Saved " << static_cloud.name << " with ID " << last_id_ << endl;
+  }
   last_name_ = name;
-  cout << "Saved " << static_cloud.name << " with ID " << last_id_ << endl;
 }
 string RecordObjectCommand::name() const { return "record object"; }
 string RecordObjectCommand::description() const {
@@ -205,7 +277,7 @@ void SetLandmarkSceneCommand::Execute(const vector<string>& args) {
   }
   string name(boost::algorithm::join(args, " "));
   PointCloud2 cloud;
-  bool success = scene_cloud_db_->Get(name, &cloud);
+  bool success = GetSceneCloud(scene_cloud_db_, name, &cloud);
   if (!success) {
     cout << "Error: scene " << name << " not found." << endl;
     return;
@@ -353,7 +425,7 @@ void EditLandmarkCommand::Execute(const vector<string>& args) {
 
     PointCloud2 db_cloud;
     scene_name = landmark_info.scene_name;
-    success = scene_cloud_db_->Get(scene_name, &db_cloud);
+    success = GetSceneCloud(scene_cloud_db_, scene_name, &db_cloud);
     if (!success) {
       cout << "Warning: scene \"" << scene_name << "\" for landmark " << name
            << " not found. Please add a scene before saving the landmark."
@@ -400,19 +472,97 @@ string EditLandmarkCommand::description() const {
 const char EditLandmarkCommand::kCreate[] = "create";
 const char EditLandmarkCommand::kEdit[] = "edit";
 
-RecordSceneCommand::RecordSceneCommand(NameDb* info_db, NameDb* cloud_db)
-    : info_db_(info_db), cloud_db_(cloud_db), tf_listener_() {}
+namespace {
+// The parts of a scene that have been saved so far. A retried InsertScene
+// skips them, so a failure partway through doesn't save them twice.
+struct SceneWrite {
+  SceneWrite() : info_saved(false), cloud_saved(false) {}
+
+  bool info_saved;
+  bool cloud_saved;
+};
+
+// Saves a scene as an octree file. The octree is only a faster copy of the
+// scene, so if it can't be written, the scene is read from the database.
+void SaveSceneOctree(const string& octree_path, const string& name,
+                     const PointCloud2& cloud) {
+  PointCloud<PointXYZRGB> pcl_cloud;
+  pcl::fromROSMsg(cloud, pcl_cloud);
+  if (!WriteSceneOctree(pcl_cloud, SceneOctreeOptions(), octree_path)) {
+    std::remove(octree_path.c_str());
+    ROS_WARN("Scene %s will be read from the database.", name.c_str());
+  }
+}
+
+// Saves a scene to the database, and then as an octree file if octree_path is
+// not empty. Only the database writes can fail: the octree is written once
+// they succeed, and is not retried.
+bool InsertScene(NameDb* info_db, NameDb* cloud_db, const string& octree_path,
+                 const string& name, const PointCloud2& cloud,
+                 boost::shared_ptr<SceneWrite> progress) {
+  try {
+    if (!progress->info_saved) {
+      rapid_msgs::SceneInfo info;
+      info.name = name;
+      info_db->Insert(name, info);
+      progress->info_saved = true;
+    }
+    if (!progress->cloud_saved) {
+      cloud_db->Insert(name, cloud);
+      progress->cloud_saved = true;
+    }
+  } catch (const std::exception& e) {
+    ROS_WARN("Failed to insert scene %s: %s", name.c_str(), e.what());
+    return false;
+  }
+  if (octree_path != "") {
+    SaveSceneOctree(octree_path, name, cloud);
+  }
+  return true;
+}
+
+// Reads the part of a scene octree inside the crop box used by CropScene, at
+// full resolution. RunCommand then downsamples it the same way as a scene read
+// from the database.
+void ReadSceneOctree(const SceneOctree& octree,
+                     PointCloud<PointXYZRGB>::Ptr cropped) {
+  double min_x, min_y, min_z, max_x, max_y, max_z;
+  ros::param::param<double>("min_x", min_x, 0.2);
+  ros::param::param<double>("min_y", min_y, -1);
+  ros::param::param<double>("min_z", min_z, 0.2);
+  ros::param::param<double>("max_x", max_x, 1.2);
+  ros::param::param<double>("max_y", max_y, 1);
+  ros::param::param<double>("max_z", max_z, 1.7);
+
+  int num_nodes = octree.Query(Eigen::Vector3f(min_x, min_y, min_z),
+                               Eigen::Vector3f(max_x, max_y, max_z),
+                               cropped.get());
+  ROS_INFO("Read %d of %d points from %d octree nodes",
+           static_cast<int>(cropped->size()),
+           static_cast<int>(octree.num_points()), num_nodes);
+}
+}  // namespace
+
+RecordSceneCommand::RecordSceneCommand(NameDb* info_db, NameDb* cloud_db,
+                                       WriteBehindQueue* writes,
+                                       FrameAverager* averager)
+    : info_db_(info_db),
+      cloud_db_(cloud_db),
+      writes_(writes),
+      averager_(averager),
+      tf_listener_() {}
 
 void RecordSceneCommand::Execute(const vector<string>& args) {
   if (args.size() == 0) {
     cout << "Error: provide a name for this scene." << endl;
     return;
   }
-  int num_clouds = 15;
-  ros::param::param<int>("num_clouds", num_clouds, 15);
   // Read cloud
-  PointCloud2::Ptr cloud_in = rapid::perception::RosFromPcl(
-      rapid::perception::GetSmoothedKinectCloud("cloud_in", num_clouds));
+  PointCloud2::Ptr cloud_in = GetSmoothedCloud(averager_);
+  if (!cloud_in) {
+    ROS_ERROR("Error: Failed to read a smoothed point cloud.");
+    return;
+  }
 
   // Transform to base link.
   PointCloud2 cloud_out;
@@ -425,10 +575,15 @@ void RecordSceneCommand::Execute(const vector<string>& args) {
 
   // Save to DB
   string name = boost::algorithm::join(args, " ");
-  rapid_msgs::SceneInfo info;
-  info.name = name;
-  info_db_->Insert(name, info);
-  cloud_db_->Insert(name, cloud_out);
+  string octree_path = SceneOctreePathParam(name);
+  boost::shared_ptr<SceneWrite> progress(new SceneWrite);
+  if (writes_ != NULL) {
+    writes_->Push(boost::bind(&InsertScene, info_db_, cloud_db_, octree_path,
+                              name, cloud_out, progress));
+    cout << "Saving scene " << name << " in the background" << endl;
+  } else {
+    InsertScene(info_db_, cloud_db_, octree_path, name, cloud_out, progress);
+  }
 }
 
 string RecordSceneCommand::name() const { return "record scene"; }
@@ -454,6 +609,10 @@ void DeleteCommand::Execute(const vector<string>& args) {
   } else {
     info_success = info_db_->Delete<rapid_msgs::SceneInfo>(name);
     cloud_success = cloud_db_->Delete<PointCloud2>(name);
+    string octree_path = SceneOctreePathParam(name);
+    if (info_success && cloud_success && octree_path != "") {
+      std::remove(octree_path.c_str());
+    }
   }
   if (!info_success || !cloud_success) {
     cout << "Invalid name " << name << ", nothing deleted." << endl;
@@ -527,6 +686,18 @@ void SetInputSceneCommand::Execute(const vector<string>& args) {
     return;
   }
 
+  // If the scene was also saved as an octree, only the part of it in the crop
+  // box is read.
+  PointCloud<PointXYZRGB>::Ptr scene_cropped(new PointCloud<PointXYZRGB>);
+  SceneOctree octree;
+  string octree_path = SceneOctreePathParam(name);
+  if (octree_path != "" && octree.Open(octree_path)) {
+    ReadSceneOctree(octree, scene_cropped);
+    pcl::toROSMsg(*scene_cropped, input_->scene_cloud);
+    viz_.set_scene(input_->scene_cloud);
+    return;
+  }
+
   success = cloud_db_->Get(name, &input_->scene_cloud);
   if (!success) {
     cout << "Error: could not find scene cloud \"" << name << "\"." << endl;
@@ -534,10 +705,9 @@ void SetInputSceneCommand::Execute(const vector<string>& args) {
   }
 
   // Visualize the cropped scene.
-  PointCloud<PointXYZRGB>::Ptr scene_cropped(new PointCloud<PointXYZRGB>);
   PointCloud<PointXYZRGB>::Ptr scene_cloud(new PointCloud<PointXYZRGB>);
   pcl::fromROSMsg(input_->scene_cloud, *scene_cloud);
-  CropScene(scene_cloud, scene_cropped);
+  CropScene<PointXYZRGB>(scene_cloud, scene_cropped);
   viz_.set_scene(*rapid::perception::RosFromPcl(scene_cropped));
 }
 
@@ -563,37 +733,43 @@ void RunCommand::Execute(const vector<string>& args) {
   const string& algorithm = args[0];
   matches_.clear();
 
-  // TODO(jstn): May need to filter NaNs from the scene
-  // if (type_ == "scene") {
-  //  // Filter NaNs
-  //  vector<int> mapping;
-  //  pcl_cloud_filtered->is_dense = false;  // Force check for NaNs
-  //  pcl::removeNaNFromPointCloud(*pcl_cloud_filtered, *pcl_cloud_filtered,
-  //                               mapping);
-  //  ROS_INFO("Filtered NaNs, there are now %ld points",
-  //           pcl_cloud_filtered->size());
-  //}
+  // NaNs in the scene are dropped by CropScene, since CropBox skips non-finite
+  // points in clouds that are not dense.
   PointCloud<PointXYZRGB>::Ptr landmark_cloud(new PointCloud<PointXYZRGB>);
   pcl::fromROSMsg(input_->landmark_cloud, *landmark_cloud);
   ROS_INFO("Loaded landmark with %ld points", landmark_cloud->size());
   PointCloud<PointXYZRGB>::Ptr scene_cloud(new PointCloud<PointXYZRGB>);
   pcl::fromROSMsg(input_->scene_cloud, *scene_cloud);
   PointCloud<PointXYZRGB>::Ptr scene_cropped(new PointCloud<PointXYZRGB>);
-  CropScene(scene_cloud, scene_cropped);
+  CropScene<PointXYZRGB>(scene_cloud, scene_cropped);
 
   double leaf_size = 0.01;
   ros::param::param<double>("leaf_size", leaf_size, 0.01);
+  bool adaptive_leaf_size = false;
+  ros::param::param<bool>("adaptive_leaf_size", adaptive_leaf_size, false);
+  if (adaptive_leaf_size) {
+    int object_point_budget;
+    double min_leaf_size;
+    double max_leaf_size;
+    ros::param::param<int>("object_point_budget", object_point_budget, 300);
+    ros::param::param<double>("min_leaf_size", min_leaf_size, 0.003);
+    ros::param::param<double>("max_leaf_size", max_leaf_size, 0.02);
+    leaf_size = AdaptiveLeafSize(input_->landmark.roi.dimensions,
+                                 object_point_budget, min_leaf_size,
+                                 max_leaf_size);
+    ROS_INFO("Using leaf size %f for landmark", leaf_size);
+  }
 
   if (algorithm == "custom") {
     UpdateEstimatorParams(estimators_->custom);
     // Downsample landmark and scene
     PointCloud<PointXYZRGB>::Ptr landmark_downsampled(
         new PointCloud<PointXYZRGB>);
-    Downsample(leaf_size, landmark_cloud, landmark_downsampled);
+    Downsample<PointXYZRGB>(leaf_size, landmark_cloud, landmark_downsampled);
     ROS_INFO("Downsampled landmark to %ld points",
              landmark_downsampled->size());
     PointCloud<PointXYZRGB>::Ptr scene_downsampled(new PointCloud<PointXYZRGB>);
-    Downsample(leaf_size, scene_cropped, scene_downsampled);
+    Downsample<PointXYZRGB>(leaf_size, scene_cropped, scene_downsampled);
     ROS_INFO("Downsampled scene to %ld points", scene_downsampled->size());
 
     pcl::ScopeTime timer(("Running algorithm: " + algorithm).c_str());
@@ -0,0 +1,246 @@
+#include "object_search/depth_image.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <limits>
+#include <string>
+
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+#include "eigen_conversions/eigen_msg.h"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "ros/ros.h"
+#include "sensor_msgs/CameraInfo.h"
+#include "sensor_msgs/Image.h"
+#include "sensor_msgs/image_encodings.h"
+
+#include "object_search/organized_cloud.h"
+
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+
+namespace enc = sensor_msgs::image_encodings;
+
+namespace object_search {
+namespace {
+// Reads depths and colors out of a depth image and an optional registered
+// color image.
+class DepthReader {
+ public:
+  DepthReader(const sensor_msgs::Image& depth, const sensor_msgs::Image* rgb)
+      : depth_(depth),
+        rgb_(rgb),
+        is_float_(depth.encoding == enc::TYPE_32FC1),
+        r_(0),
+        g_(1),
+        b_(2),
+        pixel_step_(3) {
+    if (rgb_ != NULL) {
+      if (rgb_->encoding == enc::BGR8 || rgb_->encoding == enc::BGRA8) {
+        r_ = 2;
+        b_ = 0;
+      }
+      if (rgb_->encoding == enc::RGBA8 || rgb_->encoding == enc::BGRA8) {
+        pixel_step_ = 4;
+      }
+    }
+  }
+
+  // Returns the depth in meters, or 0 if there is none.
+  float Depth(const int row, const int col) const {
+    const uint8_t* pixel = &depth_.data[row * depth_.step];
+    if (is_float_) {
+      float depth;
+      memcpy(&depth, pixel + col * sizeof(float), sizeof(float));
+      return pcl_isfinite(depth) ? depth : 0;
+    }
+    uint16_t depth_mm;
+    memcpy(&depth_mm, pixel + col * sizeof(uint16_t), sizeof(uint16_t));
+    return depth_mm * 0.001f;
+  }
+
+  void SetColor(const int row, const int col, PointC* pt) const {
+    if (rgb_ == NULL) {
+      return;
+    }
+    const uint8_t* pixel =
+        &rgb_->data[row * rgb_->step + col * pixel_step_];
+    pt->r = pixel[r_];
+    pt->g = pixel[g_];
+    pt->b = pixel[b_];
+  }
+
+ private:
+  const sensor_msgs::Image& depth_;
+  const sensor_msgs::Image* rgb_;
+  bool is_float_;
+  int r_;
+  int g_;
+  int b_;
+  int pixel_step_;
+};
+
+// Back-projects a pixel with the given depth into the camera frame.
+void Unproject(const CameraIntrinsics& intrinsics, const int row,
+               const int col, const float depth, PointC* pt) {
+  pt->x = (col - intrinsics.cx) * depth / intrinsics.fx;
+  pt->y = (row - intrinsics.cy) * depth / intrinsics.fy;
+  pt->z = depth;
+}
+
+// Returns true if the image's rows are wide enough for its pixels and its
+// buffer holds every row.
+bool HasImageData(const sensor_msgs::Image& image,
+                  const size_t bytes_per_pixel, const char* name) {
+  if (image.step < image.width * bytes_per_pixel) {
+    ROS_ERROR("%s image step %d is too small for %d pixels of %d bytes", name,
+              image.step, image.width, static_cast<int>(bytes_per_pixel));
+    return false;
+  }
+  if (image.data.size() < static_cast<size_t>(image.step) * image.height) {
+    ROS_ERROR("%s image has %d bytes, expected %d rows of %d", name,
+              static_cast<int>(image.data.size()), image.height, image.step);
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
+CameraIntrinsics IntrinsicsFromCameraInfo(
+    const sensor_msgs::CameraInfo& info) {
+  CameraIntrinsics intrinsics;
+  intrinsics.fx = info.K[0];
+  intrinsics.cx = info.K[2];
+  intrinsics.fy = info.K[4];
+  intrinsics.cy = info.K[5];
+  return intrinsics;
+}
+
+bool CanReadDepthImage(const sensor_msgs::Image& depth,
+                       const sensor_msgs::Image* rgb) {
+  // Images are assumed to be in the host's byte order.
+  if (depth.is_bigendian) {
+    ROS_ERROR("Big-endian depth images are not supported");
+    return false;
+  }
+  if (depth.encoding != enc::TYPE_16UC1 && depth.encoding != enc::MONO16 &&
+      depth.encoding != enc::TYPE_32FC1) {
+    ROS_ERROR("Unsupported depth encoding %s", depth.encoding.c_str());
+    return false;
+  }
+  const size_t depth_bytes =
+      depth.encoding == enc::TYPE_32FC1 ? sizeof(float) : sizeof(uint16_t);
+  if (!HasImageData(depth, depth_bytes, "Depth")) {
+    return false;
+  }
+  if (rgb == NULL) {
+    return true;
+  }
+  if (rgb->encoding != enc::RGB8 && rgb->encoding != enc::BGR8 &&
+      rgb->encoding != enc::RGBA8 && rgb->encoding != enc::BGRA8) {
+    ROS_ERROR("Unsupported color encoding %s", rgb->encoding.c_str());
+    return false;
+  }
+  if (rgb->width != depth.width || rgb->height != depth.height) {
+    ROS_ERROR("Color image (%dx%d) is not registered to depth image (%dx%d)",
+              rgb->width, rgb->height, depth.width, depth.height);
+    return false;
+  }
+  const size_t rgb_bytes =
+      rgb->encoding == enc::RGBA8 || rgb->encoding == enc::BGRA8 ? 4 : 3;
+  return HasImageData(*rgb, rgb_bytes, "Color");
+}
+
+bool DepthImageToCloud(const sensor_msgs::Image& depth,
+                       const sensor_msgs::Image* rgb,
+                       const sensor_msgs::CameraInfo& info,
+                       PointCloudC* cloud) {
+  if (!CanReadDepthImage(depth, rgb)) {
+    return false;
+  }
+  CameraIntrinsics intrinsics = IntrinsicsFromCameraInfo(info);
+  DepthReader reader(depth, rgb);
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+
+  cloud->width = depth.width;
+  cloud->height = depth.height;
+  cloud->is_dense = false;
+  cloud->points.resize(depth.width * depth.height);
+  for (int row = 0; row < static_cast<int>(depth.height); ++row) {
+    for (int col = 0; col < static_cast<int>(depth.width); ++col) {
+      PointC& pt = cloud->at(col, row);
+      float z = reader.Depth(row, col);
+      if (z <= 0) {
+        pt.x = nan;
+        pt.y = nan;
+        pt.z = nan;
+        continue;
+      }
+      Unproject(intrinsics, row, col, z, &pt);
+      reader.SetColor(row, col, &pt);
+    }
+  }
+  cloud->header.frame_id = depth.header.frame_id;
+  cloud->header.stamp = depth.header.stamp.toNSec() / 1000;
+  return true;
+}
+
+bool CropDepthImageToBox(const sensor_msgs::Image& depth,
+                         const sensor_msgs::Image* rgb,
+                         const sensor_msgs::CameraInfo& info,
+                         const std::string& parent_frame_id,
+                         const geometry_msgs::Transform& base_to_camera,
+                         const Eigen::Affine3f& box_pose,
+                         const Eigen::Vector3f& min_pt,
+                         const Eigen::Vector3f& max_pt,
+                         PointCloudC::Ptr cropped) {
+  if (!CanReadDepthImage(depth, rgb)) {
+    return false;
+  }
+  Eigen::Affine3d base_to_camera_eigen;
+  tf::transformMsgToEigen(base_to_camera, base_to_camera_eigen);
+  Eigen::Affine3f camera_to_base = base_to_camera_eigen.inverse().cast<float>();
+  Eigen::Affine3f box_in_camera = camera_to_base.inverse() * box_pose;
+  Eigen::Affine3f camera_to_box = box_in_camera.inverse();
+
+  CameraIntrinsics intrinsics = IntrinsicsFromCameraInfo(info);
+  PixelWindow window;
+  if (!ProjectBox(intrinsics, depth.width, depth.height, box_in_camera, min_pt,
+                  max_pt, &window)) {
+    window.min_col = 0;
+    window.max_col = depth.width - 1;
+    window.min_row = 0;
+    window.max_row = depth.height - 1;
+  }
+  ROS_DEBUG("Generating points for %d of %d pixels", window.Area(),
+            depth.width * depth.height);
+
+  DepthReader reader(depth, rgb);
+  cropped->clear();
+  cropped->reserve(window.Area());
+  for (int row = window.min_row; row <= window.max_row; ++row) {
+    for (int col = window.min_col; col <= window.max_col; ++col) {
+      float z = reader.Depth(row, col);
+      if (z <= 0) {
+        continue;
+      }
+      PointC pt;
+      Unproject(intrinsics, row, col, z, &pt);
+      Eigen::Vector3f in_box = camera_to_box * pt.getVector3fMap();
+      if (in_box.x() < min_pt.x() || in_box.y() < min_pt.y() ||
+          in_box.z() < min_pt.z() || in_box.x() > max_pt.x() ||
+          in_box.y() > max_pt.y() || in_box.z() > max_pt.z()) {
+        continue;
+      }
+      reader.SetColor(row, col, &pt);
+      pt.getVector3fMap() = camera_to_base * pt.getVector3fMap();
+      cropped->push_back(pt);
+    }
+  }
+  cropped->is_dense = true;
+  cropped->header.frame_id = parent_frame_id;
+  cropped->header.stamp = depth.header.stamp.toNSec() / 1000;
+  return true;
+}
+}  // namespace object_search
@@ -20,6 +20,8 @@
 #include "rapid_viz/publish.h"
 #include "readline/readline.h"
 
+#include "object_search/scene_octree.h"
+
 using pcl::PointXYZRGB;
 using pcl::PointCloud;
 typedef PointCloud<PointXYZRGB> PointCloudC;
@@ -39,7 +41,8 @@ TaskViz::TaskViz(const ExperimentDbs dbs, const ros::Publisher& scene_pub,
 void TaskViz::Publish(const object_search_msgs::Task& task) {
   if (task.scene_name != "") {
     sensor_msgs::PointCloud2 scene_cloud;
-    bool success = dbs_.scene_cloud_db->Get(task.scene_name, &scene_cloud);
+    bool success = GetSceneCloud(dbs_.scene_cloud_db, task.scene_name,
+                                 &scene_cloud);
     if (!success) {
       ROS_WARN("Scene cloud \"%s\" not found.", task.scene_name.c_str());
     } else {
@@ -196,7 +199,7 @@ void SetTaskScene::Execute(const std::vector<std::string>& args) {
 
   std::string name(boost::algorithm::join(args, " "));
   sensor_msgs::PointCloud2 cloud;
-  bool success = dbs_.scene_cloud_db->Get(name, &cloud);
+  bool success = GetSceneCloud(dbs_.scene_cloud_db, name, &cloud);
   if (!success) {
     ROS_ERROR("Scene cloud \"%s\" not found.", name.c_str());
     return;
@@ -326,7 +329,7 @@ void AddLabel::Execute(const std::vector<std::string>& args) {
   }
 
   sensor_msgs::PointCloud2 scene_cloud;
-  if (!dbs_.scene_cloud_db->Get(task_->scene_name, &scene_cloud)) {
+  if (!GetSceneCloud(dbs_.scene_cloud_db, task_->scene_name, &scene_cloud)) {
     ROS_ERROR("Could not get scene cloud \"%s\"", task_->scene_name.c_str());
     return;
   }
@@ -19,6 +19,7 @@
 
 #include "object_search/experiment.h"
 #include "object_search/object_search.h"
+#include "object_search/scene_octree.h"
 
 using object_search::ExperimentDbs;
 using rapid::perception::PoseEstimationMatch;
@@ -104,7 +105,8 @@ void RunExperiment(PoseEstimator* estimator,
     }
 
     sensor_msgs::PointCloud2 scene_cloud;
-    if (!dbs.scene_cloud_db->Get(task.scene_name, &scene_cloud)) {
+    if (!object_search::GetSceneCloud(dbs.scene_cloud_db, task.scene_name,
+                                      &scene_cloud)) {
       std::cerr << "Error getting scene cloud \"" << task.scene_name
                 << "\" for task \"" << task_name << "\", skipping."
                 << std::endl;
@@ -142,14 +144,16 @@ void RunExperiment(PoseEstimator* estimator,
       ros::param::param<double>("leaf_size", leaf_size, 0.01);
       PointC::Ptr scene = rapid::perception::PclFromRos(scene_cloud);
       PointC::Ptr scene_cropped(new PointC);
-      object_search::CropScene(scene, scene_cropped);
+      object_search::CropScene<PointXYZRGB>(scene, scene_cropped);
       PointC::Ptr scene_downsampled(new PointC);
-      object_search::Downsample(leaf_size, scene_cropped, scene_downsampled);
+      object_search::Downsample<PointXYZRGB>(leaf_size, scene_cropped,
+                                             scene_downsampled);
       estimator->set_scene(scene_downsampled);
 
       PointC::Ptr landmark = rapid::perception::PclFromRos(landmark_cloud);
       PointC::Ptr landmark_downsampled(new PointC);
-      object_search::Downsample(leaf_size, landmark, landmark_downsampled);
+      object_search::Downsample<PointXYZRGB>(leaf_size, landmark,
+                                             landmark_downsampled);
       estimator->set_object(landmark_downsampled);
       estimator->set_roi(landmark_info.roi);
 
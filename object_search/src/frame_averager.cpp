@@ -0,0 +1,187 @@
+#include "object_search/frame_averager.h"
+
+#include <limits>
+#include <string>
+
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "pcl_conversions/pcl_conversions.h"
+#include "ros/ros.h"
+#include "sensor_msgs/PointCloud2.h"
+
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+
+using sensor_msgs::PointCloud2;
+
+namespace object_search {
+FrameAverager::FrameAverager(const ros::NodeHandle& nh,
+                             const std::string& topic, const int num_frames)
+    : nh_(nh),
+      topic_(topic),
+      num_frames_(num_frames),
+      sub_(),
+      mutex_(),
+      cond_(),
+      running_(false),
+      frame_id_(""),
+      stamp_(0),
+      width_(0),
+      height_(0),
+      frames_(),
+      xyz_sum_(),
+      rgb_sum_(),
+      counts_() {}
+
+FrameAverager::~FrameAverager() { Stop(); }
+
+void FrameAverager::Start() {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (running_) {
+      return;
+    }
+    running_ = true;
+    Reset(0, 0);
+  }
+  sub_ = nh_.subscribe(topic_, 1, &FrameAverager::Callback, this);
+}
+
+void FrameAverager::Stop() {
+  sub_.shutdown();
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    running_ = false;
+    Reset(0, 0);
+  }
+  cond_.notify_all();
+}
+
+bool FrameAverager::running() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return running_;
+}
+
+PointCloudC::Ptr FrameAverager::Average(const ros::Duration& timeout) {
+  boost::system_time deadline =
+      boost::get_system_time() +
+      boost::posix_time::milliseconds(timeout.toSec() * 1000);
+  boost::mutex::scoped_lock lock(mutex_);
+  while (running_ && static_cast<int>(frames_.size()) < num_frames_) {
+    if (!cond_.timed_wait(lock, deadline)) {
+      break;
+    }
+  }
+  if (!running_ || static_cast<int>(frames_.size()) < num_frames_) {
+    ROS_ERROR("Only got %d of %d frames from %s",
+              static_cast<int>(frames_.size()), num_frames_, topic_.c_str());
+    return PointCloudC::Ptr();
+  }
+
+  PointCloudC::Ptr average(new PointCloudC(width_, height_));
+  average->header.frame_id = frame_id_;
+  average->header.stamp = stamp_;
+  average->is_dense = false;
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    PointC& pt = average->points[i];
+    int count = counts_[i];
+    if (count == 0) {
+      pt.x = nan;
+      pt.y = nan;
+      pt.z = nan;
+      continue;
+    }
+    pt.x = xyz_sum_[3 * i] / count;
+    pt.y = xyz_sum_[3 * i + 1] / count;
+    pt.z = xyz_sum_[3 * i + 2] / count;
+    pt.r = rgb_sum_[3 * i] / count;
+    pt.g = rgb_sum_[3 * i + 1] / count;
+    pt.b = rgb_sum_[3 * i + 2] / count;
+  }
+  return average;
+}
+
+void FrameAverager::Callback(const PointCloud2::ConstPtr& cloud) {
+  PointCloudC pcl_cloud;
+  pcl::fromROSMsg(*cloud, pcl_cloud);
+  if (pcl_cloud.height <= 1) {
+    ROS_WARN_THROTTLE(10, "Can't average frames of unorganized cloud %s",
+                      topic_.c_str());
+    return;
+  }
+
+  boost::shared_ptr<Frame> frame(new Frame);
+  frame->xyz.resize(3 * pcl_cloud.size());
+  frame->rgb.resize(pcl_cloud.size());
+  for (size_t i = 0; i < pcl_cloud.size(); ++i) {
+    const PointC& pt = pcl_cloud.points[i];
+    frame->xyz[3 * i] = pt.x;
+    frame->xyz[3 * i + 1] = pt.y;
+    frame->xyz[3 * i + 2] = pt.z;
+    frame->rgb[i] = pt.rgba;
+  }
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    // Stop may have run while the frame was being converted.
+    if (!running_) {
+      return;
+    }
+    if (static_cast<int>(pcl_cloud.width) != width_ ||
+        static_cast<int>(pcl_cloud.height) != height_) {
+      Reset(pcl_cloud.width, pcl_cloud.height);
+    }
+    frame_id_ = pcl_cloud.header.frame_id;
+    stamp_ = pcl_cloud.header.stamp;
+    Accumulate(*frame, 1);
+    frames_.push_back(frame);
+    if (static_cast<int>(frames_.size()) > num_frames_) {
+      Accumulate(*frames_.front(), -1);
+      frames_.pop_front();
+    }
+  }
+  cond_.notify_all();
+}
+
+void FrameAverager::Accumulate(const Frame& frame, const int sign) {
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    float x = frame.xyz[3 * i];
+    float y = frame.xyz[3 * i + 1];
+    float z = frame.xyz[3 * i + 2];
+    if (!pcl_isfinite(x) || !pcl_isfinite(y) || !pcl_isfinite(z)) {
+      continue;
+    }
+    counts_[i] += sign;
+    if (counts_[i] == 0) {
+      // Clear rounding error left over from adding and removing frames.
+      xyz_sum_[3 * i] = 0;
+      xyz_sum_[3 * i + 1] = 0;
+      xyz_sum_[3 * i + 2] = 0;
+      rgb_sum_[3 * i] = 0;
+      rgb_sum_[3 * i + 1] = 0;
+      rgb_sum_[3 * i + 2] = 0;
+      continue;
+    }
+    xyz_sum_[3 * i] += sign * x;
+    xyz_sum_[3 * i + 1] += sign * y;
+    xyz_sum_[3 * i + 2] += sign * z;
+    uint32_t rgb = frame.rgb[i];
+    rgb_sum_[3 * i] += sign * static_cast<int>((rgb >> 16) & 0xff);
+    rgb_sum_[3 * i + 1] += sign * static_cast<int>((rgb >> 8) & 0xff);
+    rgb_sum_[3 * i + 2] += sign * static_cast<int>(rgb & 0xff);
+  }
+}
+
+void FrameAverager::Reset(const int width, const int height) {
+  width_ = width;
+  height_ = height;
+  frames_.clear();
+  int size = width * height;
+  xyz_sum_.assign(3 * size, 0);
+  rgb_sum_.assign(3 * size, 0);
+  counts_.assign(size, 0);
+}
+}  // namespace object_search
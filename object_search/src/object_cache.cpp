@@ -0,0 +1,84 @@
+#include "object_search/object_cache.h"
+
+#include <set>
+#include <string>
+
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+
+namespace object_search {
+namespace {
+template <class Map>
+void EraseObjects(const std::set<const PreparedObject*>& objects, Map* map) {
+  typename Map::iterator it = map->begin();
+  while (it != map->end()) {
+    if (objects.count(it->second.get()) > 0) {
+      map->erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+}  // namespace
+
+PreparedObject::PreparedObject()
+    : id(), model(), transformed(), sampled(), leaf_size(0) {}
+
+ObjectCache::ObjectCache() : mutex_(), by_id_(), by_name_() {}
+
+void ObjectCache::Insert(
+    const std::string& id, const std::string& name,
+    const boost::shared_ptr<const PreparedObject>& object) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (id != "") {
+    by_id_[id] = object;
+  }
+  if (name != "") {
+    by_name_[name] = object;
+  }
+}
+
+void ObjectCache::Erase(const std::string& id, const std::string& name) {
+  boost::mutex::scoped_lock lock(mutex_);
+  std::set<const PreparedObject*> erased;
+  ObjectMap::iterator it = by_id_.find(id);
+  if (it != by_id_.end()) {
+    erased.insert(it->second.get());
+  }
+  it = by_name_.find(name);
+  if (it != by_name_.end()) {
+    erased.insert(it->second.get());
+  }
+  EraseObjects(erased, &by_id_);
+  EraseObjects(erased, &by_name_);
+}
+
+boost::shared_ptr<const PreparedObject> ObjectCache::Find(
+    const std::string& id, const std::string& name) {
+  boost::mutex::scoped_lock lock(mutex_);
+  ObjectMap::const_iterator it;
+  if (id != "") {
+    it = by_id_.find(id);
+    if (it != by_id_.end()) {
+      return it->second;
+    }
+  } else {
+    it = by_name_.find(name);
+    if (it != by_name_.end()) {
+      return it->second;
+    }
+  }
+  return boost::shared_ptr<const PreparedObject>();
+}
+
+void ObjectCache::Clear() {
+  boost::mutex::scoped_lock lock(mutex_);
+  by_id_.clear();
+  by_name_.clear();
+}
+
+size_t ObjectCache::size() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return by_id_.size();
+}
+}  // namespace object_search
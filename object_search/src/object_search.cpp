@@ -1,16 +1,62 @@
 #include "object_search/object_search.h"
 
+#include <math.h>
+#include <algorithm>
+
+#include "Eigen/Geometry"
+#include "eigen_conversions/eigen_msg.h"
+#include "geometry_msgs/Vector3.h"
+#include "pcl/common/common.h"
+#include "pcl/common/transforms.h"
 #include "pcl/filters/crop_box.h"
 #include "pcl/filters/voxel_grid.h"
 //#include "rapid_perception/grouping_pose_estimator.h"
 #include "rapid_perception/pose_estimation.h"
+#include "rapid_msgs/Roi3D.h"
 #include "rapid_perception/random_heat_mapper.h"
 //#include "rapid_perception/ransac_pose_estimator.h"
 #include "ros/ros.h"
 
+#include "object_search/organized_cloud.h"
+
 // using rapid::perception::GroupingPoseEstimator;
 
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+// Geometry-only points.
+typedef pcl::PointXYZ PointG;
+typedef pcl::PointCloud<pcl::PointXYZ> PointCloudG;
+
 namespace object_search {
+EstimatorParams::EstimatorParams()
+    : sample_ratio(0.02),
+      max_samples(500),
+      num_candidates(500),
+      fitness_threshold(0.0055),
+      sigma_threshold(8),
+      nms_radius(0.02),
+      min_results(0) {}
+
+void ConfigureEstimator(const EstimatorParams& params,
+                        rapid::perception::PoseEstimator* estimator) {
+  rapid::perception::RandomHeatMapper* heat_mapper =
+      static_cast<rapid::perception::RandomHeatMapper*>(
+          estimator->heat_mapper());
+  heat_mapper->set_sample_ratio(params.sample_ratio);
+  heat_mapper->set_max_samples(params.max_samples);
+  estimator->set_num_candidates(params.num_candidates);
+  estimator->set_fitness_threshold(params.fitness_threshold);
+  estimator->set_sigma_threshold(params.sigma_threshold);
+  estimator->set_nms_radius(params.nms_radius);
+  estimator->set_min_results(params.min_results);
+}
+
+int NumCandidates(const EstimatorParams& params, const size_t num_points) {
+  int num_samples = static_cast<int>(params.sample_ratio * num_points);
+  num_samples = std::min(num_samples, params.max_samples);
+  return std::min(num_samples, params.num_candidates);
+}
+
 void UpdateEstimatorParams(rapid::perception::PoseEstimator* custom) {
   double sample_ratio;
   int max_samples;
@@ -133,8 +179,9 @@ void UpdateEstimatorParams(rapid::perception::PoseEstimator* custom) {
 //  grouping->cg_threshold_ = cg_threshold;
 //}
 
-void CropScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr scene,
-               pcl::PointCloud<pcl::PointXYZRGB>::Ptr cropped) {
+template <typename PointT>
+void CropScene(typename pcl::PointCloud<PointT>::Ptr scene,
+               typename pcl::PointCloud<PointT>::Ptr cropped) {
   double min_x, min_y, min_z, max_x, max_y, max_z;
   ros::param::param<double>("min_x", min_x, 0.2);
   ros::param::param<double>("min_y", min_y, -1);
@@ -152,7 +199,7 @@ void CropScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr scene,
       "  max_z: %f\n",
       min_x, min_y, min_z, max_x, max_y, max_z);
 
-  pcl::CropBox<pcl::PointXYZRGB> crop;
+  pcl::CropBox<PointT> crop;
   crop.setInputCloud(scene);
   Eigen::Vector4f min;
   min << min_x, min_y, min_z, 1;
@@ -164,12 +211,172 @@ void CropScene(pcl::PointCloud<pcl::PointXYZRGB>::Ptr scene,
   ROS_INFO("Cropped to %ld points", cropped->size());
 }
 
+template <typename PointT>
 void Downsample(const double leaf_size,
-                pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_in,
-                pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_out) {
-  pcl::VoxelGrid<pcl::PointXYZRGB> vox;
+                typename pcl::PointCloud<PointT>::Ptr cloud_in,
+                typename pcl::PointCloud<PointT>::Ptr cloud_out) {
+  pcl::VoxelGrid<PointT> vox;
   vox.setInputCloud(cloud_in);
   vox.setLeafSize(leaf_size, leaf_size, leaf_size);
   vox.filter(*cloud_out);
 }
+
+template <typename PointT>
+void CropSceneToBox(typename pcl::PointCloud<PointT>::ConstPtr scene,
+                    const std::string& parent_frame_id,
+                    const geometry_msgs::Transform& base_to_camera,
+                    const Eigen::Affine3f& box_pose,
+                    const Eigen::Vector3f& min_pt,
+                    const Eigen::Vector3f& max_pt, const bool use_organized,
+                    typename pcl::PointCloud<PointT>::Ptr cropped) {
+  Eigen::Affine3d base_to_camera_eigen;
+  tf::transformMsgToEigen(base_to_camera, base_to_camera_eigen);
+  Eigen::Affine3f camera_to_base = base_to_camera_eigen.inverse().cast<float>();
+
+  bool done = false;
+  if (use_organized) {
+    done = CropOrganized(*scene, camera_to_base, box_pose, min_pt, max_pt,
+                         cropped.get());
+  }
+  if (!done) {
+    typename pcl::PointCloud<PointT>::Ptr transformed(
+        new pcl::PointCloud<PointT>);
+    pcl::transformPointCloud(*scene, *transformed, camera_to_base);
+    pcl::CropBox<PointT> crop;
+    crop.setInputCloud(transformed);
+    crop.setTransform(box_pose.inverse());
+    crop.setMin(Eigen::Vector4f(min_pt.x(), min_pt.y(), min_pt.z(), 1));
+    crop.setMax(Eigen::Vector4f(max_pt.x(), max_pt.y(), max_pt.z(), 1));
+    crop.filter(*cropped);
+  }
+  cropped->header = scene->header;
+  cropped->header.frame_id = parent_frame_id;
+}
+
+template <typename PointT>
+void CropToRoi(typename pcl::PointCloud<PointT>::ConstPtr cloud,
+               const rapid_msgs::Roi3D& roi, const double margin,
+               typename pcl::PointCloud<PointT>::Ptr cropped) {
+  // CropBox transforms each point by the given transform before testing it
+  // against the box, so we pass in the transform from the cloud frame into the
+  // ROI frame.
+  Eigen::Affine3d roi_pose;
+  tf::transformMsgToEigen(roi.transform, roi_pose);
+  pcl::CropBox<PointT> crop;
+  crop.setInputCloud(cloud);
+  crop.setTransform(roi_pose.inverse().cast<float>());
+  Eigen::Vector4f min_pt(-roi.dimensions.x / 2 - margin,
+                         -roi.dimensions.y / 2 - margin,
+                         -roi.dimensions.z / 2 - margin, 1);
+  Eigen::Vector4f max_pt(roi.dimensions.x / 2 + margin,
+                         roi.dimensions.y / 2 + margin,
+                         roi.dimensions.z / 2 + margin, 1);
+  crop.setMin(min_pt);
+  crop.setMax(max_pt);
+  crop.filter(*cropped);
+  cropped->header.frame_id = cloud->header.frame_id;
+}
+
+bool RoiInsideBox(const rapid_msgs::Roi3D& roi, const double margin,
+                  const Eigen::Vector3f& min_pt,
+                  const Eigen::Vector3f& max_pt) {
+  Eigen::Affine3d roi_pose;
+  tf::transformMsgToEigen(roi.transform, roi_pose);
+  Eigen::Vector3d half(roi.dimensions.x / 2 + margin,
+                       roi.dimensions.y / 2 + margin,
+                       roi.dimensions.z / 2 + margin);
+  // The ROI may be rotated, so each of its corners is checked.
+  for (int i = 0; i < 8; ++i) {
+    Eigen::Vector3d corner((i & 1) ? half.x() : -half.x(),
+                           (i & 2) ? half.y() : -half.y(),
+                           (i & 4) ? half.z() : -half.z());
+    Eigen::Vector3f p = (roi_pose * corner).cast<float>();
+    for (int j = 0; j < 3; ++j) {
+      if (p[j] < min_pt[j] || p[j] > max_pt[j]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+template <typename PointT>
+bool CanContainRoi(const pcl::PointCloud<PointT>& cluster,
+                   const geometry_msgs::Vector3& dimensions,
+                   const double min_ratio) {
+  if (cluster.empty()) {
+    return false;
+  }
+  PointT min_pt;
+  PointT max_pt;
+  pcl::getMinMax3D(cluster, min_pt, max_pt);
+  return BoxCanContainRoi(min_pt.getVector3fMap(), max_pt.getVector3fMap(),
+                          dimensions, min_ratio);
+}
+
+bool BoxCanContainRoi(const Eigen::Vector3f& min_pt,
+                      const Eigen::Vector3f& max_pt,
+                      const geometry_msgs::Vector3& dimensions,
+                      const double min_ratio) {
+  double extents[3] = {max_pt.x() - min_pt.x(), max_pt.y() - min_pt.y(),
+                       max_pt.z() - min_pt.z()};
+  double dims[3] = {dimensions.x, dimensions.y, dimensions.z};
+  std::sort(extents, extents + 3);
+  std::sort(dims, dims + 3);
+  for (int i = 0; i < 3; ++i) {
+    if (extents[i] < min_ratio * dims[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The preprocessing functions are instantiated for these point types.
+template void CropScene<PointC>(PointCloudC::Ptr scene,
+                                PointCloudC::Ptr cropped);
+template void Downsample<PointC>(const double leaf_size,
+                                 PointCloudC::Ptr cloud_in,
+                                 PointCloudC::Ptr cloud_out);
+template void CropSceneToBox<PointC>(
+    PointCloudC::ConstPtr scene, const std::string& parent_frame_id,
+    const geometry_msgs::Transform& base_to_camera,
+    const Eigen::Affine3f& box_pose, const Eigen::Vector3f& min_pt,
+    const Eigen::Vector3f& max_pt, const bool use_organized,
+    PointCloudC::Ptr cropped);
+template void CropToRoi<PointC>(PointCloudC::ConstPtr cloud,
+                                const rapid_msgs::Roi3D& roi,
+                                const double margin, PointCloudC::Ptr cropped);
+template bool CanContainRoi<PointC>(const PointCloudC& cluster,
+                                    const geometry_msgs::Vector3& dimensions,
+                                    const double min_ratio);
+
+template void CropScene<PointG>(PointCloudG::Ptr scene,
+                                PointCloudG::Ptr cropped);
+template void Downsample<PointG>(const double leaf_size,
+                                 PointCloudG::Ptr cloud_in,
+                                 PointCloudG::Ptr cloud_out);
+template void CropSceneToBox<PointG>(
+    PointCloudG::ConstPtr scene, const std::string& parent_frame_id,
+    const geometry_msgs::Transform& base_to_camera,
+    const Eigen::Affine3f& box_pose, const Eigen::Vector3f& min_pt,
+    const Eigen::Vector3f& max_pt, const bool use_organized,
+    PointCloudG::Ptr cropped);
+template void CropToRoi<PointG>(PointCloudG::ConstPtr cloud,
+                                const rapid_msgs::Roi3D& roi,
+                                const double margin, PointCloudG::Ptr cropped);
+template bool CanContainRoi<PointG>(const PointCloudG& cluster,
+                                    const geometry_msgs::Vector3& dimensions,
+                                    const double min_ratio);
+
+double AdaptiveLeafSize(const geometry_msgs::Vector3& dimensions,
+                        const int target_points, const double min_leaf_size,
+                        const double max_leaf_size) {
+  const geometry_msgs::Vector3& d = dimensions;
+  double visible_area = d.x * d.y + d.y * d.z + d.x * d.z;
+  if (visible_area <= 0 || target_points <= 0) {
+    return max_leaf_size;
+  }
+  double leaf_size = sqrt(visible_area / target_points);
+  return std::max(min_leaf_size, std::min(leaf_size, max_leaf_size));
+}
 }  // namespace object_search
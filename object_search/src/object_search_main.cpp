@@ -19,10 +19,6 @@
 #include "rapid_viz/scene_viz.h"
 #include "ros/ros.h"
 #include "sensor_msgs/PointCloud2.h"
-#include "static_cloud_db_msgs/GetStaticCloud.h"
-#include "static_cloud_db_msgs/ListStaticClouds.h"
-#include "static_cloud_db_msgs/RemoveStaticCloud.h"
-#include "static_cloud_db_msgs/SaveStaticCloud.h"
 #include "visualization_msgs/Marker.h"
 #include "visualization_msgs/MarkerArray.h"
 
@@ -30,6 +26,8 @@
 #include "object_search/cloud_database.h"
 #include "object_search/commands.h"
 #include "object_search/estimators.h"
+#include "object_search/frame_averager.h"
+#include "object_search/write_behind_queue.h"
 
 using sensor_msgs::PointCloud2;
 using pcl::PointCloud;
@@ -45,24 +43,13 @@ int main(int argc, char** argv) {
   spinner.start();
 
   // Build databases
-  ros::ServiceClient get_cloud =
-      nh.serviceClient<static_cloud_db_msgs::GetStaticCloud>(
-          "get_static_cloud");
-  ros::ServiceClient list_clouds =
-      nh.serviceClient<static_cloud_db_msgs::ListStaticClouds>(
-          "list_static_clouds");
-  ros::ServiceClient remove_cloud =
-      nh.serviceClient<static_cloud_db_msgs::RemoveStaticCloud>(
-          "remove_static_cloud");
-  ros::ServiceClient save_cloud =
-      nh.serviceClient<static_cloud_db_msgs::SaveStaticCloud>(
-          "save_static_cloud");
-  Database object_db("object_search", "objects", get_cloud, list_clouds,
-                     remove_cloud, save_cloud);
-  Database scene_db("object_search", "scenes", get_cloud, list_clouds,
-                    remove_cloud, save_cloud);
+  Database object_db(nh, "object_search", "objects");
+  Database scene_db(nh, "object_search", "scenes");
   rapid::db::NameDb scene_ndb(nh, "custom_landmarks", "scenes");
   rapid::db::NameDb scene_cloud_ndb(nh, "custom_landmarks", "scene_clouds");
+  // Declared after the scene databases so that it is drained before they are
+  // destroyed.
+  WriteBehindQueue scene_writes("scenes", 5, ros::WallDuration(0.5));
   rapid::db::NameDb landmark_ndb(nh, "custom_landmarks", "landmarks");
   rapid::db::NameDb landmark_cloud_ndb(nh, "custom_landmarks",
                                        "landmark_clouds");
@@ -149,7 +136,19 @@ int main(int argc, char** argv) {
   EditLandmarkCommand edit_landmark(
       &landmark_ndb, &landmark_cloud_ndb, &scene_ndb, &scene_cloud_ndb,
       &roi_server, &scene_viz, std::string(EditLandmarkCommand::kEdit));
-  RecordSceneCommand record_scene(&scene_ndb, &scene_cloud_ndb);
+  // Smooths recorded scenes. With average_continuously, the averaging window
+  // is always full, so recording doesn't wait for new frames.
+  int num_clouds = 15;
+  ros::param::param<int>("num_clouds", num_clouds, 15);
+  bool average_continuously = false;
+  ros::param::param<bool>("average_continuously", average_continuously,
+                          false);
+  FrameAverager averager(nh, "cloud_in", num_clouds);
+  if (average_continuously) {
+    averager.Start();
+  }
+  RecordSceneCommand record_scene(&scene_ndb, &scene_cloud_ndb,
+                                  &scene_writes, &averager);
   DeleteCommand delete_landmark(&landmark_ndb, &landmark_cloud_ndb, "landmark");
   DeleteCommand delete_scene(&scene_ndb, &scene_cloud_ndb, "scene");
   SetInputLandmarkCommand set_input_landmark(&landmark_ndb, &landmark_cloud_ndb,
@@ -165,13 +164,23 @@ int main(int argc, char** argv) {
 
   ShowSceneCommand show_scene(&scene_cloud_ndb, &scene_viz);
 
+  // Scenes are saved in the background, so commands that read or delete them
+  // first wait for the scenes that are still being saved.
+  AfterWritesCommand list_scenes_saved(&list_scenes, &scene_writes);
+  AfterWritesCommand list_scenes2_saved(&list_scenes2, &scene_writes);
+  AfterWritesCommand show_scene_saved(&show_scene, &scene_writes);
+  AfterWritesCommand delete_scene_saved(&delete_scene, &scene_writes);
+  AfterWritesCommand create_landmark_saved(&create_landmark, &scene_writes);
+  AfterWritesCommand edit_landmark_saved(&edit_landmark, &scene_writes);
+  AfterWritesCommand set_input_scene_saved(&set_input_scene, &scene_writes);
+
   // Build CLIs
   // Scene manager
   rapid::utils::CommandLine scene_cli("Scene manager");
-  scene_cli.AddCommand(&list_scenes);
+  scene_cli.AddCommand(&list_scenes_saved);
   scene_cli.AddCommand(&record_scene);
-  scene_cli.AddCommand(&show_scene);
-  scene_cli.AddCommand(&delete_scene);
+  scene_cli.AddCommand(&show_scene_saved);
+  scene_cli.AddCommand(&delete_scene_saved);
   scene_cli.AddCommand(&exit);
 
   // Landmark editor
@@ -183,8 +192,8 @@ int main(int argc, char** argv) {
   // Landmark manager
   rapid::utils::CommandLine landmarks_cli("Landmark manager");
   landmarks_cli.AddCommand(&list_landmarks);
-  landmarks_cli.AddCommand(&create_landmark);
-  landmarks_cli.AddCommand(&edit_landmark);
+  landmarks_cli.AddCommand(&create_landmark_saved);
+  landmarks_cli.AddCommand(&edit_landmark_saved);
   landmarks_cli.AddCommand(&delete_landmark);
   landmarks_cli.AddCommand(&exit);
 
@@ -194,12 +203,12 @@ int main(int argc, char** argv) {
                             "- Edit landmarks");
 
   rapid::utils::CommandLine cli("Custom landmarks CLI");
-  cli.AddCommand(&list_scenes2);
+  cli.AddCommand(&list_scenes2_saved);
   cli.AddCommand(&list_landmarks2);
   cli.AddCommand(&edit_scenes);
   cli.AddCommand(&edit_landmarks);
   cli.AddCommand(&set_input_landmark);
-  cli.AddCommand(&set_input_scene);
+  cli.AddCommand(&set_input_scene_saved);
   cli.AddCommand(&run);
   cli.AddCommand(&set_debug);
   cli.AddCommand(&exit);
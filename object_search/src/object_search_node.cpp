@@ -1,10 +1,24 @@
 #include "object_search/object_search_node.h"
 
+#include <math.h>
+#include <algorithm>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "Eigen/Core"
-#include "pcl/filters/crop_box.h"
+#include "Eigen/Geometry"
+#include "boost/bind.hpp"
+#include "boost/ref.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/future.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread.hpp"
+#include "eigen_conversions/eigen_msg.h"
+#include "message_filters/subscriber.h"
+#include "message_filters/sync_policies/approximate_time.h"
+#include "message_filters/synchronizer.h"
+#include "pcl/common/io.h"
 #include "pcl/filters/voxel_grid.h"
 #include "pcl/point_cloud.h"
 #include "pcl/point_types.h"
@@ -13,14 +27,14 @@
 #include "rapid_perception/pose_estimation.h"
 #include "rapid_perception/pose_estimation_match.h"
 #include "rapid_perception/random_heat_mapper.h"
-#include "rapid_perception/scene.h"
-#include "rapid_perception/scene_parsing.h"
+#include "ros/callback_queue.h"
 #include "ros/ros.h"
+#include "sensor_msgs/CameraInfo.h"
+#include "sensor_msgs/Image.h"
 #include "sensor_msgs/PointCloud2.h"
-#include "static_cloud_db_msgs/GetStaticCloud.h"
-#include "static_cloud_db_msgs/ListStaticClouds.h"
-#include "static_cloud_db_msgs/RemoveStaticCloud.h"
-#include "static_cloud_db_msgs/SaveStaticCloud.h"
+#include "static_cloud_db_msgs/StaticCloudMetadata.h"
+#include "std_msgs/Bool.h"
+#include "std_msgs/Header.h"
 #include "std_msgs/String.h"
 #include "tf/tf.h"
 #include "visualization_msgs/Marker.h"
@@ -28,47 +42,296 @@
 #include "object_search/capture_roi.h"
 #include "object_search/cloud_database.h"
 #include "object_search/commands.h"
+#include "object_search/depth_image.h"
+#include "object_search/frame_averager.h"
+#include "object_search/object_search.h"
+#include "object_search/scene_buffer.h"
+#include "object_search/search_cache.h"
+#include "object_search/search_scheduler.h"
+#include "object_search/tabletop_extractor.h"
 #include "object_search_msgs/GetObjectInfo.h"
 #include "object_search_msgs/Match.h"
 #include "object_search_msgs/Search.h"
 
 typedef pcl::PointXYZRGB PointC;
 typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+typedef pcl::PointXYZ PointG;
+typedef pcl::PointCloud<pcl::PointXYZ> PointCloudG;
 
 using sensor_msgs::PointCloud2;
 
 namespace object_search {
+namespace {
+// Fills in a scene from the scene fields of a Search or RegisterScene request.
+// If a depth image is given, it is used instead of the scene's cloud.
+template <class Request>
+bool SetSceneInput(const Request& req, PreparedScene* scene) {
+  scene->parent_frame_id = req.scene.parent_frame_id;
+  scene->base_to_camera = req.scene.base_to_camera;
+  if (req.depth.data.empty()) {
+    scene->cloud.reset(new PointCloud2(req.scene.cloud));
+    return true;
+  }
+  scene->depth.reset(new sensor_msgs::Image(req.depth));
+  if (!req.rgb.data.empty()) {
+    scene->rgb.reset(new sensor_msgs::Image(req.rgb));
+  }
+  scene->camera_info.reset(new sensor_msgs::CameraInfo(req.camera_info));
+  return CanReadDepthImage(*scene->depth, scene->rgb.get());
+}
+
+// The database level of detail to fetch objects at. With adaptive leaf sizes,
+// the leaf size depends on the object's ROI, which isn't known until the object
+// arrives, so the finest leaf size the object could get is used.
+double LodLeafSize(const VoxelParams& voxel) {
+  return voxel.adaptive_leaf_size ? voxel.min_leaf_size : voxel.leaf_size;
+}
+
+// Depth, camera info and color frames are only used together if their stamps
+// are within about one frame at 30 Hz of each other.
+const double kMaxStampSkew = 0.03;
+
+typedef message_filters::sync_policies::ApproximateTime<
+    sensor_msgs::Image, sensor_msgs::CameraInfo>
+    DepthPolicy;
+typedef message_filters::sync_policies::ApproximateTime<
+    sensor_msgs::Image, sensor_msgs::CameraInfo, sensor_msgs::Image>
+    DepthRgbPolicy;
+
+bool StampsMatch(const ros::Time& a, const ros::Time& b) {
+  return fabs((a - b).toSec()) <= kMaxStampSkew;
+}
+
+void SetDepthFrame(PreparedScene* scene,
+                   const sensor_msgs::Image::ConstPtr& depth,
+                   const sensor_msgs::CameraInfo::ConstPtr& camera_info) {
+  if (scene->depth ||
+      !StampsMatch(depth->header.stamp, camera_info->header.stamp)) {
+    return;
+  }
+  scene->depth = depth;
+  scene->camera_info = camera_info;
+}
+
+void SetDepthRgbFrame(PreparedScene* scene,
+                      const sensor_msgs::Image::ConstPtr& depth,
+                      const sensor_msgs::CameraInfo::ConstPtr& camera_info,
+                      const sensor_msgs::Image::ConstPtr& rgb) {
+  if (scene->depth ||
+      !StampsMatch(depth->header.stamp, camera_info->header.stamp) ||
+      !StampsMatch(depth->header.stamp, rgb->header.stamp)) {
+    return;
+  }
+  scene->depth = depth;
+  scene->camera_info = camera_info;
+  scene->rgb = rgb;
+}
+
+// Waits for a depth image, its camera info and, if use_rgb is set, a color
+// image whose stamps all match. Frames are synchronized on a private callback
+// queue so that mismatched messages from different topics are never combined.
+bool WaitForDepthFrame(const bool use_rgb, const ros::WallDuration& timeout,
+                       PreparedScene* scene) {
+  ros::NodeHandle nh;
+  ros::CallbackQueue queue;
+  nh.setCallbackQueue(&queue);
+  message_filters::Subscriber<sensor_msgs::Image> depth_sub(nh, "depth_in", 5);
+  message_filters::Subscriber<sensor_msgs::CameraInfo> info_sub(
+      nh, "camera_info_in", 5);
+  message_filters::Subscriber<sensor_msgs::Image> rgb_sub;
+  boost::shared_ptr<message_filters::Synchronizer<DepthPolicy> > depth_sync;
+  boost::shared_ptr<message_filters::Synchronizer<DepthRgbPolicy> > rgb_sync;
+  if (use_rgb) {
+    rgb_sub.subscribe(nh, "rgb_in", 5);
+    rgb_sync.reset(new message_filters::Synchronizer<DepthRgbPolicy>(
+        DepthRgbPolicy(10), depth_sub, info_sub, rgb_sub));
+    rgb_sync->registerCallback(
+        boost::bind(&SetDepthRgbFrame, scene, _1, _2, _3));
+  } else {
+    depth_sync.reset(new message_filters::Synchronizer<DepthPolicy>(
+        DepthPolicy(10), depth_sub, info_sub));
+    depth_sync->registerCallback(boost::bind(&SetDepthFrame, scene, _1, _2));
+  }
+
+  ros::WallTime deadline = ros::WallTime::now() + timeout;
+  while (!scene->depth && ros::ok() && ros::WallTime::now() < deadline) {
+    queue.callAvailable(ros::WallDuration(0.05));
+  }
+  if (!scene->depth) {
+    ROS_ERROR("Timed out waiting for a synchronized depth frame");
+    return false;
+  }
+  return true;
+}
+
+// Describes what a change-aware search of an object compares against: the
+// object, its leaf size, the fitness threshold that decided which matches were
+// kept, and the search region, if any. A reference is only reused by searches
+// with the same key.
+std::string ChangeKey(const PreparedObject& object,
+                      const rapid_msgs::Roi3D* region,
+                      const double region_margin,
+                      const EstimatorParams& params) {
+  std::stringstream key;
+  key.precision(9);
+  key << (object.id != "" ? object.id : "name:" + object.model.name) << " "
+      << object.leaf_size << " " << params.fitness_threshold;
+  if (region != NULL) {
+    const geometry_msgs::Transform& t = region->transform;
+    key << " " << t.translation.x << " " << t.translation.y << " "
+        << t.translation.z << " " << t.rotation.x << " " << t.rotation.y << " "
+        << t.rotation.z << " " << t.rotation.w << " " << region->dimensions.x
+        << " " << region->dimensions.y << " " << region->dimensions.z << " "
+        << region_margin;
+  }
+  return key.str();
+}
+
+bool ErrorLess(const object_search_msgs::Match& a,
+               const object_search_msgs::Match& b) {
+  return a.error < b.error;
+}
+
+// Combines the matches kept from an earlier search with the new matches from
+// the changed regions. An object near the edge of a change can be found again
+// in the grown region, so duplicates are suppressed across both sets, and the
+// fitness threshold and min_results are applied to the combined matches.
+void MergeMatches(const EstimatorParams& params,
+                  std::vector<object_search_msgs::Match>* matches) {
+  std::sort(matches->begin(), matches->end(), ErrorLess);
+  if (params.nms_radius > 0) {
+    SuppressNonMaxima(params.nms_radius, matches);
+  }
+  std::vector<object_search_msgs::Match> merged;
+  for (size_t i = 0; i < matches->size(); ++i) {
+    if (matches->at(i).error <= params.fitness_threshold ||
+        static_cast<int>(merged.size()) < params.min_results) {
+      merged.push_back(matches->at(i));
+    }
+  }
+  matches->swap(merged);
+}
+
+bool Cancelled(SearchProgress* progress) {
+  return progress != NULL && progress->cancelled();
+}
+
+void SetStage(SearchProgress* progress, const std::string& stage) {
+  if (progress != NULL) {
+    progress->SetStage(stage);
+  }
+}
+}  // namespace
+
+SearchOptions::SearchOptions()
+    : is_tabletop(false),
+      max_error(0),
+      min_results(0),
+      region(),
+      region_margin(0),
+      near_last_match(false),
+      geometry_only(false) {}
+
+VoxelParams::VoxelParams()
+    : leaf_size(0.005),
+      adaptive_leaf_size(false),
+      object_point_budget(300),
+      min_leaf_size(0.003),
+      max_leaf_size(0.02) {}
+
+NodeParams::NodeParams()
+    : voxel(),
+      min_x(0.2),
+      min_y(-1),
+      min_z(0.3),
+      max_x(1.2),
+      max_y(1),
+      max_z(1.7),
+      region_margin(0.1),
+      organized_crop(true),
+      depth_input(false),
+      depth_input_rgb(true),
+      max_scene_age(2),
+      scene_ttl(60),
+      max_registered_scenes(8),
+      search_cache_ttl(10),
+      search_cache_leaf_size(0.01),
+      search_cache_size(32),
+      change_aware_search(false),
+      change_leaf_size(0.01),
+      change_min_points(2),
+      change_min_voxels(3),
+      max_changed_ratio(0.5),
+      max_change_references(8),
+      tiled_search(false),
+      tile_size_ratio(4),
+      sample_ratio(0.02),
+      max_samples(500),
+      fitness_threshold(0.0045),
+      sigma_threshold(8),
+      nms_radius(0.02),
+      tabletop_mode("merged"),
+      num_threads(4),
+      min_cluster_extent_ratio(0.5),
+      min_cluster_samples(20),
+      cache_table_plane(true),
+      table_max_angle_change(0.05),
+      table_max_offset_change(0.02),
+      table_min_inlier_ratio(0.7),
+      table_distance_threshold(0.01),
+      table_max_object_height(0.5),
+      table_cluster_tolerance(0.01),
+      table_min_cluster_size(50) {}
+
 ObjectSearchNode::ObjectSearchNode(
     const rapid::perception::PoseEstimator& estimator,
-    const RecordObjectCommand& record_object, const Database& object_db)
+    const RecordObjectCommand& record_object, const Database& object_db,
+    SceneBuffer* scene_buffer, const int max_search_queue)
     : tf_listener_(),
       estimator_(estimator),
       record_object_(record_object),
       object_db_(object_db),
-      leaf_size_(0.005),
-      min_x_(0.2),
-      min_y_(-1),
-      min_z_(0.3),
-      max_x_(1.2),
-      max_y_(1),
-      max_z_(1.7),
-      sample_ratio_(0.02),
-      max_samples_(500),
-      fitness_threshold_(0.0045),
-      sigma_threshold_(8),
-      nms_radius_(0.02) {}
+      scene_buffer_(scene_buffer),
+      parallel_search_(1),
+      tabletop_(),
+      estimator_mutex_(),
+      tabletop_mutex_(),
+      object_cache_(),
+      scene_registry_(8),
+      search_cache_(),
+      scheduler_(max_search_queue),
+      action_server_(NULL),
+      action_mutex_(),
+      action_progress_(NULL),
+      last_match_poses_(),
+      last_match_mutex_(),
+      change_refs_(),
+      change_refs_mutex_(),
+      params_(),
+      params_mutex_() {
+  UpdateParams();
+}
 
 bool ObjectSearchNode::ServeGetObjectInfo(
     object_search_msgs::GetObjectInfoRequest& req,
     object_search_msgs::GetObjectInfoResponse& resp) {
-  rapid_msgs::StaticCloud cloud;
+  boost::shared_ptr<const PreparedObject> cached =
+      object_cache_.Find(req.db_id, req.name);
+  if (cached) {
+    resp.name = cached->model.name;
+    resp.dimensions = cached->model.roi.dimensions;
+    return true;
+  }
+
+  // Only the metadata is fetched, not the object's point cloud.
+  static_cloud_db_msgs::StaticCloudMetadata info;
   if (req.db_id != "") {
-    object_db_.GetById(req.db_id, &cloud);
+    object_db_.GetInfoById(req.db_id, &info);
   } else {
-    object_db_.Get(req.name, &cloud);
+    object_db_.GetInfo(req.name, &info);
   }
-  resp.name = cloud.name;
-  resp.dimensions = cloud.roi.dimensions;
+  resp.name = info.name;
+  resp.dimensions = info.roi.dimensions;
   return true;
 }
 
@@ -78,78 +341,269 @@ bool ObjectSearchNode::ServeRecordObject(
   std::vector<std::string> args(1);
   args[0] = req.name;
   record_object_.Execute(args);
-  resp.success = record_object_.last_id() != "";
-  resp.db_id = record_object_.last_id();
+  const std::string id = record_object_.last_id();
   resp.name = record_object_.last_name();
   resp.roi = record_object_.last_roi();
+
+  // Prepare the new object while it is written to the database, from the copy
+  // the database keeps in memory until then.
+  rapid_msgs::StaticCloud model;
+  boost::shared_ptr<PreparedObject> object;
+  if (id != "" && object_db_.GetById(id, &model)) {
+    UpdateParams();
+    object.reset(new PreparedObject);
+    PrepareObject(model, CurrentParams().voxel, object.get());
+  }
+
+  // With write_behind, the ID is provisional and only valid in this process,
+  // so the response waits for the real one.
+  resp.success = id != "" && object_db_.WaitForSave(id, ros::WallDuration(30),
+                                                   &resp.db_id);
+  if (!resp.success) {
+    resp.db_id = "";
+    return true;
+  }
+
+  // The object is only cached by ID, since if the name was already taken, the
+  // database returns the older object for it. Whatever was cached for the name
+  // is dropped so the database decides.
+  object_cache_.Erase("", resp.name);
+  if (object) {
+    object->id = resp.db_id;
+    object_cache_.Insert(resp.db_id, "", object);
+  }
   return true;
 }
 
-void ObjectSearchNode::Search(const rapid_msgs::StaticCloud& scene,
-                              const rapid_msgs::StaticCloud& object,
-                              const bool is_tabletop, const double max_error,
-                              const int min_results,
-                              std::vector<object_search_msgs::Match>* matches) {
-  matches->clear();
-  UpdateParams();
+void ObjectSearchNode::OnObjectRemoved(
+    const rapid_msgs::StaticCloudInfo::ConstPtr& info) {
+  object_cache_.Erase(info->id, info->name);
+}
 
-  PointCloudC::Ptr scene_in(new PointCloudC);
+// Transforms the object model into the base frame and voxelizes it.
+void ObjectSearchNode::PrepareObject(const rapid_msgs::StaticCloud& model,
+                                     const VoxelParams& voxel,
+                                     PreparedObject* object) {
+  object->model = model;
   PointCloudC::Ptr object_in(new PointCloudC);
-  pcl::fromROSMsg(scene.cloud, *scene_in);
-  pcl::fromROSMsg(object.cloud, *object_in);
-  ROS_INFO("Scene (frame %s) has %ld points", scene_in->header.frame_id.c_str(),
-           scene_in->size());
+  pcl::fromROSMsg(model.cloud, *object_in);
   ROS_INFO("Object (frame %s) has %ld points",
            object_in->header.frame_id.c_str(), object_in->size());
 
-  PointCloudC::Ptr scene_transformed(new PointCloudC);
-  PointCloudC::Ptr object_transformed(new PointCloudC);
-  TransformToBase(scene_in, scene.parent_frame_id, scene.base_to_camera,
-                  scene_transformed);
-  TransformToBase(object_in, object.parent_frame_id, object.base_to_camera,
-                  object_transformed);
-  ROS_INFO("Scene transformed to frame %s",
-           scene_transformed->header.frame_id.c_str());
+  object->transformed.reset(new PointCloudC);
+  TransformToBase<PointC>(object_in, model.parent_frame_id,
+                          model.base_to_camera, object->transformed);
   ROS_INFO("Object transformed to frame %s",
-           object_transformed->header.frame_id.c_str());
+           object->transformed->header.frame_id.c_str());
 
-  PointCloudC::Ptr scene_cropped(new PointCloudC);
-  if (is_tabletop) {
-    ExtractTabletop(scene_transformed, scene_cropped);
-    ROS_INFO("Extracted %ld points from tabletop", scene_cropped->size());
+  object->leaf_size = ObjectLeafSize(model, voxel);
+  object->sampled.reset(new PointCloudC);
+  Downsample<PointC>(object->leaf_size, object->transformed, object->sampled);
+  ROS_INFO("Downsampled object to %d points (leaf size %f)",
+           static_cast<int>(object->sampled->size()), object->leaf_size);
+}
+
+// Crops a scene to the crop box in the base frame and voxelizes it, as the
+// scene buffer does for scenes from cloud_in. The crop box and leaf size are
+// the ones in effect when the scene is prepared.
+void ObjectSearchNode::PrepareScene(const NodeParams& config,
+                                    PreparedScene* scene) {
+  const double leaf_size = config.voxel.leaf_size;
+  scene->cropped.reset(new PointCloudC);
+  CropSceneToBase(config, *scene, NULL, 0, scene->cropped);
+  scene->crop_min = Eigen::Vector3f(config.min_x, config.min_y, config.min_z);
+  scene->crop_max = Eigen::Vector3f(config.max_x, config.max_y, config.max_z);
+
+  scene->leaf_size = leaf_size;
+  scene->downsampled.reset(new PointCloudC);
+  Downsample<PointC>(leaf_size, scene->cropped, scene->downsampled);
+}
+
+// Called on the database's background thread once the object is fetched. The
+// request may have stopped waiting by then, so this only touches the state it
+// shares with the request.
+void ObjectSearchNode::OnObjectFetched(
+    boost::shared_ptr<PreparedObject> object, const VoxelParams& voxel,
+    boost::shared_ptr<boost::promise<bool> > ready, bool success,
+    const std::string& id, const rapid_msgs::StaticCloud& model) {
+  if (success) {
+    object->id = id;
+    PrepareObject(model, voxel, object.get());
+  }
+  ready->set_value(success);
+}
+
+// Searches for a prepared object in a scene, with the params the object was
+// prepared with.
+void ObjectSearchNode::Search(const NodeParams& config,
+                              const PreparedScene& scene,
+                              const PreparedObject& object,
+                              const SearchOptions& options,
+                              SearchProgress* progress,
+                              std::vector<object_search_msgs::Match>* matches) {
+  const double max_error = options.max_error;
+  const int min_results = options.min_results;
+  const rapid_msgs::StaticCloud& model = object.model;
+  matches->clear();
+  if (Cancelled(progress)) {
+    return;
+  }
+  SetStage(progress, "preprocessing");
+
+  if (scene.depth) {
+    ROS_INFO("Scene (frame %s) is a %dx%d depth image",
+             scene.depth->header.frame_id.c_str(), scene.depth->width,
+             scene.depth->height);
   } else {
-    CropScene(scene_transformed, scene_cropped);
-    ROS_INFO("Cropped scene to %ld points", scene_cropped->size());
+    ROS_INFO("Scene (frame %s) has %d points",
+             scene.cloud->header.frame_id.c_str(),
+             scene.cloud->width * scene.cloud->height);
   }
 
-  PointCloudC::Ptr scene_sampled(new PointCloudC);
-  PointCloudC::Ptr object_sampled(new PointCloudC);
-  Downsample(scene_cropped, scene_sampled);
-  ROS_INFO("Downsampled scene to %ld points", scene_sampled->size());
-  Downsample(object_transformed, object_sampled);
+  // If we know roughly where the object is, only that region is searched.
+  // Tabletop extraction needs to see the table, so in that case the region is
+  // cropped after the tabletop objects are extracted.
+  rapid_msgs::Roi3D region;
+  double region_margin = 0;
+  bool has_region =
+      SearchRegion(config, model, options, &region, &region_margin);
 
-  rapid::perception::RandomHeatMapper* heat_mapper =
-      static_cast<rapid::perception::RandomHeatMapper*>(
-          estimator_.heat_mapper());
-  heat_mapper->set_sample_ratio(sample_ratio_);
-  heat_mapper->set_max_samples(max_samples_);
-
-  estimator_.set_sigma_threshold(sigma_threshold_);
-  estimator_.set_nms_radius(nms_radius_);
-  estimator_.set_num_candidates(max_samples_);
-
-  estimator_.set_scene(scene_sampled);
-  estimator_.set_object(object_sampled);
-  estimator_.set_roi(object.roi);
-  if (max_error == 0) {
-    estimator_.set_fitness_threshold(fitness_threshold_);
+  PointCloudC::Ptr scene_cropped(new PointCloudC);
+  // With geometry_only, the cropped scene without color. The estimator takes
+  // colored points, so the scene is widened back to them, but only as late as
+  // possible: the plain search only widens the downsampled scene.
+  PointCloudG::Ptr scene_geometry;
+  std::vector<PointCloudC::Ptr> clusters;
+  if (options.is_tabletop) {
+    // Tabletop extraction needs the whole scene, so a depth image is fully
+    // converted here.
+    PointCloudC::Ptr scene_in(new PointCloudC);
+    if (scene.depth) {
+      DepthImageToCloud(*scene.depth, scene.rgb.get(), *scene.camera_info,
+                        scene_in.get());
+    } else {
+      pcl::fromROSMsg(*scene.cloud, *scene_in);
+    }
+    PointCloudC::Ptr scene_transformed(new PointCloudC);
+    TransformToBase<PointC>(scene_in, scene.parent_frame_id,
+                            scene.base_to_camera, scene_transformed);
+    ExtractTabletopClusters(config, scene_transformed, &clusters);
+    if (has_region) {
+      std::vector<PointCloudC::Ptr> region_clusters;
+      for (size_t i = 0; i < clusters.size(); ++i) {
+        PointCloudC::Ptr cropped(new PointCloudC);
+        CropToRoi<PointC>(clusters[i], region, region_margin, cropped);
+        if (!cropped->empty()) {
+          region_clusters.push_back(cropped);
+        }
+      }
+      clusters.swap(region_clusters);
+    }
+    for (size_t i = 0; i < clusters.size(); ++i) {
+      *scene_cropped += *clusters[i];
+    }
+    scene_cropped->header.frame_id = scene_transformed->header.frame_id;
+    ROS_INFO("Extracted %d points in %d clusters from tabletop",
+             static_cast<int>(scene_cropped->size()),
+             static_cast<int>(clusters.size()));
+  } else if (scene.cropped && !has_region) {
+    // The scene was already cropped to the crop box in the background. It was
+    // cropped and voxelized in color, so geometry_only has nothing left to
+    // save here and is ignored.
+    scene_cropped = scene.cropped;
+  } else if (scene.cropped &&
+             RoiInsideBox(region, region_margin, scene.crop_min,
+                          scene.crop_max)) {
+    CropToRoi<PointC>(scene.cropped, region, region_margin, scene_cropped);
+    ROS_INFO("Cropped prepared scene to %d points in search region",
+             static_cast<int>(scene_cropped->size()));
+  } else if (options.geometry_only && !scene.depth) {
+    scene_geometry.reset(new PointCloudG);
+    CropSceneGeometryToBase(config, scene, has_region ? &region : NULL,
+                            region_margin, scene_geometry);
   } else {
-    estimator_.set_fitness_threshold(max_error);
+    // This is also the path for regions that extend past the crop box of a
+    // prepared scene, whose points outside the box were already dropped.
+    CropSceneToBase(config, scene, has_region ? &region : NULL, region_margin,
+                    scene_cropped);
   }
-  estimator_.set_min_results(min_results);
 
+  if (Cancelled(progress)) {
+    return;
+  }
+
+  // The scene is voxelized at the same resolution as the object so that the
+  // two point densities match.
+  const double leaf_size = object.leaf_size;
+
+  SetStage(progress, "estimating");
+  EstimatorParams params =
+      CurrentEstimatorParams(config, max_error, min_results);
   std::vector<rapid::perception::PoseEstimationMatch> pe_matches;
-  estimator_.Find(&pe_matches);
+  // Matches from the last search that are outside the parts of the scene that
+  // changed since, with change_aware_search.
+  std::vector<object_search_msgs::Match> kept_matches;
+  const bool change_aware = config.change_aware_search && !options.is_tabletop;
+  std::string change_key;
+  if (change_aware) {
+    change_key = ChangeKey(object, has_region ? &region : NULL, region_margin,
+                           params);
+  }
+  // Change-aware and tiled searches work on the whole cropped scene.
+  if (scene_geometry && (change_aware || config.tiled_search)) {
+    pcl::copyPointCloud(*scene_geometry, *scene_cropped);
+  }
+  if (options.is_tabletop && config.tabletop_mode == "clusters") {
+    SearchClusters(config, clusters, object.sampled, model.roi, leaf_size,
+                   params, progress, &pe_matches);
+  } else if (change_aware &&
+             SearchChanges(config, scene_cropped, change_key, object, params,
+                           progress, &pe_matches, &kept_matches)) {
+    // Only the changed regions were searched.
+  } else if (config.tiled_search) {
+    bool use_prepared = scene_cropped == scene.cropped;
+    SearchTiles(config,
+                use_prepared ? scene.DownsampledAt(leaf_size) : scene_cropped,
+                use_prepared, object, params, progress, &pe_matches);
+  } else {
+    PointCloudC::Ptr scene_sampled(new PointCloudC);
+    if (scene_cropped == scene.cropped) {
+      scene_sampled = scene.DownsampledAt(leaf_size);
+      ROS_INFO("Using prepared scene with %d points",
+               static_cast<int>(scene_sampled->size()));
+    } else if (scene_geometry) {
+      PointCloudG::Ptr sampled_geometry(new PointCloudG);
+      Downsample<PointG>(leaf_size, scene_geometry, sampled_geometry);
+      pcl::copyPointCloud(*sampled_geometry, *scene_sampled);
+      ROS_INFO("Downsampled scene geometry to %d points",
+               static_cast<int>(scene_sampled->size()));
+    } else {
+      Downsample<PointC>(leaf_size, scene_cropped, scene_sampled);
+      ROS_INFO("Downsampled scene to %d points",
+               static_cast<int>(scene_sampled->size()));
+    }
+
+    boost::mutex::scoped_lock lock(estimator_mutex_);
+    ConfigureEstimator(params, &estimator_);
+    estimator_.set_scene(scene_sampled);
+    estimator_.set_object(object.sampled);
+    estimator_.set_roi(model.roi);
+    estimator_.Find(&pe_matches);
+    if (progress != NULL) {
+      double best_fitness = -1;
+      for (size_t i = 0; i < pe_matches.size(); ++i) {
+        if (best_fitness < 0 || pe_matches[i].fitness() < best_fitness) {
+          best_fitness = pe_matches[i].fitness();
+        }
+      }
+      progress->AddCandidates(NumCandidates(params, scene_sampled->size()),
+                              best_fitness);
+    }
+  }
+
+  // If the search was cancelled, the matches found so far are returned, but
+  // aren't remembered for near_last_match.
+  bool cancelled = Cancelled(progress);
 
   for (size_t i = 0; i < pe_matches.size(); ++i) {
     const rapid::perception::PoseEstimationMatch& match = pe_matches[i];
@@ -159,123 +613,941 @@ void ObjectSearchNode::Search(const rapid_msgs::StaticCloud& scene,
     msg.error = match.fitness();
     matches->push_back(msg);
   }
+  if (!kept_matches.empty()) {
+    matches->insert(matches->end(), kept_matches.begin(), kept_matches.end());
+    MergeMatches(params, matches);
+  }
+
+  // The reference only keeps matches under the threshold. The others were only
+  // returned to make min_results, and would otherwise be returned again by
+  // later searches as if they had passed.
+  if (change_aware && !cancelled) {
+    boost::mutex::scoped_lock lock(change_refs_mutex_);
+    ChangeReference& reference = change_refs_[change_key];
+    reference.scene = scene_cropped;
+    reference.matches.clear();
+    for (size_t i = 0; i < matches->size(); ++i) {
+      if (matches->at(i).error <= params.fitness_threshold) {
+        reference.matches.push_back(matches->at(i));
+      }
+    }
+    reference.last_used = ros::WallTime::now();
+    while (static_cast<int>(change_refs_.size()) >
+           config.max_change_references) {
+      std::map<std::string, ChangeReference>::iterator oldest =
+          change_refs_.begin();
+      for (std::map<std::string, ChangeReference>::iterator it =
+               change_refs_.begin();
+           it != change_refs_.end(); ++it) {
+        if (it->second.last_used < oldest->second.last_used) {
+          oldest = it;
+        }
+      }
+      change_refs_.erase(oldest);
+    }
+  }
+
+  // Matches that are only returned to make min_results are not remembered,
+  // so that near_last_match isn't drawn toward a bad pose.
+  if (matches->size() > 0 && !cancelled) {
+    size_t best = 0;
+    for (size_t i = 1; i < matches->size(); ++i) {
+      if (matches->at(i).error < matches->at(best).error) {
+        best = i;
+      }
+    }
+    if (matches->at(best).error <= params.fitness_threshold) {
+      boost::mutex::scoped_lock lock(last_match_mutex_);
+      last_match_poses_[model.name] = matches->at(best).pose;
+    }
+  }
+}
+
+// Searches only the parts of the scene that changed since the object was last
+// searched for. Earlier matches that the object could overlap a change from are
+// dropped, and the rest are returned in kept_matches. The changed regions are
+// grown by the size of the object, so that they contain any object that
+// overlaps a change, and searched like tabletop clusters.
+//
+// Returns false if there is no reference scene with the given key, or if too
+// much of the scene changed, in which case the whole scene should be searched.
+bool ObjectSearchNode::SearchChanges(
+    const NodeParams& config, PointCloudC::ConstPtr scene,
+    const std::string& key, const PreparedObject& object,
+    const EstimatorParams& params, SearchProgress* progress,
+    std::vector<rapid::perception::PoseEstimationMatch>* new_matches,
+    std::vector<object_search_msgs::Match>* kept_matches) {
+  const rapid_msgs::StaticCloud& model = object.model;
+  ChangeReference reference;
+  {
+    boost::mutex::scoped_lock lock(change_refs_mutex_);
+    std::map<std::string, ChangeReference>::iterator it =
+        change_refs_.find(key);
+    if (it == change_refs_.end()) {
+      return false;
+    }
+    it->second.last_used = ros::WallTime::now();
+    reference = it->second;
+  }
+
+  SceneDiff diff;
+  diff.set_leaf_size(config.change_leaf_size);
+  diff.set_min_points(config.change_min_points);
+  diff.set_min_voxels(config.change_min_voxels);
+  std::vector<ChangedRegion> changes;
+  diff.Compare(*reference.scene, *scene, &changes);
+  ROS_INFO("%d voxels (%.1f%%) changed in %d regions since the last search "
+           "for %s",
+           diff.num_changed_voxels(), 100 * diff.changed_ratio(),
+           static_cast<int>(changes.size()), model.name.c_str());
+  if (diff.changed_ratio() > config.max_changed_ratio) {
+    return false;
+  }
+
+  const geometry_msgs::Vector3& dims = model.roi.dimensions;
+  const double object_size = std::max(dims.x, std::max(dims.y, dims.z));
+  std::vector<ChangedRegion> overlapped(changes);
+  GrowRegions(object_size / 2, &overlapped);
+  kept_matches->clear();
+  for (size_t i = 0; i < reference.matches.size(); ++i) {
+    const geometry_msgs::Point& position = reference.matches[i].pose.position;
+    Eigen::Vector3f center(position.x, position.y, position.z);
+    if (!InAnyRegion(center, overlapped)) {
+      kept_matches->push_back(reference.matches[i]);
+    }
+  }
+
+  std::vector<ChangedRegion> search_regions(changes);
+  GrowRegions(object_size, &search_regions);
+  std::vector<PointCloudC::Ptr> region_clouds;
+  CropToRegions(*scene, search_regions, &region_clouds);
+  ROS_INFO("Kept %d of %d earlier matches, searching %d changed regions",
+           static_cast<int>(kept_matches->size()),
+           static_cast<int>(reference.matches.size()),
+           static_cast<int>(region_clouds.size()));
+  new_matches->clear();
+  if (!region_clouds.empty()) {
+    SearchClusters(config, region_clouds, object.sampled, model.roi,
+                   object.leaf_size, params, progress, new_matches);
+  }
+  return true;
+}
+
+// Splits a large scene into overlapping tiles a few times the size of the
+// object, and searches the tiles in parallel. Each tile is gathered and
+// downsampled on its own when a worker gets to it, so the full-resolution scene
+// is never copied or voxelized at once, and only the tiles being searched are
+// held in memory. Tiles overlap by the size of the object, so each object is
+// entirely inside some tile, and matches found in more than one tile are
+// suppressed.
+void ObjectSearchNode::SearchTiles(
+    const NodeParams& config, PointCloudC::ConstPtr scene, const bool sampled,
+    const PreparedObject& object, const EstimatorParams& params,
+    SearchProgress* progress,
+    std::vector<rapid::perception::PoseEstimationMatch>* matches) {
+  const rapid_msgs::StaticCloud& model = object.model;
+  const geometry_msgs::Vector3& dims = model.roi.dimensions;
+  const double object_size = std::max(dims.x, std::max(dims.y, dims.z));
+  SceneTiles tiles(*scene, config.tile_size_ratio * object_size, object_size);
+  ROS_INFO("Searching %d tiles of %.2fm", static_cast<int>(tiles.size()),
+           config.tile_size_ratio * object_size);
+
+  // Tiles too small to contain the object are dropped before the budget is
+  // split, so that their share goes to the tiles that are searched.
+  std::vector<size_t> searched;
+  std::vector<int> num_points;
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    Eigen::Vector3f min_pt;
+    Eigen::Vector3f max_pt;
+    tiles.Bounds(i, &min_pt, &max_pt);
+    if (BoxCanContainRoi(min_pt, max_pt, dims,
+                         config.min_cluster_extent_ratio)) {
+      searched.push_back(i);
+      num_points.push_back(tiles.num_points(i));
+    }
+  }
+  std::vector<int> num_samples;
+  SplitSampleBudget(num_points, params.max_samples, config.min_cluster_samples,
+                    &num_samples);
+  boost::mutex::scoped_lock lock(estimator_mutex_);
+  parallel_search_.set_num_threads(config.num_threads);
+  parallel_search_.set_object(object.sampled, model.roi);
+  parallel_search_.set_params(params);
+  parallel_search_.set_progress(progress);
+  parallel_search_.set_nms_radius(params.nms_radius);
+  parallel_search_.Find(searched.size(),
+                        boost::bind(&ObjectSearchNode::LoadTile, this,
+                                    boost::cref(tiles), boost::cref(searched),
+                                    sampled, boost::cref(object), _1),
+                        num_samples, matches);
+  parallel_search_.set_nms_radius(0);
+  parallel_search_.set_progress(NULL);
+}
+
+// Gathers the index-th of the searched tiles for SearchTiles, and downsamples
+// it unless the scene was already downsampled. Called on the parallel search's
+// worker threads.
+PointCloudC::Ptr ObjectSearchNode::LoadTile(const SceneTiles& tiles,
+                                            const std::vector<size_t>& searched,
+                                            const bool sampled,
+                                            const PreparedObject& object,
+                                            const size_t index) {
+  PointCloudC::Ptr tile(new PointCloudC);
+  tiles.Extract(searched[index], tile.get());
+  if (sampled) {
+    return tile;
+  }
+  PointCloudC::Ptr tile_sampled(new PointCloudC);
+  Downsample<PointC>(object.leaf_size, tile, tile_sampled);
+  return tile_sampled;
+}
+
+// Gets the region to search for the object in, if any. The region comes from
+// the request, or from where the object was last found if near_last_match is
+// set. Returns false if the whole scene should be searched.
+bool ObjectSearchNode::SearchRegion(const NodeParams& config,
+                                    const rapid_msgs::StaticCloud& object,
+                                    const SearchOptions& options,
+                                    rapid_msgs::Roi3D* region,
+                                    double* margin) {
+  const geometry_msgs::Vector3& dims = options.region.dimensions;
+  if (dims.x != 0 || dims.y != 0 || dims.z != 0) {
+    *region = options.region;
+    *margin = options.region_margin;
+    return true;
+  }
+  if (!options.near_last_match) {
+    return false;
+  }
+
+  boost::mutex::scoped_lock lock(last_match_mutex_);
+  std::map<std::string, geometry_msgs::Pose>::const_iterator it =
+      last_match_poses_.find(object.name);
+  if (it == last_match_poses_.end()) {
+    ROS_INFO("No previous match for %s, searching the whole scene",
+             object.name.c_str());
+    return false;
+  }
+  const geometry_msgs::Pose& pose = it->second;
+  region->transform.translation.x = pose.position.x;
+  region->transform.translation.y = pose.position.y;
+  region->transform.translation.z = pose.position.z;
+  region->transform.rotation = pose.orientation;
+  region->dimensions = object.roi.dimensions;
+  *margin = options.region_margin != 0 ? options.region_margin
+                                       : config.region_margin;
+  return true;
+}
+
+bool ObjectSearchNode::ServeRegisterScene(
+    object_search_msgs::RegisterSceneRequest& req,
+    object_search_msgs::RegisterSceneResponse& resp) {
+  UpdateParams();
+  const NodeParams config = CurrentParams();
+  boost::shared_ptr<PreparedScene> scene(new PreparedScene);
+  if (!SetSceneInput(req, scene.get())) {
+    return false;
+  }
+  PrepareScene(config, scene.get());
+  resp.ttl = req.ttl > 0 ? req.ttl : config.scene_ttl;
+  resp.handle = scene_registry_.Register(scene, ros::WallDuration(resp.ttl));
+  ROS_INFO("Registered scene %s (%d points after cropping)",
+           resp.handle.c_str(), static_cast<int>(scene->cropped->size()));
+  return true;
+}
+
+bool ObjectSearchNode::ServeReleaseScene(
+    object_search_msgs::ReleaseSceneRequest& req,
+    object_search_msgs::ReleaseSceneResponse& resp) {
+  resp.success = scene_registry_.Release(req.handle);
+  return true;
 }
 
 bool ObjectSearchNode::ServeSearch(object_search_msgs::SearchRequest& req,
                                    object_search_msgs::SearchResponse& resp) {
-  Search(req.scene, req.object, req.is_tabletop, req.max_error, req.min_results,
-         &resp.matches);
-  return true;
+  UpdateParams();
+  const NodeParams config = CurrentParams();
+  boost::shared_ptr<const PreparedScene> scene;
+  if (req.scene_handle != "") {
+    scene = scene_registry_.Find(req.scene_handle);
+    if (!scene) {
+      ROS_ERROR("Unknown or expired scene handle: %s",
+                req.scene_handle.c_str());
+      return false;
+    }
+  } else {
+    boost::shared_ptr<PreparedScene> new_scene(new PreparedScene);
+    if (!SetSceneInput(req, new_scene.get())) {
+      return false;
+    }
+    scene = new_scene;
+  }
+  PreparedObject object;
+  PrepareObject(req.object, config.voxel, &object);
+  SearchOptions options(req);
+  // The object comes with the request, so there is no cheap key to coalesce
+  // identical requests by.
+  return ScheduleSearch("", req.priority,
+                        boost::bind(&ObjectSearchNode::Search, this,
+                                    boost::cref(config), boost::cref(*scene),
+                                    boost::cref(object), boost::cref(options),
+                                    static_cast<SearchProgress*>(NULL), _1),
+                        NULL, &resp.matches);
 }
 
 bool ObjectSearchNode::ServeSearchFromDb(
     object_search_msgs::SearchFromDbRequest& req,
     object_search_msgs::SearchFromDbResponse& resp) {
-  // Read scene from cloud_in
-  PointCloud2::ConstPtr cloud_in =
-      ros::topic::waitForMessage<PointCloud2>("cloud_in", ros::Duration(10));
-  rapid_msgs::StaticCloud scene;
-  scene.cloud = *cloud_in;
+  return SearchFromDb(req, NULL, &resp.matches);
+}
 
-  // Get transform
-  scene.parent_frame_id = "base_link";
-  try {
-    tf::StampedTransform base_to_camera_tf;
-    tf_listener_.lookupTransform(scene.cloud.header.frame_id, "base_link",
-                                 scene.cloud.header.stamp, base_to_camera_tf);
-    tf::transformTFToMsg(base_to_camera_tf, scene.base_to_camera);
-  } catch (tf::TransformException e) {
-    ROS_WARN("%s", e.what());
+// Runs a search action. The goal is the same as a SearchFromDb request, and
+// the search is cancelled if the goal is preempted.
+void ObjectSearchNode::ExecuteSearchAction(
+    const object_search_msgs::SearchFromDbGoalConstPtr& goal) {
+  object_search_msgs::SearchFromDbRequest req;
+  req.object_id = goal->object_id;
+  req.name = goal->name;
+  req.is_tabletop = goal->is_tabletop;
+  req.max_error = goal->max_error;
+  req.min_results = goal->min_results;
+  req.region = goal->region;
+  req.region_margin = goal->region_margin;
+  req.near_last_match = goal->near_last_match;
+  req.priority = goal->priority;
+  req.geometry_only = goal->geometry_only;
+
+  SearchProgress progress(
+      boost::bind(&ObjectSearchNode::PublishSearchFeedback, this, _1, _2, _3));
+  {
+    boost::mutex::scoped_lock lock(action_mutex_);
+    action_progress_ = &progress;
+    // The goal may have been preempted before the progress was set.
+    if (action_server_->isPreemptRequested()) {
+      progress.Cancel();
+    }
+  }
+  object_search_msgs::SearchFromDbResult result;
+  bool success = SearchFromDb(req, &progress, &result.matches);
+  {
+    boost::mutex::scoped_lock lock(action_mutex_);
+    action_progress_ = NULL;
   }
 
-  rapid_msgs::StaticCloud object;
-  ROS_INFO("object_id: %s, name: %s", req.object_id.c_str(), req.name.c_str());
+  if (progress.cancelled() || action_server_->isPreemptRequested()) {
+    ROS_INFO("Search for %s preempted with %d partial matches",
+             req.name.c_str(), static_cast<int>(result.matches.size()));
+    action_server_->setPreempted(result);
+  } else if (success) {
+    action_server_->setSucceeded(result);
+  } else {
+    action_server_->setAborted(result);
+  }
+}
+
+// Called by the action server when the current goal is preempted.
+void ObjectSearchNode::PreemptSearchAction() {
+  boost::mutex::scoped_lock lock(action_mutex_);
+  if (action_progress_ != NULL) {
+    action_progress_->Cancel();
+  }
+}
+
+void ObjectSearchNode::set_action_server(SearchActionServer* action_server) {
+  action_server_ = action_server;
+}
+
+void ObjectSearchNode::PublishSearchFeedback(const std::string& stage,
+                                             const int candidates,
+                                             const double best_fitness) {
+  object_search_msgs::SearchFromDbFeedback feedback;
+  feedback.stage = stage;
+  feedback.candidates_evaluated = candidates;
+  feedback.best_fitness = best_fitness;
+  action_server_->publishFeedback(feedback);
+}
+
+// Caches an object fetched for a SearchFromDb request. An object fetched by ID
+// is only cached by ID, since with repeated names it may not be the object the
+// database returns for its name.
+void ObjectSearchNode::CacheObject(
+    const object_search_msgs::SearchFromDbRequest& req,
+    const boost::shared_ptr<const PreparedObject>& object) {
   if (req.object_id != "") {
-    bool success = object_db_.GetById(req.object_id, &object);
-    if (!success) {
-      ROS_ERROR("Invalid ID: %s", req.object_id.c_str());
+    object_cache_.Insert(req.object_id, "", object);
+  } else {
+    object_cache_.Insert("", object->model.name, object);
+  }
+}
+
+// Finds an object from the database in the latest scene. If progress is not
+// NULL, progress is reported to it, and the search stops early if it is
+// cancelled, returning the matches found so far.
+bool ObjectSearchNode::SearchFromDb(
+    const object_search_msgs::SearchFromDbRequest& req,
+    SearchProgress* progress,
+    std::vector<object_search_msgs::Match>* matches) {
+  UpdateParams();
+  const NodeParams config = CurrentParams();
+  const VoxelParams& voxel = config.voxel;
+  SetStage(progress, "fetching object");
+
+  ROS_INFO("object_id: %s, name: %s", req.object_id.c_str(), req.name.c_str());
+  boost::shared_ptr<const PreparedObject> object =
+      object_cache_.Find(req.object_id, req.name);
+  if (object && object->leaf_size != ObjectLeafSize(object->model, voxel)) {
+    // The voxelization params have changed since the object was cached. The
+    // cached model is the level of detail for the old leaf size, so the object
+    // is fetched again, and replaces the cached one once it is prepared.
+    object.reset();
+  }
+
+  // If the object isn't cached, fetch and preprocess it in the background
+  // while the scene is acquired, so the database round trip is hidden behind
+  // the camera wait.
+  boost::shared_ptr<PreparedObject> fetched(new PreparedObject);
+  boost::shared_ptr<boost::promise<bool> > object_ready(
+      new boost::promise<bool>);
+  boost::unique_future<bool> object_fetched = object_ready->get_future();
+  if (!object) {
+    Database::GetCallback done =
+        boost::bind(&ObjectSearchNode::OnObjectFetched, fetched, voxel,
+                    object_ready, _1, _2, _3);
+    // Ask the database for a level of detail close to the leaf size the
+    // object will be voxelized at.
+    if (req.object_id != "") {
+      object_db_.GetByIdAsync(req.object_id, LodLeafSize(voxel), done);
+    } else {
+      object_db_.GetAsync(req.name, LodLeafSize(voxel), done);
+    }
+  }
+
+  // Use the newest scene from the scene buffer if there is one, otherwise wait
+  // for the next cloud on cloud_in.
+  SetStage(progress, "waiting for scene");
+  boost::shared_ptr<const PreparedScene> scene;
+  if (scene_buffer_ != NULL) {
+    scene = scene_buffer_->Latest(ros::Duration(10),
+                                  ros::Duration(config.max_scene_age));
+  } else {
+    boost::shared_ptr<PreparedScene> new_scene(new PreparedScene);
+    if (WaitForScene(config, new_scene.get())) {
+      scene = new_scene;
+    }
+  }
+  if (!scene) {
+    ROS_ERROR("No recent scene received from cloud_in");
+    return false;
+  }
+
+  if (!object) {
+    // The database thread may be stuck behind other requests, so the search
+    // gives up instead of blocking its service thread indefinitely.
+    if (!object_fetched.timed_wait(boost::posix_time::seconds(10))) {
+      ROS_ERROR("Timed out fetching the object from the database");
+      return false;
+    }
+    if (!object_fetched.get()) {
+      if (req.object_id != "") {
+        ROS_ERROR("Invalid ID: %s", req.object_id.c_str());
+      } else {
+        ROS_ERROR("Invalid name: %s", req.name.c_str());
+      }
+      return false;
+    }
+    CacheObject(req, fetched);
+    object = fetched;
+  }
+  if (Cancelled(progress)) {
+    return false;
+  }
+
+  // A repeated search for the same object in an unchanged scene returns the
+  // earlier result, or joins it if it is still running. Only prepared scenes
+  // can be hashed cheaply.
+  SearchOptions options(req);
+  // The last match moves as other searches finish, so the region near it is
+  // resolved once here, and both the cache key and the search use it.
+  if (options.near_last_match) {
+    rapid_msgs::Roi3D region;
+    double region_margin = 0;
+    if (SearchRegion(config, object->model, options, &region, &region_margin)) {
+      options.region = region;
+      options.region_margin = region_margin;
+    }
+    options.near_last_match = false;
+  }
+  std::string cache_key;
+  if (scene->downsampled) {
+    cache_key = SearchCacheKey(config, *scene, *object, options);
+  }
+  if (config.search_cache_ttl > 0 && cache_key != "") {
+    bool hit = search_cache_.Find(cache_key, matches);
+    ROS_INFO("Search cache %s (%d hits, %d misses, %d expired, %d entries)",
+             hit ? "hit" : "miss", search_cache_.num_hits(),
+             search_cache_.num_misses(), search_cache_.num_expired(),
+             static_cast<int>(search_cache_.size()));
+    if (hit) {
+      return true;
+    }
+  }
+
+  // Cancellable searches aren't coalesced, since a cancelled search would
+  // hand its partial result to the requests that joined it.
+  SetStage(progress, "queued");
+  if (!ScheduleSearch(progress == NULL ? cache_key : "", req.priority,
+                      boost::bind(&ObjectSearchNode::Search, this,
+                                  boost::cref(config), boost::cref(*scene),
+                                  boost::cref(*object), boost::cref(options),
+                                  progress, _1),
+                      progress, matches)) {
+    return false;
+  }
+  if (config.search_cache_ttl > 0 && cache_key != "" && !Cancelled(progress)) {
+    search_cache_.Insert(cache_key, *matches);
+  }
+  return true;
+}
+
+// Runs a search through the scheduler. Returns false if it was rejected. If
+// progress is cancelled while the search is queued, the search never runs.
+bool ObjectSearchNode::ScheduleSearch(
+    const std::string& key, const int priority,
+    const SearchScheduler::Work& work, SearchProgress* progress,
+    std::vector<object_search_msgs::Match>* matches) {
+  SearchScheduler::Cancelled cancelled;
+  if (progress != NULL) {
+    cancelled = boost::bind(&SearchProgress::cancelled, progress);
+  }
+  if (!scheduler_.Run(key, priority, work, cancelled, matches)) {
+    ROS_WARN(
+        "Search queue is full, rejecting request with priority %d (%d "
+        "rejected so far)",
+        priority, scheduler_.num_rejected());
+    return false;
+  }
+  return true;
+}
+
+void ObjectSearchNode::Preload() {
+  UpdateParams();
+  const NodeParams config = CurrentParams();
+  const VoxelParams& voxel = config.voxel;
+  std::vector<rapid_msgs::StaticCloudInfo> infos;
+  object_db_.List(&infos);
+  std::vector<std::string> ids;
+  for (size_t i = 0; i < infos.size(); ++i) {
+    ids.push_back(infos[i].id);
+  }
+
+  // Each worker fetches one object at a time at the level of detail it will be
+  // voxelized at, so the whole library is never held in memory at full
+  // resolution, and fetching overlaps with preparing.
+  ros::Time start = ros::Time::now();
+  std::vector<boost::shared_ptr<PreparedObject> > objects(ids.size());
+  size_t next = 0;
+  boost::mutex mutex;
+  boost::thread_group workers;
+  for (int i = 0; i < std::max(1, config.num_threads); ++i) {
+    workers.create_thread(boost::bind(&ObjectSearchNode::PreloadWorker, this,
+                                      &ids, &voxel, &objects, &next, &mutex));
+  }
+  workers.join_all();
+
+  // Insert in reverse so that if names are repeated, the first object with
+  // that name wins, as it does in the database.
+  int num_loaded = 0;
+  for (size_t i = objects.size(); i > 0; --i) {
+    if (objects[i - 1]) {
+      object_cache_.Insert(ids[i - 1], objects[i - 1]->model.name,
+                           objects[i - 1]);
+      ++num_loaded;
+    }
+  }
+  if (num_loaded < static_cast<int>(ids.size())) {
+    ROS_WARN("Failed to preload %d objects, they will be loaded on demand",
+             static_cast<int>(ids.size()) - num_loaded);
+  }
+  ROS_INFO("Preloaded %d objects in %f seconds", num_loaded,
+           (ros::Time::now() - start).toSec());
+}
+
+void ObjectSearchNode::PreloadWorker(
+    const std::vector<std::string>* ids, const VoxelParams* voxel,
+    std::vector<boost::shared_ptr<PreparedObject> >* objects, size_t* next,
+    boost::mutex* mutex) {
+  while (true) {
+    size_t index;
+    {
+      boost::mutex::scoped_lock lock(*mutex);
+      if (*next >= ids->size()) {
+        return;
+      }
+      index = (*next)++;
+    }
+    rapid_msgs::StaticCloud model;
+    std::string id;
+    if (!object_db_.GetById(ids->at(index), LodLeafSize(*voxel), &model,
+                            &id)) {
+      continue;
+    }
+    boost::shared_ptr<PreparedObject> object(new PreparedObject);
+    object->id = id;
+    PrepareObject(model, *voxel, object.get());
+    objects->at(index) = object;
+  }
+}
+
+// Waits for the next cloud on cloud_in, and looks up its transform.
+bool ObjectSearchNode::WaitForScene(const NodeParams& config,
+                                    PreparedScene* scene) {
+  std_msgs::Header header;
+  if (config.depth_input) {
+    // The depth image is much smaller than the cloud it would make, and only
+    // the part inside the crop box is converted.
+    if (!WaitForDepthFrame(config.depth_input_rgb, ros::WallDuration(10),
+                           scene) ||
+        !CanReadDepthImage(*scene->depth, scene->rgb.get())) {
       return false;
     }
+    header = scene->depth->header;
   } else {
-    bool success = object_db_.Get(req.name, &object);
-    if (!success) {
-      ROS_ERROR("Invalid name: %s", req.name.c_str());
+    PointCloud2::ConstPtr cloud_in = ros::topic::waitForMessage<PointCloud2>(
+        "cloud_in", ros::Duration(10));
+    if (!cloud_in) {
       return false;
     }
+    scene->cloud = cloud_in;
+    header = cloud_in->header;
   }
 
-  Search(scene, object, req.is_tabletop, req.max_error, req.min_results,
-         &resp.matches);
+  // Get transform
+  scene->parent_frame_id = "base_link";
+  try {
+    tf::StampedTransform base_to_camera_tf;
+    tf_listener_.lookupTransform(header.frame_id, "base_link", header.stamp,
+                                 base_to_camera_tf);
+    tf::transformTFToMsg(base_to_camera_tf, scene->base_to_camera);
+  } catch (tf::TransformException e) {
+    ROS_WARN("%s", e.what());
+  }
   return true;
 }
 
 void ObjectSearchNode::UpdateParams() {
-  ros::param::param<double>("leaf_size", leaf_size_, 0.005);
-  ros::param::param<double>("min_x", min_x_, 0.3);
-  ros::param::param<double>("min_y", min_y_, -0.75);
-  ros::param::param<double>("min_z", min_z_, 0.3);
-  ros::param::param<double>("max_x", max_x_, 1.2);
-  ros::param::param<double>("max_y", max_y_, 0.75);
-  ros::param::param<double>("max_z", max_z_, 1.7);
-  ros::param::param<double>("sample_ratio", sample_ratio_, 0.02);
-  ros::param::param<int>("max_samples", max_samples_, 500);
-  ros::param::param<double>("fitness_threshold", fitness_threshold_, 0.0055);
-  ros::param::param<double>("sigma_threshold", sigma_threshold_, 8);
-  ros::param::param<double>("nms_radius", nms_radius_, 0.02);
+  NodeParams config;
+  VoxelParams& voxel = config.voxel;
+  ros::param::param<double>("leaf_size", voxel.leaf_size, 0.005);
+  ros::param::param<bool>("adaptive_leaf_size", voxel.adaptive_leaf_size,
+                          false);
+  ros::param::param<int>("object_point_budget", voxel.object_point_budget,
+                         300);
+  ros::param::param<double>("min_leaf_size", voxel.min_leaf_size, 0.003);
+  ros::param::param<double>("max_leaf_size", voxel.max_leaf_size, 0.02);
+  ros::param::param<double>("min_x", config.min_x, 0.3);
+  ros::param::param<double>("min_y", config.min_y, -0.75);
+  ros::param::param<double>("min_z", config.min_z, 0.3);
+  ros::param::param<double>("max_x", config.max_x, 1.2);
+  ros::param::param<double>("max_y", config.max_y, 0.75);
+  ros::param::param<double>("max_z", config.max_z, 1.7);
+  ros::param::param<double>("region_margin", config.region_margin, 0.1);
+  ros::param::param<bool>("organized_crop", config.organized_crop, true);
+  ros::param::param<bool>("depth_input", config.depth_input, false);
+  ros::param::param<bool>("depth_input_rgb", config.depth_input_rgb, true);
+  ros::param::param<double>("max_scene_age", config.max_scene_age, 2);
+  ros::param::param<double>("scene_ttl", config.scene_ttl, 60);
+  ros::param::param<int>("max_registered_scenes",
+                         config.max_registered_scenes, 8);
+  ros::param::param<double>("search_cache_ttl", config.search_cache_ttl, 10);
+  ros::param::param<double>("search_cache_leaf_size",
+                            config.search_cache_leaf_size, 0.01);
+  ros::param::param<int>("search_cache_size", config.search_cache_size, 32);
+  ros::param::param<bool>("change_aware_search", config.change_aware_search,
+                          false);
+  ros::param::param<double>("change_leaf_size", config.change_leaf_size, 0.01);
+  ros::param::param<int>("change_min_points", config.change_min_points, 2);
+  ros::param::param<int>("change_min_voxels", config.change_min_voxels, 3);
+  ros::param::param<double>("max_changed_ratio", config.max_changed_ratio,
+                            0.5);
+  ros::param::param<int>("max_change_references",
+                         config.max_change_references, 8);
+  ros::param::param<bool>("tiled_search", config.tiled_search, false);
+  ros::param::param<double>("tile_size_ratio", config.tile_size_ratio, 4);
+  ros::param::param<double>("sample_ratio", config.sample_ratio, 0.02);
+  ros::param::param<int>("max_samples", config.max_samples, 500);
+  ros::param::param<double>("fitness_threshold", config.fitness_threshold,
+                            0.0055);
+  ros::param::param<double>("sigma_threshold", config.sigma_threshold, 8);
+  ros::param::param<double>("nms_radius", config.nms_radius, 0.02);
+  ros::param::param<std::string>("tabletop_mode", config.tabletop_mode,
+                                 "merged");
+  ros::param::param<int>("num_threads", config.num_threads, 4);
+  ros::param::param<double>("min_cluster_extent_ratio",
+                            config.min_cluster_extent_ratio, 0.5);
+  ros::param::param<int>("min_cluster_samples", config.min_cluster_samples,
+                         20);
+  ros::param::param<bool>("cache_table_plane", config.cache_table_plane, true);
+  ros::param::param<double>("table_max_angle_change",
+                            config.table_max_angle_change, 0.05);
+  ros::param::param<double>("table_max_offset_change",
+                            config.table_max_offset_change, 0.02);
+  ros::param::param<double>("table_min_inlier_ratio",
+                            config.table_min_inlier_ratio, 0.7);
+  ros::param::param<double>("table_distance_threshold",
+                            config.table_distance_threshold, 0.01);
+  ros::param::param<double>("table_max_object_height",
+                            config.table_max_object_height, 0.5);
+  ros::param::param<double>("table_cluster_tolerance",
+                            config.table_cluster_tolerance, 0.01);
+  ros::param::param<int>("table_min_cluster_size",
+                         config.table_min_cluster_size, 50);
+  {
+    boost::mutex::scoped_lock lock(params_mutex_);
+    params_ = config;
+  }
+
+  if (scene_buffer_ != NULL) {
+    scene_buffer_->set_crop_box(
+        Eigen::Vector3f(config.min_x, config.min_y, config.min_z),
+        Eigen::Vector3f(config.max_x, config.max_y, config.max_z));
+    scene_buffer_->set_leaf_size(voxel.leaf_size);
+    scene_buffer_->set_use_organized(config.organized_crop);
+  }
+  scene_registry_.set_max_scenes(config.max_registered_scenes);
+  if (config.search_cache_ttl > 0) {
+    search_cache_.set_ttl(ros::WallDuration(config.search_cache_ttl));
+  }
+  search_cache_.set_max_entries(config.search_cache_size);
 }
 
+// Returns the leaf size to use for the given object. If adaptive_leaf_size is
+// set, the leaf size is picked from the object's ROI so that every object is
+// reduced to about object_point_budget points, which keeps the per-object
+// search time predictable.
+double ObjectSearchNode::ObjectLeafSize(const rapid_msgs::StaticCloud& object,
+                                        const VoxelParams& voxel) {
+  if (!voxel.adaptive_leaf_size) {
+    return voxel.leaf_size;
+  }
+  return AdaptiveLeafSize(object.roi.dimensions, voxel.object_point_budget,
+                          voxel.min_leaf_size, voxel.max_leaf_size);
+}
+
+NodeParams ObjectSearchNode::CurrentParams() {
+  boost::mutex::scoped_lock lock(params_mutex_);
+  return params_;
+}
+
+template <typename PointT>
 void ObjectSearchNode::Downsample(
-    pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr in,
-    pcl::PointCloud<pcl::PointXYZRGB>::Ptr out) {
-  pcl::VoxelGrid<PointC> vox;
+    const double leaf_size, typename pcl::PointCloud<PointT>::ConstPtr in,
+    typename pcl::PointCloud<PointT>::Ptr out) {
+  pcl::VoxelGrid<PointT> vox;
   vox.setInputCloud(in);
-  vox.setLeafSize(leaf_size_, leaf_size_, leaf_size_);
+  vox.setLeafSize(leaf_size, leaf_size, leaf_size);
   vox.filter(*out);
 }
 
+template <typename PointT>
 void ObjectSearchNode::TransformToBase(
-    pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr in,
+    typename pcl::PointCloud<PointT>::ConstPtr in,
     const std::string& parent_frame_id,
     const geometry_msgs::Transform& base_to_camera,
-    pcl::PointCloud<pcl::PointXYZRGB>::Ptr out) {
+    typename pcl::PointCloud<PointT>::Ptr out) {
   tf::Transform base_to_camera_tf;
   tf::transformMsgToTF(base_to_camera, base_to_camera_tf);
   pcl_ros::transformPointCloud(*in, *out, base_to_camera_tf.inverse());
   out->header.frame_id = parent_frame_id;
 }
 
-void ObjectSearchNode::CropScene(PointCloudC::Ptr in, PointCloudC::Ptr out) {
-  ROS_INFO(
-      "Cropping:\n"
-      "  min_x: %f\n"
-      "  min_y: %f\n"
-      "  min_z: %f\n"
-      "  max_x: %f\n"
-      "  max_y: %f\n"
-      "  max_z: %f\n",
-      min_x_, min_y_, min_z_, max_x_, max_y_, max_z_);
-  pcl::CropBox<PointC> crop;
-  crop.setInputCloud(in);
-  Eigen::Vector4f min;
-  min << min_x_, min_y_, min_z_, 1;
-  Eigen::Vector4f max;
-  max << max_x_, max_y_, max_z_, 1;
-  crop.setMin(min);
-  crop.setMax(max);
-  crop.filter(*out);
-}
-
-void ObjectSearchNode::ExtractTabletop(PointCloudC::Ptr in,
+// Gets the box that a scene is cropped to in the base frame: the search region
+// if one is given, or the global crop box otherwise.
+void ObjectSearchNode::SceneCropBox(const NodeParams& config,
+                                    const rapid_msgs::Roi3D* region,
+                                    const double region_margin,
+                                    Eigen::Affine3f* box_pose,
+                                    Eigen::Vector3f* min_pt,
+                                    Eigen::Vector3f* max_pt) {
+  *box_pose = Eigen::Affine3f::Identity();
+  *min_pt = Eigen::Vector3f(config.min_x, config.min_y, config.min_z);
+  *max_pt = Eigen::Vector3f(config.max_x, config.max_y, config.max_z);
+  if (region != NULL) {
+    Eigen::Affine3d region_pose;
+    tf::transformMsgToEigen(region->transform, region_pose);
+    *box_pose = region_pose.cast<float>();
+    Eigen::Vector3f half(region->dimensions.x / 2 + region_margin,
+                         region->dimensions.y / 2 + region_margin,
+                         region->dimensions.z / 2 + region_margin);
+    *min_pt = -half;
+    *max_pt = half;
+  } else {
+    ROS_INFO(
+        "Cropping:\n"
+        "  min_x: %f\n"
+        "  min_y: %f\n"
+        "  min_z: %f\n"
+        "  max_x: %f\n"
+        "  max_y: %f\n"
+        "  max_z: %f\n",
+        config.min_x, config.min_y, config.min_z, config.max_x, config.max_y,
+        config.max_z);
+  }
+}
+
+// Crops the scene to the search region if one is given, or to the global crop
+// box otherwise, and transforms it into the base frame.
+void ObjectSearchNode::CropSceneToBase(const NodeParams& config,
+                                       const PreparedScene& scene,
+                                       const rapid_msgs::Roi3D* region,
+                                       const double region_margin,
                                        PointCloudC::Ptr out) {
-  rapid::perception::Scene scene;
-  rapid::perception::ParseScene(in, rapid::perception::Pr2Params(), &scene);
-  std::vector<rapid::perception::Object> objects =
-      scene.primary_surface().objects();
-  for (size_t i = 0; i < objects.size(); ++i) {
-    const rapid::perception::Object& object = objects[i];
-    *out += *object.GetCloud();
+  Eigen::Affine3f box_pose;
+  Eigen::Vector3f min_pt;
+  Eigen::Vector3f max_pt;
+  SceneCropBox(config, region, region_margin, &box_pose, &min_pt, &max_pt);
+  if (scene.depth) {
+    // Only the pixels inside the box are turned into points.
+    CropDepthImageToBox(*scene.depth, scene.rgb.get(), *scene.camera_info,
+                        scene.parent_frame_id, scene.base_to_camera, box_pose,
+                        min_pt, max_pt, out);
+  } else {
+    PointCloudC::Ptr scene_in(new PointCloudC);
+    pcl::fromROSMsg(*scene.cloud, *scene_in);
+    CropSceneToBox<PointC>(scene_in, scene.parent_frame_id,
+                           scene.base_to_camera, box_pose, min_pt, max_pt,
+                           config.organized_crop, out);
+  }
+  ROS_INFO("Cropped scene to %d points", static_cast<int>(out->size()));
+}
+
+// Like CropSceneToBase, but only reads x, y and z from the scene's cloud, so
+// the whole-scene conversion, transform and crop move half as much data. The
+// scene must be a cloud, not a depth image.
+void ObjectSearchNode::CropSceneGeometryToBase(const NodeParams& config,
+                                               const PreparedScene& scene,
+                                               const rapid_msgs::Roi3D* region,
+                                               const double region_margin,
+                                               PointCloudG::Ptr out) {
+  Eigen::Affine3f box_pose;
+  Eigen::Vector3f min_pt;
+  Eigen::Vector3f max_pt;
+  SceneCropBox(config, region, region_margin, &box_pose, &min_pt, &max_pt);
+  PointCloudG::Ptr scene_in(new PointCloudG);
+  pcl::fromROSMsg(*scene.cloud, *scene_in);
+  CropSceneToBox<PointG>(scene_in, scene.parent_frame_id, scene.base_to_camera,
+                         box_pose, min_pt, max_pt, config.organized_crop, out);
+  ROS_INFO("Cropped scene geometry to %d points",
+           static_cast<int>(out->size()));
+}
+
+// Describes everything that determines the result of a search: the scene's
+// voxel occupancy, the object, the search region, and the search parameters.
+// The object is identified by its database ID, so a search by name shares its
+// result with a search by ID for the same object. The search region must
+// already be resolved, since the last match can move before the search runs.
+std::string ObjectSearchNode::SearchCacheKey(const NodeParams& config,
+                                             const PreparedScene& scene,
+                                             const PreparedObject& object,
+                                             const SearchOptions& options) {
+  double hash_leaf_size =
+      std::max(scene.leaf_size, config.search_cache_leaf_size);
+  rapid_msgs::Roi3D region;
+  double region_margin = 0;
+  bool has_region =
+      SearchRegion(config, object.model, options, &region, &region_margin);
+  EstimatorParams params =
+      CurrentEstimatorParams(config, options.max_error, options.min_results);
+
+  std::stringstream key;
+  key.precision(9);
+  key << HashVoxelOccupancy(*scene.downsampled, hash_leaf_size) << " "
+      << scene.parent_frame_id << " " << object.id << " " << object.leaf_size
+      << " " << options.is_tabletop << " " << options.geometry_only << " "
+      << config.tabletop_mode << " " << params.sample_ratio << " "
+      << params.max_samples << " " << params.fitness_threshold << " "
+      << params.sigma_threshold << " " << params.nms_radius << " "
+      << params.min_results << " " << config.tiled_search << " "
+      << config.change_aware_search << " " << config.tile_size_ratio << " "
+      << config.min_cluster_extent_ratio << " " << config.min_cluster_samples
+      << " " << config.num_threads;
+  if (options.is_tabletop) {
+    key << " " << config.table_distance_threshold << " "
+        << config.table_max_object_height << " "
+        << config.table_cluster_tolerance << " "
+        << config.table_min_cluster_size;
+  }
+  if (has_region) {
+    const geometry_msgs::Transform& t = region.transform;
+    key << " " << t.translation.x << " " << t.translation.y << " "
+        << t.translation.z << " " << t.rotation.x << " " << t.rotation.y << " "
+        << t.rotation.z << " " << t.rotation.w << " " << region.dimensions.x
+        << " " << region.dimensions.y << " " << region.dimensions.z << " "
+        << region_margin;
+  }
+  return key.str();
+}
+
+EstimatorParams ObjectSearchNode::CurrentEstimatorParams(
+    const NodeParams& config, const double max_error, const int min_results) {
+  EstimatorParams params;
+  params.sample_ratio = config.sample_ratio;
+  params.max_samples = config.max_samples;
+  params.num_candidates = config.max_samples;
+  params.fitness_threshold =
+      max_error == 0 ? config.fitness_threshold : max_error;
+  params.sigma_threshold = config.sigma_threshold;
+  params.nms_radius = config.nms_radius;
+  params.min_results = min_results;
+  return params;
+}
+
+// Searches each tabletop cluster, or other part of the scene, separately and
+// in parallel. Clusters that are too small to contain the object are skipped,
+// and the candidate budget is split among the remaining clusters by size.
+void ObjectSearchNode::SearchClusters(
+    const NodeParams& config, const std::vector<PointCloudC::Ptr>& clusters,
+    PointCloudC::Ptr object, const rapid_msgs::Roi3D& roi,
+    const double leaf_size, const EstimatorParams& params,
+    SearchProgress* progress,
+    std::vector<rapid::perception::PoseEstimationMatch>* matches) {
+  std::vector<PointCloudC::Ptr> candidates;
+  for (size_t i = 0; i < clusters.size(); ++i) {
+    if (!CanContainRoi(*clusters[i], roi.dimensions,
+                       config.min_cluster_extent_ratio)) {
+      continue;
+    }
+    PointCloudC::Ptr sampled(new PointCloudC);
+    Downsample<PointC>(leaf_size, clusters[i], sampled);
+    candidates.push_back(sampled);
   }
-  out->header.frame_id = in->header.frame_id;
+  ROS_INFO("Searching %d of %d clusters", static_cast<int>(candidates.size()),
+           static_cast<int>(clusters.size()));
+
+  std::vector<int> num_samples;
+  SplitSampleBudget(candidates, params.max_samples, config.min_cluster_samples,
+                    &num_samples);
+  boost::mutex::scoped_lock lock(estimator_mutex_);
+  parallel_search_.set_num_threads(config.num_threads);
+  parallel_search_.set_object(object, roi);
+  parallel_search_.set_params(params);
+  parallel_search_.set_progress(progress);
+  parallel_search_.Find(candidates, num_samples, matches);
+  parallel_search_.set_progress(NULL);
+}
+
+void ObjectSearchNode::ExtractTabletopClusters(
+    const NodeParams& config, PointCloudC::Ptr in,
+    std::vector<PointCloudC::Ptr>* clusters) {
+  boost::mutex::scoped_lock lock(tabletop_mutex_);
+  tabletop_.set_use_cache(config.cache_table_plane);
+  tabletop_.set_max_angle_change(config.table_max_angle_change);
+  tabletop_.set_max_offset_change(config.table_max_offset_change);
+  tabletop_.set_min_inlier_ratio(config.table_min_inlier_ratio);
+  tabletop_.set_distance_threshold(config.table_distance_threshold);
+  tabletop_.set_max_object_height(config.table_max_object_height);
+  tabletop_.set_cluster_tolerance(config.table_cluster_tolerance);
+  tabletop_.set_min_cluster_size(config.table_min_cluster_size);
+  tabletop_.Extract(in, clusters);
 }
 }  // namespace object_search
 
@@ -317,20 +1589,7 @@ int main(int argc, char** argv) {
   pose_estimator.set_marker_publisher(marker_pub);
 
   // Build databases
-  ros::ServiceClient get_cloud =
-      nh.serviceClient<static_cloud_db_msgs::GetStaticCloud>(
-          "get_static_cloud");
-  ros::ServiceClient list_clouds =
-      nh.serviceClient<static_cloud_db_msgs::ListStaticClouds>(
-          "list_static_clouds");
-  ros::ServiceClient remove_cloud =
-      nh.serviceClient<static_cloud_db_msgs::RemoveStaticCloud>(
-          "remove_static_cloud");
-  ros::ServiceClient save_cloud =
-      nh.serviceClient<static_cloud_db_msgs::SaveStaticCloud>(
-          "save_static_cloud");
-  object_search::Database object_db("object_search", "objects", get_cloud,
-                                    list_clouds, remove_cloud, save_cloud);
+  object_search::Database object_db(nh, "object_search", "objects");
 
   rapid::perception::Box3DRoiServer roi_server("roi");
   roi_server.set_base_frame("base_link");
@@ -340,24 +1599,92 @@ int main(int argc, char** argv) {
   ros::Publisher name_request =
       nh.advertise<std_msgs::String>("landmarkRequest", 1);
 
+  // Smooths recorded objects. The averager is started when recording begins,
+  // or at startup with average_continuously.
+  int num_clouds = 15;
+  ros::param::param<int>("num_clouds", num_clouds, 15);
+  bool average_continuously = false;
+  ros::param::param<bool>("average_continuously", average_continuously,
+                          false);
+  object_search::FrameAverager averager(nh, "cloud_in", num_clouds);
+  if (average_continuously) {
+    averager.Start();
+  }
   object_search::RecordObjectCommand record_object(&object_db, &capture,
-                                                   name_request);
+                                                   name_request, &averager);
+
+  // Keep the newest scene preprocessed in the background, so that searches
+  // from the database don't have to wait for a new cloud.
+  bool use_scene_buffer = true;
+  ros::param::param<bool>("use_scene_buffer", use_scene_buffer, true);
+  object_search::SceneBuffer scene_buffer(nh, "cloud_in", "base_link");
+
+  // Searches wait for their turn in the scheduler on their own spinner
+  // threads, so that queued searches don't hold up the scene buffer and the
+  // other services. One thread runs while the rest wait, so the queue length
+  // can't change after startup.
+  int max_search_queue = 8;
+  ros::param::param<int>("max_search_queue", max_search_queue, 8);
+
+  object_search::ObjectSearchNode node(
+      pose_estimator, record_object, object_db,
+      use_scene_buffer ? &scene_buffer : NULL, max_search_queue);
+  if (use_scene_buffer) {
+    scene_buffer.Start();
+  }
+
+  // The services are only advertised once the object library is warm.
+  ros::Publisher ready_pub = nh.advertise<std_msgs::Bool>("ready", 1, true);
+  std_msgs::Bool ready;
+  ready.data = false;
+  ready_pub.publish(ready);
+  bool preload_objects = true;
+  ros::param::param<bool>("preload_objects", preload_objects, true);
+  if (preload_objects) {
+    node.Preload();
+  }
+
+  ros::CallbackQueue search_queue;
+  ros::NodeHandle search_nh;
+  search_nh.setCallbackQueue(&search_queue);
+  ros::AsyncSpinner search_spinner(max_search_queue + 1, &search_queue);
+  search_spinner.start();
 
-  object_search::ObjectSearchNode node(pose_estimator, record_object,
-                                       object_db);
   ros::ServiceServer get_info_service = nh.advertiseService(
       "get_object_info", &object_search::ObjectSearchNode::ServeGetObjectInfo,
       &node);
-  ros::ServiceServer search_service = nh.advertiseService(
+  ros::ServiceServer search_service = search_nh.advertiseService(
       "find_object", &object_search::ObjectSearchNode::ServeSearch, &node);
-  ros::ServiceServer search_from_db_service = nh.advertiseService(
+  ros::ServiceServer search_from_db_service = search_nh.advertiseService(
       "find_object_from_db",
       &object_search::ObjectSearchNode::ServeSearchFromDb, &node);
+  // Same as find_object_from_db, but reports progress and can be preempted.
+  object_search::SearchActionServer search_action_server(
+      search_nh, "find_object_from_db_action",
+      boost::bind(&object_search::ObjectSearchNode::ExecuteSearchAction, &node,
+                  _1),
+      false);
+  search_action_server.registerPreemptCallback(boost::bind(
+      &object_search::ObjectSearchNode::PreemptSearchAction, &node));
+  node.set_action_server(&search_action_server);
+  search_action_server.start();
+  ros::Subscriber removed_sub =
+      nh.subscribe("static_cloud_removed", 10,
+                   &object_search::ObjectSearchNode::OnObjectRemoved, &node);
   ros::ServiceServer record_object_service = nh.advertiseService(
       "record_object", &object_search::ObjectSearchNode::ServeRecordObject,
       &node);
+  ros::ServiceServer register_scene_service = nh.advertiseService(
+      "register_scene", &object_search::ObjectSearchNode::ServeRegisterScene,
+      &node);
+  ros::ServiceServer release_scene_service = nh.advertiseService(
+      "release_scene", &object_search::ObjectSearchNode::ServeReleaseScene,
+      &node);
+  ready.data = true;
+  ready_pub.publish(ready);
 
   ros::waitForShutdown();
+  search_spinner.stop();
   spinner.stop();
   return 0;
 }
@@ -0,0 +1,223 @@
+#include "object_search/organized_cloud.h"
+
+#include <math.h>
+#include <algorithm>
+
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "ros/ros.h"
+
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+typedef pcl::PointXYZ PointG;
+typedef pcl::PointCloud<pcl::PointXYZ> PointCloudG;
+
+namespace object_search {
+namespace {
+// Pixels are sampled on a grid with this spacing to estimate the intrinsics.
+const int kIntrinsicsStride = 16;
+const int kMinIntrinsicsSamples = 20;
+// Fits that are off by more than this many pixels at any sampled pixel are
+// rejected. ProjectBox pads the window by a pixel, so this leaves room for the
+// error between the samples.
+const double kMaxIntrinsicsResidual = 0.5;
+// Boxes with a corner closer than this to the camera plane are not projected.
+const float kMinDepth = 0.05;
+
+template <typename PointT>
+bool IsFinite(const PointT& pt) {
+  return pcl_isfinite(pt.x) && pcl_isfinite(pt.y) && pcl_isfinite(pt.z);
+}
+
+// Solves value = scale * ratio + offset by least squares.
+bool FitLine(double n, double sum_r, double sum_v, double sum_rr,
+             double sum_rv, double* scale, double* offset) {
+  double denom = n * sum_rr - sum_r * sum_r;
+  if (fabs(denom) < 1e-12) {
+    return false;
+  }
+  *scale = (n * sum_rv - sum_r * sum_v) / denom;
+  *offset = (sum_v - *scale * sum_r) / n;
+  return true;
+}
+}  // namespace
+
+CameraIntrinsics::CameraIntrinsics() : fx(0), fy(0), cx(0), cy(0) {}
+
+PixelWindow::PixelWindow() : min_col(0), max_col(-1), min_row(0), max_row(-1) {}
+
+int PixelWindow::Area() const {
+  if (max_col < min_col || max_row < min_row) {
+    return 0;
+  }
+  return (max_col - min_col + 1) * (max_row - min_row + 1);
+}
+
+template <typename PointT>
+bool EstimateIntrinsics(const pcl::PointCloud<PointT>& cloud,
+                        CameraIntrinsics* intrinsics) {
+  if (!cloud.isOrganized()) {
+    return false;
+  }
+  double n = 0;
+  double sum_xr = 0, sum_xv = 0, sum_xrr = 0, sum_xrv = 0;
+  double sum_yr = 0, sum_yv = 0, sum_yrr = 0, sum_yrv = 0;
+  for (size_t row = 0; row < cloud.height; row += kIntrinsicsStride) {
+    for (size_t col = 0; col < cloud.width; col += kIntrinsicsStride) {
+      const PointT& pt = cloud.at(col, row);
+      if (!IsFinite(pt) || pt.z <= 0) {
+        continue;
+      }
+      double xr = pt.x / pt.z;
+      double yr = pt.y / pt.z;
+      n += 1;
+      sum_xr += xr;
+      sum_xv += col;
+      sum_xrr += xr * xr;
+      sum_xrv += xr * col;
+      sum_yr += yr;
+      sum_yv += row;
+      sum_yrr += yr * yr;
+      sum_yrv += yr * row;
+    }
+  }
+  if (n < kMinIntrinsicsSamples) {
+    return false;
+  }
+  CameraIntrinsics fit;
+  if (!FitLine(n, sum_xr, sum_xv, sum_xrr, sum_xrv, &fit.fx, &fit.cx) ||
+      !FitLine(n, sum_yr, sum_yv, sum_yrr, sum_yrv, &fit.fy, &fit.cy)) {
+    return false;
+  }
+  if (fit.fx <= 0 || fit.fy <= 0) {
+    ROS_DEBUG("Rejected intrinsics with fx=%f, fy=%f", fit.fx, fit.fy);
+    return false;
+  }
+
+  // A cloud that is not a pinhole projection still gets a fit, so check it
+  // against the same samples.
+  double max_residual = 0;
+  for (size_t row = 0; row < cloud.height; row += kIntrinsicsStride) {
+    for (size_t col = 0; col < cloud.width; col += kIntrinsicsStride) {
+      const PointT& pt = cloud.at(col, row);
+      if (!IsFinite(pt) || pt.z <= 0) {
+        continue;
+      }
+      double col_error = fit.fx * pt.x / pt.z + fit.cx - col;
+      double row_error = fit.fy * pt.y / pt.z + fit.cy - row;
+      max_residual = std::max(max_residual, fabs(col_error));
+      max_residual = std::max(max_residual, fabs(row_error));
+    }
+  }
+  if (max_residual > kMaxIntrinsicsResidual) {
+    ROS_DEBUG("Rejected intrinsics with a residual of %f pixels",
+              max_residual);
+    return false;
+  }
+  *intrinsics = fit;
+  return true;
+}
+
+bool ProjectBox(const CameraIntrinsics& intrinsics, const int width,
+                const int height, const Eigen::Affine3f& box_in_camera,
+                const Eigen::Vector3f& min_pt, const Eigen::Vector3f& max_pt,
+                PixelWindow* window) {
+  double min_col = width;
+  double max_col = -1;
+  double min_row = height;
+  double max_row = -1;
+  for (int i = 0; i < 8; ++i) {
+    Eigen::Vector3f corner((i & 1) ? max_pt.x() : min_pt.x(),
+                           (i & 2) ? max_pt.y() : min_pt.y(),
+                           (i & 4) ? max_pt.z() : min_pt.z());
+    Eigen::Vector3f pt = box_in_camera * corner;
+    if (pt.z() < kMinDepth) {
+      return false;
+    }
+    double col = intrinsics.fx * pt.x() / pt.z() + intrinsics.cx;
+    double row = intrinsics.fy * pt.y() / pt.z() + intrinsics.cy;
+    min_col = std::min(min_col, col);
+    max_col = std::max(max_col, col);
+    min_row = std::min(min_row, row);
+    max_row = std::max(max_row, row);
+  }
+  // Pad by a pixel to allow for error in the estimated intrinsics.
+  window->min_col = std::max(0, static_cast<int>(floor(min_col)) - 1);
+  window->max_col = std::min(width - 1, static_cast<int>(ceil(max_col)) + 1);
+  window->min_row = std::max(0, static_cast<int>(floor(min_row)) - 1);
+  window->max_row = std::min(height - 1, static_cast<int>(ceil(max_row)) + 1);
+  return true;
+}
+
+template <typename PointT>
+bool CropOrganized(const pcl::PointCloud<PointT>& cloud,
+                   const Eigen::Affine3f& camera_to_base,
+                   const Eigen::Affine3f& box_pose,
+                   const Eigen::Vector3f& min_pt,
+                   const Eigen::Vector3f& max_pt,
+                   pcl::PointCloud<PointT>* cropped) {
+  if (!cloud.isOrganized()) {
+    return false;
+  }
+
+  CameraIntrinsics intrinsics;
+  if (!EstimateIntrinsics(cloud, &intrinsics)) {
+    return false;
+  }
+
+  PixelWindow window;
+  window.max_col = cloud.width - 1;
+  window.max_row = cloud.height - 1;
+  Eigen::Affine3f box_in_camera = camera_to_base.inverse() * box_pose;
+  PixelWindow box_window;
+  if (ProjectBox(intrinsics, cloud.width, cloud.height, box_in_camera, min_pt,
+                 max_pt, &box_window)) {
+    window = box_window;
+  }
+  ROS_DEBUG("Scanning %d of %d pixels", window.Area(),
+            static_cast<int>(cloud.size()));
+
+  // Points are tested in the box frame, and output in the base frame.
+  Eigen::Affine3f camera_to_box = box_in_camera.inverse();
+  cropped->clear();
+  cropped->reserve(window.Area());
+  for (int row = window.min_row; row <= window.max_row; ++row) {
+    for (int col = window.min_col; col <= window.max_col; ++col) {
+      const PointT& pt = cloud.at(col, row);
+      if (!IsFinite(pt)) {
+        continue;
+      }
+      Eigen::Vector3f in_box = camera_to_box * pt.getVector3fMap();
+      if (in_box.x() < min_pt.x() || in_box.y() < min_pt.y() ||
+          in_box.z() < min_pt.z() || in_box.x() > max_pt.x() ||
+          in_box.y() > max_pt.y() || in_box.z() > max_pt.z()) {
+        continue;
+      }
+      PointT out = pt;
+      out.getVector3fMap() = camera_to_base * pt.getVector3fMap();
+      cropped->push_back(out);
+    }
+  }
+  cropped->is_dense = true;
+  return true;
+}
+
+template bool EstimateIntrinsics<PointC>(const PointCloudC& cloud,
+                                         CameraIntrinsics* intrinsics);
+template bool EstimateIntrinsics<PointG>(const PointCloudG& cloud,
+                                         CameraIntrinsics* intrinsics);
+template bool CropOrganized<PointC>(const PointCloudC& cloud,
+                                    const Eigen::Affine3f& camera_to_base,
+                                    const Eigen::Affine3f& box_pose,
+                                    const Eigen::Vector3f& min_pt,
+                                    const Eigen::Vector3f& max_pt,
+                                    PointCloudC* cropped);
+template bool CropOrganized<PointG>(const PointCloudG& cloud,
+                                    const Eigen::Affine3f& camera_to_base,
+                                    const Eigen::Affine3f& box_pose,
+                                    const Eigen::Vector3f& min_pt,
+                                    const Eigen::Vector3f& max_pt,
+                                    PointCloudG* cropped);
+}  // namespace object_search
@@ -0,0 +1,260 @@
+#include "object_search/parallel_search.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread.hpp"
+#include "geometry_msgs/Point.h"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "rapid_msgs/Roi3D.h"
+#include "rapid_perception/pose_estimation.h"
+#include "rapid_perception/pose_estimation_match.h"
+#include "rapid_perception/random_heat_mapper.h"
+#include "ros/ros.h"
+
+#include "object_search/object_search.h"
+#include "object_search/search_progress.h"
+#include "object_search_msgs/Match.h"
+
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+
+using rapid::perception::PoseEstimationMatch;
+using rapid::perception::PoseEstimator;
+using rapid::perception::RandomHeatMapper;
+
+namespace object_search {
+namespace {
+bool FitnessLess(const PoseEstimationMatch& a, const PoseEstimationMatch& b) {
+  return a.fitness() < b.fitness();
+}
+
+PointCloudC::Ptr RegionAt(const std::vector<PointCloudC::Ptr>* regions,
+                          const size_t i) {
+  return regions->at(i);
+}
+
+geometry_msgs::Point Position(const PoseEstimationMatch& match) {
+  return match.pose().position;
+}
+
+geometry_msgs::Point Position(const object_search_msgs::Match& match) {
+  return match.pose.position;
+}
+
+template <typename Match>
+void SuppressNonMaximaAt(const double radius, std::vector<Match>* matches) {
+  std::vector<Match> kept;
+  for (size_t i = 0; i < matches->size(); ++i) {
+    geometry_msgs::Point pos = Position(matches->at(i));
+    bool suppressed = false;
+    for (size_t j = 0; j < kept.size() && !suppressed; ++j) {
+      geometry_msgs::Point kept_pos = Position(kept[j]);
+      double dx = pos.x - kept_pos.x;
+      double dy = pos.y - kept_pos.y;
+      double dz = pos.z - kept_pos.z;
+      suppressed = dx * dx + dy * dy + dz * dz < radius * radius;
+    }
+    if (!suppressed) {
+      kept.push_back(matches->at(i));
+    }
+  }
+  matches->swap(kept);
+}
+}  // namespace
+
+ParallelSearch::ParallelSearch(const int num_threads)
+    : heat_mappers_(),
+      estimators_(),
+      object_(),
+      roi_(),
+      params_(),
+      progress_(NULL),
+      nms_radius_(0),
+      mutex_(),
+      num_regions_(0),
+      load_(),
+      num_samples_(NULL),
+      next_region_(0),
+      results_() {
+  set_num_threads(num_threads);
+}
+
+void ParallelSearch::set_num_threads(const int num_threads) {
+  size_t num = std::max(1, num_threads);
+  while (estimators_.size() < num) {
+    boost::shared_ptr<RandomHeatMapper> heat_mapper(new RandomHeatMapper());
+    heat_mapper->set_name("random");
+    heat_mappers_.push_back(heat_mapper);
+    estimators_.push_back(
+        boost::shared_ptr<PoseEstimator>(new PoseEstimator(heat_mapper.get())));
+  }
+  estimators_.resize(num);
+  heat_mappers_.resize(num);
+}
+
+int ParallelSearch::num_threads() const { return estimators_.size(); }
+
+void ParallelSearch::set_object(PointCloudC::Ptr object,
+                                const rapid_msgs::Roi3D& roi) {
+  object_ = object;
+  roi_ = roi;
+}
+
+void ParallelSearch::set_params(const EstimatorParams& params) {
+  params_ = params;
+}
+
+void ParallelSearch::set_progress(SearchProgress* progress) {
+  progress_ = progress;
+}
+
+void ParallelSearch::set_nms_radius(const double radius) {
+  nms_radius_ = radius;
+}
+
+void ParallelSearch::Find(const std::vector<PointCloudC::Ptr>& regions,
+                          const std::vector<int>& num_samples,
+                          std::vector<PoseEstimationMatch>* matches) {
+  Find(regions.size(), boost::bind(&RegionAt, &regions, _1), num_samples,
+       matches);
+}
+
+void ParallelSearch::Find(const size_t num_regions, const RegionLoader& load,
+                          const std::vector<int>& num_samples,
+                          std::vector<PoseEstimationMatch>* matches) {
+  matches->clear();
+  num_regions_ = num_regions;
+  load_ = load;
+  num_samples_ = &num_samples;
+  next_region_ = 0;
+  results_.clear();
+
+  size_t num_workers = std::min(estimators_.size(), num_regions);
+  boost::thread_group workers;
+  for (size_t i = 0; i < num_workers; ++i) {
+    workers.create_thread(boost::bind(&ParallelSearch::Worker, this, i));
+  }
+  workers.join_all();
+
+  std::vector<PoseEstimationMatch> results;
+  results.swap(results_);
+  num_regions_ = 0;
+  load_.clear();
+  num_samples_ = NULL;
+
+  // Each region returns up to min_results matches of its own, so apply the
+  // threshold and min_results again across all regions.
+  std::sort(results.begin(), results.end(), FitnessLess);
+  if (nms_radius_ > 0) {
+    SuppressNonMaxima(nms_radius_, &results);
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (results[i].fitness() <= params_.fitness_threshold ||
+        static_cast<int>(matches->size()) < params_.min_results) {
+      matches->push_back(results[i]);
+    }
+  }
+}
+
+void ParallelSearch::Worker(const int thread_index) {
+  PoseEstimator* estimator = estimators_[thread_index].get();
+  while (true) {
+    size_t region_i;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (next_region_ >= num_regions_ ||
+          (progress_ != NULL && progress_->cancelled())) {
+        return;
+      }
+      region_i = next_region_;
+      ++next_region_;
+    }
+
+    if (num_samples_->at(region_i) <= 0) {
+      continue;
+    }
+    PointCloudC::Ptr region = load_(region_i);
+    if (!region || region->empty()) {
+      continue;
+    }
+
+    EstimatorParams params(params_);
+    params.max_samples = num_samples_->at(region_i);
+    params.num_candidates = num_samples_->at(region_i);
+    ConfigureEstimator(params, estimator);
+    estimator->set_scene(region);
+    estimator->set_object(object_);
+    estimator->set_roi(roi_);
+
+    std::vector<PoseEstimationMatch> region_matches;
+    estimator->Find(&region_matches);
+    ROS_DEBUG("Region %d (%d points, %d samples): %d matches",
+              static_cast<int>(region_i),
+              static_cast<int>(region->size()),
+              params.max_samples, static_cast<int>(region_matches.size()));
+
+    if (progress_ != NULL) {
+      double best_fitness = -1;
+      for (size_t i = 0; i < region_matches.size(); ++i) {
+        if (best_fitness < 0 || region_matches[i].fitness() < best_fitness) {
+          best_fitness = region_matches[i].fitness();
+        }
+      }
+      progress_->AddCandidates(
+          NumCandidates(params, region->size()),
+          best_fitness);
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    results_.insert(results_.end(), region_matches.begin(),
+                    region_matches.end());
+  }
+}
+
+void SplitSampleBudget(const std::vector<PointCloudC::Ptr>& regions,
+                       const int total_samples, const int min_samples,
+                       std::vector<int>* num_samples) {
+  std::vector<int> num_points;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    num_points.push_back(regions[i]->size());
+  }
+  SplitSampleBudget(num_points, total_samples, min_samples, num_samples);
+}
+
+void SplitSampleBudget(const std::vector<int>& num_points,
+                       const int total_samples, const int min_samples,
+                       std::vector<int>* num_samples) {
+  num_samples->clear();
+  if (num_points.empty()) {
+    return;
+  }
+  const int num_regions = num_points.size();
+  const int min_each = std::min(min_samples, total_samples / num_regions);
+  const int remaining = total_samples - min_each * num_regions;
+  double total_points = 0;
+  for (size_t i = 0; i < num_points.size(); ++i) {
+    total_points += num_points[i];
+  }
+  for (size_t i = 0; i < num_points.size(); ++i) {
+    int samples = min_each;
+    if (total_points > 0) {
+      samples += static_cast<int>(remaining * (num_points[i] / total_points));
+    }
+    num_samples->push_back(samples);
+  }
+}
+
+void SuppressNonMaxima(const double radius,
+                       std::vector<PoseEstimationMatch>* matches) {
+  SuppressNonMaximaAt(radius, matches);
+}
+
+void SuppressNonMaxima(const double radius,
+                       std::vector<object_search_msgs::Match>* matches) {
+  SuppressNonMaximaAt(radius, matches);
+}
+}  // namespace object_search
@@ -0,0 +1,236 @@
+#include "object_search/scene_buffer.h"
+
+#include <deque>
+#include <string>
+#include <utility>
+
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+#include "boost/bind.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/condition_variable.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread.hpp"
+#include "pcl/filters/voxel_grid.h"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "pcl_conversions/pcl_conversions.h"
+#include "ros/ros.h"
+#include "sensor_msgs/PointCloud2.h"
+#include "tf/transform_datatypes.h"
+#include "tf/transform_listener.h"
+
+#include "object_search/object_search.h"
+
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+
+using sensor_msgs::PointCloud2;
+
+namespace object_search {
+namespace {
+// Voxelizations kept by PreparedScene::DownsampledAt.
+const size_t kMaxResampled = 4;
+}  // namespace
+
+PreparedScene::PreparedScene()
+    : cloud(),
+      depth(),
+      rgb(),
+      camera_info(),
+      parent_frame_id(""),
+      base_to_camera(),
+      cropped(),
+      downsampled(),
+      leaf_size(0),
+      crop_min(Eigen::Vector3f::Zero()),
+      crop_max(Eigen::Vector3f::Zero()),
+      resampled_mutex(),
+      resampled() {}
+
+PointCloudC::Ptr PreparedScene::DownsampledAt(const double leaf_size) const {
+  if (downsampled && leaf_size == this->leaf_size) {
+    return downsampled;
+  }
+  boost::mutex::scoped_lock lock(resampled_mutex);
+  for (size_t i = 0; i < resampled.size(); ++i) {
+    if (resampled[i].first == leaf_size) {
+      return resampled[i].second;
+    }
+  }
+  PointCloudC::Ptr out(new PointCloudC);
+  pcl::VoxelGrid<PointC> vox;
+  vox.setInputCloud(cropped);
+  vox.setLeafSize(leaf_size, leaf_size, leaf_size);
+  vox.filter(*out);
+  resampled.push_back(std::make_pair(leaf_size, out));
+  if (resampled.size() > kMaxResampled) {
+    resampled.pop_front();
+  }
+  return out;
+}
+
+SceneBuffer::SceneBuffer(const ros::NodeHandle& nh, const std::string& topic,
+                         const std::string& base_frame)
+    : nh_(nh),
+      topic_(topic),
+      base_frame_(base_frame),
+      sub_(),
+      tf_listener_(),
+      thread_(),
+      running_(false),
+      settings_mutex_(),
+      min_pt_(0.2, -1, 0.3),
+      max_pt_(1.2, 1, 1.7),
+      leaf_size_(0.005),
+      use_organized_(true),
+      pending_mutex_(),
+      pending_cond_(),
+      pending_(),
+      ready_mutex_(),
+      ready_cond_(),
+      ready_() {}
+
+SceneBuffer::~SceneBuffer() { Stop(); }
+
+void SceneBuffer::Start() {
+  {
+    boost::mutex::scoped_lock lock(pending_mutex_);
+    if (running_) {
+      return;
+    }
+    running_ = true;
+  }
+  thread_ = boost::thread(&SceneBuffer::ProcessLoop, this);
+  sub_ = nh_.subscribe(topic_, 1, &SceneBuffer::Callback, this);
+}
+
+void SceneBuffer::Stop() {
+  sub_.shutdown();
+  {
+    boost::mutex::scoped_lock lock(pending_mutex_);
+    running_ = false;
+  }
+  pending_cond_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void SceneBuffer::set_crop_box(const Eigen::Vector3f& min_pt,
+                               const Eigen::Vector3f& max_pt) {
+  boost::mutex::scoped_lock lock(settings_mutex_);
+  min_pt_ = min_pt;
+  max_pt_ = max_pt;
+}
+
+void SceneBuffer::set_leaf_size(double leaf_size) {
+  boost::mutex::scoped_lock lock(settings_mutex_);
+  leaf_size_ = leaf_size;
+}
+
+void SceneBuffer::set_use_organized(bool use_organized) {
+  boost::mutex::scoped_lock lock(settings_mutex_);
+  use_organized_ = use_organized;
+}
+
+boost::shared_ptr<const PreparedScene> SceneBuffer::Latest(
+    const ros::Duration& timeout, const ros::Duration& max_age) {
+  boost::system_time deadline =
+      boost::get_system_time() +
+      boost::posix_time::milliseconds(timeout.toSec() * 1000);
+  boost::mutex::scoped_lock lock(ready_mutex_);
+  while (!ready_ ||
+         (!max_age.isZero() &&
+          ros::Time::now() - ready_->cloud->header.stamp > max_age)) {
+    if (!ready_cond_.timed_wait(lock, deadline)) {
+      if (ready_) {
+        ROS_WARN("Newest scene is %f seconds old, waited for a newer one",
+                 (ros::Time::now() - ready_->cloud->header.stamp).toSec());
+      }
+      return boost::shared_ptr<const PreparedScene>();
+    }
+  }
+  return ready_;
+}
+
+void SceneBuffer::Callback(const PointCloud2::ConstPtr& cloud) {
+  {
+    boost::mutex::scoped_lock lock(pending_mutex_);
+    pending_ = cloud;
+  }
+  pending_cond_.notify_one();
+}
+
+void SceneBuffer::ProcessLoop() {
+  while (true) {
+    PointCloud2::ConstPtr cloud;
+    {
+      boost::mutex::scoped_lock lock(pending_mutex_);
+      while (running_ && !pending_) {
+        pending_cond_.wait(lock);
+      }
+      if (!running_) {
+        return;
+      }
+      cloud.swap(pending_);
+    }
+
+    boost::shared_ptr<PreparedScene> back(new PreparedScene);
+    if (!Prepare(cloud, back.get())) {
+      continue;
+    }
+    {
+      boost::mutex::scoped_lock lock(ready_mutex_);
+      ready_ = back;
+    }
+    ready_cond_.notify_all();
+  }
+}
+
+bool SceneBuffer::Prepare(const PointCloud2::ConstPtr& cloud,
+                          PreparedScene* scene) {
+  Eigen::Vector3f min_pt;
+  Eigen::Vector3f max_pt;
+  double leaf_size;
+  bool use_organized;
+  {
+    boost::mutex::scoped_lock lock(settings_mutex_);
+    min_pt = min_pt_;
+    max_pt = max_pt_;
+    leaf_size = leaf_size_;
+    use_organized = use_organized_;
+  }
+
+  scene->cloud = cloud;
+  scene->parent_frame_id = base_frame_;
+  try {
+    tf::StampedTransform base_to_camera;
+    tf_listener_.waitForTransform(cloud->header.frame_id, base_frame_,
+                                  cloud->header.stamp, ros::Duration(0.5));
+    tf_listener_.lookupTransform(cloud->header.frame_id, base_frame_,
+                                 cloud->header.stamp, base_to_camera);
+    tf::transformTFToMsg(base_to_camera, scene->base_to_camera);
+  } catch (tf::TransformException e) {
+    ROS_WARN("%s", e.what());
+    return false;
+  }
+
+  PointCloudC::Ptr scene_in(new PointCloudC);
+  pcl::fromROSMsg(*cloud, *scene_in);
+  scene->cropped.reset(new PointCloudC);
+  CropSceneToBox<PointC>(scene_in, base_frame_, scene->base_to_camera,
+                         Eigen::Affine3f::Identity(), min_pt, max_pt,
+                         use_organized, scene->cropped);
+  scene->crop_min = min_pt;
+  scene->crop_max = max_pt;
+
+  scene->leaf_size = leaf_size;
+  scene->downsampled.reset(new PointCloudC);
+  pcl::VoxelGrid<PointC> vox;
+  vox.setInputCloud(scene->cropped);
+  vox.setLeafSize(leaf_size, leaf_size, leaf_size);
+  vox.filter(*scene->downsampled);
+  return true;
+}
+}  // namespace object_search
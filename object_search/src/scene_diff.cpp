@@ -0,0 +1,235 @@
+#include "object_search/scene_diff.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "Eigen/Core"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+
+namespace object_search {
+namespace {
+// Voxel indices are packed into 21 bits per axis, offset so that negative
+// indices sort before positive ones.
+const int kBits = 21;
+const int64_t kOffset = 1 << (kBits - 1);
+const uint64_t kMask = (1 << kBits) - 1;
+
+uint64_t PackVoxel(const int64_t i, const int64_t j, const int64_t k) {
+  return (static_cast<uint64_t>(i + kOffset) << (2 * kBits)) |
+         (static_cast<uint64_t>(j + kOffset) << kBits) |
+         static_cast<uint64_t>(k + kOffset);
+}
+
+void UnpackVoxel(const uint64_t key, int64_t* i, int64_t* j, int64_t* k) {
+  *i = static_cast<int64_t>((key >> (2 * kBits)) & kMask) - kOffset;
+  *j = static_cast<int64_t>((key >> kBits) & kMask) - kOffset;
+  *k = static_cast<int64_t>(key & kMask) - kOffset;
+}
+
+// Returns the sorted keys of the voxels with at least min_points points.
+void OccupiedVoxels(const PointCloudC& cloud, const double leaf_size,
+                    const int min_points, std::vector<uint64_t>* occupied) {
+  std::vector<uint64_t> keys;
+  keys.reserve(cloud.size());
+  for (size_t i = 0; i < cloud.size(); ++i) {
+    const PointC& pt = cloud.points[i];
+    if (!pcl_isfinite(pt.x) || !pcl_isfinite(pt.y) || !pcl_isfinite(pt.z)) {
+      continue;
+    }
+    keys.push_back(PackVoxel(static_cast<int64_t>(floor(pt.x / leaf_size)),
+                             static_cast<int64_t>(floor(pt.y / leaf_size)),
+                             static_cast<int64_t>(floor(pt.z / leaf_size))));
+  }
+  std::sort(keys.begin(), keys.end());
+
+  occupied->clear();
+  size_t start = 0;
+  while (start < keys.size()) {
+    size_t end = start + 1;
+    while (end < keys.size() && keys[end] == keys[start]) {
+      ++end;
+    }
+    if (static_cast<int>(end - start) >= min_points) {
+      occupied->push_back(keys[start]);
+    }
+    start = end;
+  }
+}
+}  // namespace
+
+ChangedRegion::ChangedRegion() : min_pt(), max_pt(), num_voxels(0) {}
+
+bool ChangedRegion::Contains(const Eigen::Vector3f& point) const {
+  return (point.array() >= min_pt.array()).all() &&
+         (point.array() <= max_pt.array()).all();
+}
+
+SceneDiff::SceneDiff()
+    : leaf_size_(0.01),
+      min_points_(2),
+      min_voxels_(3),
+      num_changed_voxels_(0),
+      changed_ratio_(0) {}
+
+void SceneDiff::set_leaf_size(const double leaf_size) {
+  leaf_size_ = leaf_size;
+}
+
+void SceneDiff::set_min_points(const int min_points) {
+  min_points_ = min_points;
+}
+
+void SceneDiff::set_min_voxels(const int min_voxels) {
+  min_voxels_ = min_voxels;
+}
+
+void SceneDiff::Compare(const PointCloudC& reference,
+                        const PointCloudC& current,
+                        std::vector<ChangedRegion>* regions) {
+  regions->clear();
+  std::vector<uint64_t> before;
+  std::vector<uint64_t> after;
+  OccupiedVoxels(reference, leaf_size_, min_points_, &before);
+  OccupiedVoxels(current, leaf_size_, min_points_, &after);
+
+  std::vector<uint64_t> changed;
+  std::set_symmetric_difference(before.begin(), before.end(), after.begin(),
+                                after.end(), std::back_inserter(changed));
+  std::vector<uint64_t> occupied;
+  std::set_union(before.begin(), before.end(), after.begin(), after.end(),
+                 std::back_inserter(occupied));
+  num_changed_voxels_ = changed.size();
+  changed_ratio_ =
+      occupied.empty() ? 0 : static_cast<double>(changed.size()) /
+                                 occupied.size();
+
+  // Group touching changed voxels with a flood fill. The changed voxels are
+  // sorted, so neighbors are looked up with a binary search.
+  std::vector<bool> visited(changed.size(), false);
+  std::vector<size_t> stack;
+  for (size_t seed = 0; seed < changed.size(); ++seed) {
+    if (visited[seed]) {
+      continue;
+    }
+    visited[seed] = true;
+    stack.push_back(seed);
+    int64_t min_i, min_j, min_k;
+    UnpackVoxel(changed[seed], &min_i, &min_j, &min_k);
+    int64_t max_i = min_i, max_j = min_j, max_k = min_k;
+    int num_voxels = 0;
+    while (!stack.empty()) {
+      size_t index = stack.back();
+      stack.pop_back();
+      ++num_voxels;
+      int64_t i, j, k;
+      UnpackVoxel(changed[index], &i, &j, &k);
+      min_i = std::min(min_i, i);
+      min_j = std::min(min_j, j);
+      min_k = std::min(min_k, k);
+      max_i = std::max(max_i, i);
+      max_j = std::max(max_j, j);
+      max_k = std::max(max_k, k);
+      for (int di = -1; di <= 1; ++di) {
+        for (int dj = -1; dj <= 1; ++dj) {
+          for (int dk = -1; dk <= 1; ++dk) {
+            uint64_t key = PackVoxel(i + di, j + dj, k + dk);
+            std::vector<uint64_t>::const_iterator it =
+                std::lower_bound(changed.begin(), changed.end(), key);
+            if (it == changed.end() || *it != key) {
+              continue;
+            }
+            size_t neighbor = it - changed.begin();
+            if (!visited[neighbor]) {
+              visited[neighbor] = true;
+              stack.push_back(neighbor);
+            }
+          }
+        }
+      }
+    }
+    if (num_voxels < min_voxels_) {
+      continue;
+    }
+    const float leaf_size = leaf_size_;
+    ChangedRegion region;
+    region.min_pt = Eigen::Vector3f(min_i, min_j, min_k) * leaf_size;
+    region.max_pt = Eigen::Vector3f(max_i + 1, max_j + 1, max_k + 1) *
+                    leaf_size;
+    region.num_voxels = num_voxels;
+    regions->push_back(region);
+  }
+}
+
+int SceneDiff::num_changed_voxels() const { return num_changed_voxels_; }
+
+double SceneDiff::changed_ratio() const { return changed_ratio_; }
+
+void GrowRegions(const double margin, std::vector<ChangedRegion>* regions) {
+  const Eigen::Vector3f grow = Eigen::Vector3f::Constant(margin);
+  std::vector<ChangedRegion> grown(*regions);
+  for (size_t i = 0; i < grown.size(); ++i) {
+    grown[i].min_pt -= grow;
+    grown[i].max_pt += grow;
+  }
+
+  // Merge until no two regions overlap. Merging can make a region overlap
+  // one that it didn't before, so this repeats until nothing changes.
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < grown.size() && !merged; ++i) {
+      for (size_t j = i + 1; j < grown.size(); ++j) {
+        if ((grown[i].max_pt.array() < grown[j].min_pt.array()).any() ||
+            (grown[j].max_pt.array() < grown[i].min_pt.array()).any()) {
+          continue;
+        }
+        grown[i].min_pt = grown[i].min_pt.cwiseMin(grown[j].min_pt);
+        grown[i].max_pt = grown[i].max_pt.cwiseMax(grown[j].max_pt);
+        grown[i].num_voxels += grown[j].num_voxels;
+        grown.erase(grown.begin() + j);
+        merged = true;
+        break;
+      }
+    }
+  }
+  regions->swap(grown);
+}
+
+bool InAnyRegion(const Eigen::Vector3f& point,
+                 const std::vector<ChangedRegion>& regions) {
+  for (size_t i = 0; i < regions.size(); ++i) {
+    if (regions[i].Contains(point)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void CropToRegions(const PointCloudC& cloud,
+                   const std::vector<ChangedRegion>& regions,
+                   std::vector<PointCloudC::Ptr>* cropped) {
+  cropped->clear();
+  for (size_t i = 0; i < regions.size(); ++i) {
+    PointCloudC::Ptr region_cloud(new PointCloudC);
+    region_cloud->header = cloud.header;
+    cropped->push_back(region_cloud);
+  }
+  for (size_t i = 0; i < cloud.size(); ++i) {
+    const PointC& pt = cloud.points[i];
+    Eigen::Vector3f point(pt.x, pt.y, pt.z);
+    for (size_t j = 0; j < regions.size(); ++j) {
+      if (regions[j].Contains(point)) {
+        cropped->at(j)->push_back(pt);
+        break;
+      }
+    }
+  }
+}
+}  // namespace object_search
@@ -0,0 +1,418 @@
+#include "object_search/scene_octree.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "Eigen/Core"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "pcl_conversions/pcl_conversions.h"
+#include "rapid_db/name_db.hpp"
+#include "ros/ros.h"
+#include "sensor_msgs/PointCloud2.h"
+
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+
+namespace object_search {
+namespace {
+// File layout: a Header, then num_nodes Nodes, then num_points Points. Node 0
+// is the root. The structs have no padding, so that they can be read straight
+// from the mapped file.
+const char kMagic[8] = {'O', 'S', 'O', 'C', 'T', 'R', 'E', 'E'};
+// Version 1 files also stored a level of detail for each node.
+const uint32_t kVersion = 2;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_nodes;
+  uint64_t num_points;
+  char frame_id[64];
+};
+
+struct Node {
+  uint64_t points_begin;  // Index of the node's first point.
+  float min_pt[3];
+  float size;            // Nodes are cubes.
+  uint32_t num_points;   // 0 for internal nodes.
+  uint32_t children[8];  // 0 if there is no child in that octant.
+  uint32_t reserved;
+};
+
+struct Point {
+  float x;
+  float y;
+  float z;
+  uint32_t rgb;
+};
+
+Point ToPoint(const PointC& pt) {
+  Point point;
+  point.x = pt.x;
+  point.y = pt.y;
+  point.z = pt.z;
+  point.rgb = (static_cast<uint32_t>(pt.r) << 16) |
+              (static_cast<uint32_t>(pt.g) << 8) | pt.b;
+  return point;
+}
+
+PointC FromPoint(const Point& point) {
+  PointC pt;
+  pt.x = point.x;
+  pt.y = point.y;
+  pt.z = point.z;
+  pt.r = (point.rgb >> 16) & 0xff;
+  pt.g = (point.rgb >> 8) & 0xff;
+  pt.b = point.rgb & 0xff;
+  return pt;
+}
+
+// Builds the nodes and points of an octree in memory.
+class OctreeBuilder {
+ public:
+  OctreeBuilder(const PointCloudC& scene, const SceneOctreeOptions& options)
+      : nodes(), points(), scene_(scene), options_(options) {}
+
+  // Builds the subtree for the given points and returns the index of its
+  // root. The indices are consumed.
+  uint32_t Build(std::vector<int>* indices, const Eigen::Vector3f& min_pt,
+                 const float size, const int depth) {
+    uint32_t index = nodes.size();
+    Node node;
+    memset(&node, 0, sizeof(node));
+    node.min_pt[0] = min_pt.x();
+    node.min_pt[1] = min_pt.y();
+    node.min_pt[2] = min_pt.z();
+    node.size = size;
+
+    if (static_cast<int>(indices->size()) <= options_.max_leaf_points ||
+        depth >= options_.max_depth) {
+      node.points_begin = points.size();
+      for (size_t i = 0; i < indices->size(); ++i) {
+        points.push_back(ToPoint(scene_.points[indices->at(i)]));
+      }
+      node.num_points = indices->size();
+      nodes.push_back(node);
+      return index;
+    }
+    nodes.push_back(node);
+
+    const float half = size / 2;
+    const Eigen::Vector3f mid = min_pt + Eigen::Vector3f::Constant(half);
+    std::vector<int> octants[8];
+    for (size_t i = 0; i < indices->size(); ++i) {
+      const PointC& pt = scene_.points[indices->at(i)];
+      int octant = (pt.x >= mid.x() ? 1 : 0) | (pt.y >= mid.y() ? 2 : 0) |
+                   (pt.z >= mid.z() ? 4 : 0);
+      octants[octant].push_back(indices->at(i));
+    }
+    std::vector<int>().swap(*indices);
+
+    for (int octant = 0; octant < 8; ++octant) {
+      if (octants[octant].empty()) {
+        continue;
+      }
+      Eigen::Vector3f child_min(
+          (octant & 1) ? mid.x() : min_pt.x(),
+          (octant & 2) ? mid.y() : min_pt.y(),
+          (octant & 4) ? mid.z() : min_pt.z());
+      uint32_t child = Build(&octants[octant], child_min, half, depth + 1);
+      nodes[index].children[octant] = child;
+    }
+    return index;
+  }
+
+  std::vector<Node> nodes;
+  std::vector<Point> points;
+
+ private:
+  const PointCloudC& scene_;
+  SceneOctreeOptions options_;
+};
+
+bool Intersects(const Node& node, const Eigen::Vector3f& min_pt,
+                const Eigen::Vector3f& max_pt) {
+  for (int i = 0; i < 3; ++i) {
+    if (node.min_pt[i] > max_pt[i] || node.min_pt[i] + node.size < min_pt[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void AddPointsInBox(const Point* points, const uint64_t begin,
+                    const uint32_t count, const Eigen::Vector3f& min_pt,
+                    const Eigen::Vector3f& max_pt, PointCloudC* cloud) {
+  for (uint64_t i = begin; i < begin + count; ++i) {
+    const Point& point = points[i];
+    if (point.x < min_pt.x() || point.y < min_pt.y() || point.z < min_pt.z() ||
+        point.x > max_pt.x() || point.y > max_pt.y() || point.z > max_pt.z()) {
+      continue;
+    }
+    cloud->push_back(FromPoint(point));
+  }
+}
+
+void Visit(const Node* nodes, const Point* points, const uint32_t index,
+           const Eigen::Vector3f& min_pt, const Eigen::Vector3f& max_pt,
+           PointCloudC* cloud, int* num_read) {
+  const Node& node = nodes[index];
+  if (!Intersects(node, min_pt, max_pt)) {
+    return;
+  }
+  ++*num_read;
+  if (node.num_points > 0) {
+    AddPointsInBox(points, node.points_begin, node.num_points, min_pt, max_pt,
+                   cloud);
+    return;
+  }
+  for (int octant = 0; octant < 8; ++octant) {
+    if (node.children[octant] != 0) {
+      Visit(nodes, points, node.children[octant], min_pt, max_pt, cloud,
+            num_read);
+    }
+  }
+}
+
+// Creates the directory that the file at path is in, and its parents.
+bool MakeParentDirs(const std::string& path) {
+  size_t end = path.rfind('/');
+  if (end == std::string::npos || end == 0) {
+    return true;
+  }
+  size_t slash = 0;
+  while (slash < end) {
+    slash = path.find('/', slash + 1);
+    std::string dir = path.substr(0, slash);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      ROS_ERROR("Failed to create directory %s: %s", dir.c_str(),
+                strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns true if the nodes only refer to points in the file, and each child
+// comes after its parent, so that a query always stays inside the mapped file
+// and terminates.
+bool NodesAreValid(const Node* nodes, const uint32_t num_nodes,
+                   const uint64_t num_points) {
+  for (uint32_t i = 0; i < num_nodes; ++i) {
+    const Node& node = nodes[i];
+    if (node.points_begin > num_points ||
+        node.num_points > num_points - node.points_begin) {
+      return false;
+    }
+    for (int octant = 0; octant < 8; ++octant) {
+      uint32_t child = node.children[octant];
+      if (child != 0 && (child <= i || child >= num_nodes)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+}  // namespace
+
+SceneOctreeOptions::SceneOctreeOptions()
+    : max_leaf_points(4096), max_depth(12) {}
+
+bool WriteSceneOctree(const PointCloudC& scene,
+                      const SceneOctreeOptions& options,
+                      const std::string& path) {
+  std::vector<int> indices;
+  indices.reserve(scene.size());
+  Eigen::Vector3f min_pt = Eigen::Vector3f::Constant(0);
+  Eigen::Vector3f max_pt = Eigen::Vector3f::Constant(0);
+  for (size_t i = 0; i < scene.size(); ++i) {
+    const PointC& pt = scene.points[i];
+    if (!pcl_isfinite(pt.x) || !pcl_isfinite(pt.y) || !pcl_isfinite(pt.z)) {
+      continue;
+    }
+    Eigen::Vector3f point(pt.x, pt.y, pt.z);
+    if (indices.empty()) {
+      min_pt = point;
+      max_pt = point;
+    } else {
+      min_pt = min_pt.cwiseMin(point);
+      max_pt = max_pt.cwiseMax(point);
+    }
+    indices.push_back(i);
+  }
+  // The root is a cube around the scene, slightly larger so that the points
+  // on the max faces are inside.
+  float size = std::max(1e-3f, (max_pt - min_pt).maxCoeff() * 1.001f);
+
+  OctreeBuilder builder(scene, options);
+  uint64_t num_points = indices.size();
+  builder.Build(&indices, min_pt, size, 0);
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.num_nodes = builder.nodes.size();
+  header.num_points = num_points;
+  strncpy(header.frame_id, scene.header.frame_id.c_str(),
+          sizeof(header.frame_id) - 1);
+
+  if (!MakeParentDirs(path)) {
+    return false;
+  }
+  std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(&builder.nodes[0]),
+            builder.nodes.size() * sizeof(Node));
+  if (!builder.points.empty()) {
+    out.write(reinterpret_cast<const char*>(&builder.points[0]),
+              builder.points.size() * sizeof(Point));
+  }
+  out.close();
+  if (!out) {
+    ROS_ERROR("Failed to write scene octree %s", path.c_str());
+    return false;
+  }
+  ROS_INFO("Wrote scene octree %s: %d points, %d nodes", path.c_str(),
+           static_cast<int>(num_points),
+           static_cast<int>(builder.nodes.size()));
+  return true;
+}
+
+std::string SceneOctreePath(const std::string& dir, const std::string& name) {
+  std::string file_name(name);
+  for (size_t i = 0; i < file_name.size(); ++i) {
+    char c = file_name[i];
+    if (!isalnum(c) && c != '-' && c != '_' && c != '.') {
+      file_name[i] = '_';
+    }
+  }
+  return dir + "/" + file_name + ".octree";
+}
+
+std::string SceneOctreePathParam(const std::string& name) {
+  std::string dir;
+  ros::param::param<std::string>("scene_octree_dir", dir, "");
+  if (dir == "") {
+    return "";
+  }
+  return SceneOctreePath(dir, name);
+}
+
+bool GetSceneCloud(rapid::db::NameDb* cloud_db, const std::string& name,
+                   sensor_msgs::PointCloud2* cloud) {
+  std::string path = SceneOctreePathParam(name);
+  SceneOctree octree;
+  if (path != "" && octree.Open(path)) {
+    const float inf = std::numeric_limits<float>::max();
+    PointCloudC scene;
+    octree.Query(Eigen::Vector3f::Constant(-inf),
+                 Eigen::Vector3f::Constant(inf), &scene);
+    pcl::toROSMsg(scene, *cloud);
+    return true;
+  }
+  return cloud_db->Get(name, cloud);
+}
+
+SceneOctree::SceneOctree() : fd_(-1), data_(NULL), size_(0) {}
+
+SceneOctree::~SceneOctree() { Close(); }
+
+bool SceneOctree::Open(const std::string& path) {
+  Close();
+  fd_ = open(path.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd_, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < sizeof(Header)) {
+    ROS_ERROR("%s is not a scene octree", path.c_str());
+    Close();
+    return false;
+  }
+  size_ = info.st_size;
+  void* data = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    ROS_ERROR("Failed to map scene octree %s", path.c_str());
+    Close();
+    return false;
+  }
+  data_ = static_cast<char*>(data);
+
+  // The counts are checked against the file size before they are multiplied,
+  // so that a corrupt header can't overflow the expected size.
+  const Header* header = reinterpret_cast<const Header*>(data_);
+  const size_t body_size = size_ - sizeof(Header);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion || header->num_nodes == 0 ||
+      header->num_nodes > body_size / sizeof(Node) ||
+      header->num_points > body_size / sizeof(Point) ||
+      body_size != header->num_nodes * sizeof(Node) +
+                       header->num_points * sizeof(Point)) {
+    ROS_ERROR("%s is not a scene octree, or is from a different version",
+              path.c_str());
+    Close();
+    return false;
+  }
+  const Node* nodes = reinterpret_cast<const Node*>(data_ + sizeof(Header));
+  if (!NodesAreValid(nodes, header->num_nodes, header->num_points)) {
+    ROS_ERROR("Scene octree %s is corrupt", path.c_str());
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void SceneOctree::Close() {
+  if (data_ != NULL) {
+    munmap(data_, size_);
+    data_ = NULL;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  size_ = 0;
+}
+
+bool SceneOctree::is_open() const { return data_ != NULL; }
+
+uint64_t SceneOctree::num_points() const {
+  if (data_ == NULL) {
+    return 0;
+  }
+  return reinterpret_cast<const Header*>(data_)->num_points;
+}
+
+int SceneOctree::Query(const Eigen::Vector3f& min_pt,
+                       const Eigen::Vector3f& max_pt,
+                       PointCloudC* cloud) const {
+  cloud->clear();
+  if (data_ == NULL) {
+    return 0;
+  }
+  const Header* header = reinterpret_cast<const Header*>(data_);
+  const Node* nodes = reinterpret_cast<const Node*>(data_ + sizeof(Header));
+  const Point* points = reinterpret_cast<const Point*>(
+      data_ + sizeof(Header) + header->num_nodes * sizeof(Node));
+  cloud->header.frame_id = std::string(
+      header->frame_id, strnlen(header->frame_id, sizeof(header->frame_id)));
+
+  int num_read = 0;
+  Visit(nodes, points, 0, min_pt, max_pt, cloud, &num_read);
+  return num_read;
+}
+}  // namespace object_search
@@ -0,0 +1,88 @@
+#include "object_search/scene_registry.h"
+
+#include <sstream>
+#include <string>
+
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "ros/ros.h"
+
+#include "object_search/scene_buffer.h"
+
+namespace object_search {
+SceneRegistry::SceneRegistry(const int max_scenes)
+    : max_scenes_(max_scenes), mutex_(), entries_(), next_id_(0) {}
+
+std::string SceneRegistry::Register(
+    const boost::shared_ptr<const PreparedScene>& scene,
+    const ros::WallDuration& ttl) {
+  ros::WallTime now = ros::WallTime::now();
+  boost::mutex::scoped_lock lock(mutex_);
+  RemoveExpired(now);
+  while (!entries_.empty() &&
+         static_cast<int>(entries_.size()) >= max_scenes_) {
+    EntryMap::iterator oldest = entries_.begin();
+    for (EntryMap::iterator it = entries_.begin(); it != entries_.end();
+         ++it) {
+      if (it->second.expires < oldest->second.expires) {
+        oldest = it;
+      }
+    }
+    ROS_INFO("Dropping scene %s to make room for a new one",
+             oldest->first.c_str());
+    entries_.erase(oldest);
+  }
+
+  // The time makes handles from an earlier run of the node unlikely to match.
+  std::stringstream ss;
+  ss << "scene-" << now.toNSec() << "-" << next_id_++;
+  Entry entry;
+  entry.scene = scene;
+  entry.ttl = ttl;
+  entry.expires = now + ttl;
+  entries_[ss.str()] = entry;
+  return ss.str();
+}
+
+boost::shared_ptr<const PreparedScene> SceneRegistry::Find(
+    const std::string& handle) {
+  ros::WallTime now = ros::WallTime::now();
+  boost::mutex::scoped_lock lock(mutex_);
+  RemoveExpired(now);
+  EntryMap::iterator it = entries_.find(handle);
+  if (it == entries_.end()) {
+    return boost::shared_ptr<const PreparedScene>();
+  }
+  it->second.expires = now + it->second.ttl;
+  return it->second.scene;
+}
+
+bool SceneRegistry::Release(const std::string& handle) {
+  boost::mutex::scoped_lock lock(mutex_);
+  RemoveExpired(ros::WallTime::now());
+  return entries_.erase(handle) > 0;
+}
+
+size_t SceneRegistry::size() {
+  boost::mutex::scoped_lock lock(mutex_);
+  RemoveExpired(ros::WallTime::now());
+  return entries_.size();
+}
+
+void SceneRegistry::set_max_scenes(const int max_scenes) {
+  boost::mutex::scoped_lock lock(mutex_);
+  max_scenes_ = max_scenes;
+}
+
+void SceneRegistry::RemoveExpired(const ros::WallTime& now) {
+  EntryMap::iterator it = entries_.begin();
+  while (it != entries_.end()) {
+    if (it->second.expires <= now) {
+      ROS_INFO("Scene %s expired", it->first.c_str());
+      entries_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+}  // namespace object_search
@@ -0,0 +1,172 @@
+#include "object_search/scene_tiles.h"
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "Eigen/Core"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+
+namespace object_search {
+namespace {
+bool IsFinite(const PointC& pt) {
+  return pcl_isfinite(pt.x) && pcl_isfinite(pt.y) && pcl_isfinite(pt.z);
+}
+}  // namespace
+
+SceneTiles::SceneTiles(const PointCloudC& scene, const double tile_size,
+                       const double overlap)
+    : scene_(scene),
+      tile_size_(tile_size),
+      overlap_(overlap),
+      reach_(0),
+      min_cell_x_(0),
+      min_cell_y_(0),
+      num_cells_x_(0),
+      num_cells_y_(0),
+      cell_start_(),
+      cell_points_(),
+      tiles_(),
+      tile_points_(),
+      tile_min_(),
+      tile_max_() {
+  if (tile_size <= 0) {
+    return;
+  }
+  reach_ = static_cast<int>(ceil(overlap / tile_size));
+
+  // Find the grid cells the scene spans.
+  int min_x = std::numeric_limits<int>::max();
+  int min_y = std::numeric_limits<int>::max();
+  int max_x = std::numeric_limits<int>::min();
+  int max_y = std::numeric_limits<int>::min();
+  std::vector<int> point_cells(scene.size(), -1);
+  for (size_t i = 0; i < scene.size(); ++i) {
+    const PointC& pt = scene.points[i];
+    if (!IsFinite(pt)) {
+      continue;
+    }
+    int cell_x = static_cast<int>(floor(pt.x / tile_size));
+    int cell_y = static_cast<int>(floor(pt.y / tile_size));
+    min_x = std::min(min_x, cell_x);
+    min_y = std::min(min_y, cell_y);
+    max_x = std::max(max_x, cell_x);
+    max_y = std::max(max_y, cell_y);
+  }
+  if (min_x > max_x) {
+    return;
+  }
+  min_cell_x_ = min_x;
+  min_cell_y_ = min_y;
+  num_cells_x_ = max_x - min_x + 1;
+  num_cells_y_ = max_y - min_y + 1;
+
+  // Count the points in each cell, and in each tile, and find the bounds of
+  // each tile. Tiles extend reach_ cells past the scene's cells on each side.
+  const int num_tiles_y = num_cells_y_ + 2 * reach_;
+  const int num_tiles = (num_cells_x_ + 2 * reach_) * num_tiles_y;
+  std::vector<int> cell_counts(num_cells_x_ * num_cells_y_, 0);
+  std::vector<int> tile_counts(num_tiles, 0);
+  const float kMax = std::numeric_limits<float>::max();
+  std::vector<Eigen::Vector3f> tile_min(num_tiles,
+                                        Eigen::Vector3f(kMax, kMax, kMax));
+  std::vector<Eigen::Vector3f> tile_max(num_tiles,
+                                        Eigen::Vector3f(-kMax, -kMax, -kMax));
+  for (size_t i = 0; i < scene.size(); ++i) {
+    const PointC& pt = scene.points[i];
+    if (!IsFinite(pt)) {
+      continue;
+    }
+    int cell_x = static_cast<int>(floor(pt.x / tile_size));
+    int cell_y = static_cast<int>(floor(pt.y / tile_size));
+    point_cells[i] = (cell_x - min_cell_x_) * num_cells_y_ +
+                     (cell_y - min_cell_y_);
+    ++cell_counts[point_cells[i]];
+    for (int tx = cell_x - reach_; tx <= cell_x + reach_; ++tx) {
+      for (int ty = cell_y - reach_; ty <= cell_y + reach_; ++ty) {
+        if (InTile(pt, tx, ty)) {
+          int t = (tx - min_cell_x_ + reach_) * num_tiles_y +
+                  (ty - min_cell_y_ + reach_);
+          ++tile_counts[t];
+          tile_min[t] = tile_min[t].cwiseMin(pt.getVector3fMap());
+          tile_max[t] = tile_max[t].cwiseMax(pt.getVector3fMap());
+        }
+      }
+    }
+  }
+
+  // Sort the point indices by cell.
+  cell_start_.resize(cell_counts.size() + 1, 0);
+  for (size_t c = 0; c < cell_counts.size(); ++c) {
+    cell_start_[c + 1] = cell_start_[c] + cell_counts[c];
+  }
+  cell_points_.resize(cell_start_.back());
+  std::vector<int> next(cell_start_.begin(), cell_start_.end() - 1);
+  for (size_t i = 0; i < scene.size(); ++i) {
+    if (point_cells[i] >= 0) {
+      cell_points_[next[point_cells[i]]++] = i;
+    }
+  }
+
+  for (size_t t = 0; t < tile_counts.size(); ++t) {
+    if (tile_counts[t] == 0) {
+      continue;
+    }
+    int tx = static_cast<int>(t) / num_tiles_y + min_cell_x_ - reach_;
+    int ty = static_cast<int>(t) % num_tiles_y + min_cell_y_ - reach_;
+    tiles_.push_back(std::make_pair(tx, ty));
+    tile_points_.push_back(tile_counts[t]);
+    tile_min_.push_back(tile_min[t]);
+    tile_max_.push_back(tile_max[t]);
+  }
+}
+
+size_t SceneTiles::size() const { return tiles_.size(); }
+
+int SceneTiles::num_points(const size_t i) const { return tile_points_[i]; }
+
+std::vector<int> SceneTiles::num_points() const { return tile_points_; }
+
+void SceneTiles::Bounds(const size_t i, Eigen::Vector3f* min_pt,
+                        Eigen::Vector3f* max_pt) const {
+  *min_pt = tile_min_[i];
+  *max_pt = tile_max_[i];
+}
+
+void SceneTiles::Extract(const size_t i, PointCloudC* tile) const {
+  const int tx = tiles_[i].first;
+  const int ty = tiles_[i].second;
+  tile->clear();
+  tile->header = scene_.header;
+  tile->reserve(tile_points_[i]);
+  const int min_x = std::max(tx - reach_, min_cell_x_);
+  const int max_x = std::min(tx + reach_, min_cell_x_ + num_cells_x_ - 1);
+  const int min_y = std::max(ty - reach_, min_cell_y_);
+  const int max_y = std::min(ty + reach_, min_cell_y_ + num_cells_y_ - 1);
+  for (int cell_x = min_x; cell_x <= max_x; ++cell_x) {
+    for (int cell_y = min_y; cell_y <= max_y; ++cell_y) {
+      int c = (cell_x - min_cell_x_) * num_cells_y_ + (cell_y - min_cell_y_);
+      for (int j = cell_start_[c]; j < cell_start_[c + 1]; ++j) {
+        const PointC& pt = scene_.points[cell_points_[j]];
+        if (InTile(pt, tx, ty)) {
+          tile->push_back(pt);
+        }
+      }
+    }
+  }
+}
+
+bool SceneTiles::InTile(const PointC& pt, const int tx, const int ty) const {
+  float min_x = tx * tile_size_ - overlap_;
+  float min_y = ty * tile_size_ - overlap_;
+  float max_x = (tx + 1) * tile_size_ + overlap_;
+  float max_y = (ty + 1) * tile_size_ + overlap_;
+  return pt.x >= min_x && pt.x < max_x && pt.y >= min_y && pt.y < max_y;
+}
+}  // namespace object_search
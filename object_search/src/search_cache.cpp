@@ -0,0 +1,154 @@
+#include "object_search/search_cache.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "boost/thread/mutex.hpp"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "ros/ros.h"
+
+#include "object_search_msgs/Match.h"
+
+namespace object_search {
+namespace {
+const uint64_t kFnvOffset = 14695981039346656037ULL;
+const uint64_t kFnvPrime = 1099511628211ULL;
+
+// Packs a voxel index into 21 bits per axis, which covers several kilometers
+// at millimeter voxels.
+uint64_t VoxelKey(const float x, const float y, const float z,
+                  const double leaf_size) {
+  const uint64_t mask = (1 << 21) - 1;
+  uint64_t i = static_cast<int64_t>(floor(x / leaf_size)) & mask;
+  uint64_t j = static_cast<int64_t>(floor(y / leaf_size)) & mask;
+  uint64_t k = static_cast<int64_t>(floor(z / leaf_size)) & mask;
+  return (i << 42) | (j << 21) | k;
+}
+}  // namespace
+
+uint64_t HashVoxelOccupancy(const pcl::PointCloud<pcl::PointXYZRGB>& cloud,
+                            const double leaf_size) {
+  std::vector<uint64_t> keys;
+  keys.reserve(cloud.size());
+  for (size_t i = 0; i < cloud.size(); ++i) {
+    const pcl::PointXYZRGB& pt = cloud.points[i];
+    if (!pcl_isfinite(pt.x) || !pcl_isfinite(pt.y) || !pcl_isfinite(pt.z)) {
+      continue;
+    }
+    keys.push_back(VoxelKey(pt.x, pt.y, pt.z, leaf_size));
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  // FNV-1a over the bytes of the sorted keys.
+  uint64_t hash = kFnvOffset;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    for (int byte = 0; byte < 8; ++byte) {
+      hash ^= (keys[i] >> (8 * byte)) & 0xff;
+      hash *= kFnvPrime;
+    }
+  }
+  return hash;
+}
+
+SearchCache::SearchCache()
+    : mutex_(),
+      entries_(),
+      ttl_(10),
+      max_entries_(32),
+      num_hits_(0),
+      num_misses_(0),
+      num_expired_(0) {}
+
+bool SearchCache::Find(const std::string& key,
+                       std::vector<object_search_msgs::Match>* matches) {
+  ros::WallTime now = ros::WallTime::now();
+  boost::mutex::scoped_lock lock(mutex_);
+  EntryMap::iterator it = entries_.find(key);
+  if (it != entries_.end() && now - it->second.created >= ttl_) {
+    ++num_expired_;
+    entries_.erase(it);
+    it = entries_.end();
+  }
+  if (it == entries_.end()) {
+    ++num_misses_;
+    return false;
+  }
+  ++num_hits_;
+  *matches = it->second.matches;
+  return true;
+}
+
+void SearchCache::Insert(
+    const std::string& key,
+    const std::vector<object_search_msgs::Match>& matches) {
+  ros::WallTime now = ros::WallTime::now();
+  boost::mutex::scoped_lock lock(mutex_);
+  RemoveExpired(now);
+  while (!entries_.empty() &&
+         static_cast<int>(entries_.size()) >= max_entries_ &&
+         entries_.find(key) == entries_.end()) {
+    EntryMap::iterator oldest = entries_.begin();
+    for (EntryMap::iterator it = entries_.begin(); it != entries_.end();
+         ++it) {
+      if (it->second.created < oldest->second.created) {
+        oldest = it;
+      }
+    }
+    entries_.erase(oldest);
+  }
+  Entry& entry = entries_[key];
+  entry.matches = matches;
+  entry.created = now;
+}
+
+void SearchCache::Clear() {
+  boost::mutex::scoped_lock lock(mutex_);
+  entries_.clear();
+}
+
+size_t SearchCache::size() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return entries_.size();
+}
+
+void SearchCache::set_ttl(const ros::WallDuration& ttl) {
+  boost::mutex::scoped_lock lock(mutex_);
+  ttl_ = ttl;
+}
+
+void SearchCache::set_max_entries(const int max_entries) {
+  boost::mutex::scoped_lock lock(mutex_);
+  max_entries_ = max_entries;
+}
+
+int SearchCache::num_hits() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return num_hits_;
+}
+
+int SearchCache::num_misses() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return num_misses_;
+}
+
+int SearchCache::num_expired() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return num_expired_;
+}
+
+void SearchCache::RemoveExpired(const ros::WallTime& now) {
+  EntryMap::iterator it = entries_.begin();
+  while (it != entries_.end()) {
+    if (now - it->second.created >= ttl_) {
+      entries_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+}  // namespace object_search
@@ -0,0 +1,72 @@
+#include "object_search/search_progress.h"
+
+#include <string>
+
+#include "boost/thread/mutex.hpp"
+
+namespace object_search {
+SearchProgress::SearchProgress()
+    : callback_(),
+      mutex_(),
+      stage_(""),
+      candidates_(0),
+      best_fitness_(-1),
+      cancelled_(false) {}
+
+SearchProgress::SearchProgress(const Callback& callback)
+    : callback_(callback),
+      mutex_(),
+      stage_(""),
+      candidates_(0),
+      best_fitness_(-1),
+      cancelled_(false) {}
+
+void SearchProgress::SetStage(const std::string& stage) {
+  int candidates;
+  double best_fitness;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stage_ = stage;
+    candidates = candidates_;
+    best_fitness = best_fitness_;
+  }
+  Notify(stage, candidates, best_fitness);
+}
+
+void SearchProgress::AddCandidates(const int num_candidates,
+                                   const double best_fitness) {
+  std::string stage;
+  int candidates;
+  double best;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    candidates_ += num_candidates;
+    if (best_fitness >= 0 &&
+        (best_fitness_ < 0 || best_fitness < best_fitness_)) {
+      best_fitness_ = best_fitness;
+    }
+    stage = stage_;
+    candidates = candidates_;
+    best = best_fitness_;
+  }
+  Notify(stage, candidates, best);
+}
+
+void SearchProgress::Cancel() {
+  boost::mutex::scoped_lock lock(mutex_);
+  cancelled_ = true;
+}
+
+bool SearchProgress::cancelled() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return cancelled_;
+}
+
+// The callback is run without the lock held, so that it may take its time.
+void SearchProgress::Notify(const std::string& stage, const int candidates,
+                            const double best_fitness) {
+  if (callback_) {
+    callback_(stage, candidates, best_fitness);
+  }
+}
+}  // namespace object_search
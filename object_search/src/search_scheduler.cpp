@@ -0,0 +1,159 @@
+#include "object_search/search_scheduler.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "boost/shared_ptr.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread_time.hpp"
+#include "ros/ros.h"
+
+#include "object_search_msgs/Match.h"
+
+namespace object_search {
+namespace {
+// How often queued requests check whether they have been cancelled.
+const int kCancelPollMs = 100;
+}  // namespace
+
+SearchScheduler::Request::Request()
+    : key(""), priority(0), sequence(0), done(false), matches() {}
+
+SearchScheduler::SearchScheduler(const int max_queued)
+    : mutex_(),
+      cond_(),
+      max_queued_(max_queued),
+      queue_(),
+      by_key_(),
+      busy_(false),
+      next_sequence_(0),
+      num_run_(0),
+      num_coalesced_(0),
+      num_rejected_(0),
+      num_cancelled_(0) {}
+
+bool SearchScheduler::Run(const std::string& key, const int priority,
+                          const Work& work, const Cancelled& cancelled,
+                          std::vector<object_search_msgs::Match>* matches) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (key != "") {
+    std::map<std::string, boost::shared_ptr<Request> >::iterator it =
+        by_key_.find(key);
+    if (it != by_key_.end()) {
+      boost::shared_ptr<Request> request = it->second;
+      request->priority = std::max(request->priority, priority);
+      ++num_coalesced_;
+      ROS_INFO("Coalescing with an identical search already in progress");
+      while (!request->done) {
+        cond_.wait(lock);
+      }
+      *matches = request->matches;
+      return true;
+    }
+  }
+
+  if (static_cast<int>(queue_.size()) >= max_queued_) {
+    ++num_rejected_;
+    return false;
+  }
+  boost::shared_ptr<Request> request(new Request);
+  request->key = key;
+  request->priority = priority;
+  request->sequence = next_sequence_++;
+  queue_.push_back(request);
+  if (key != "") {
+    by_key_[key] = request;
+  }
+  if (busy_) {
+    ROS_INFO("Search queued behind %d others (priority %d)",
+             static_cast<int>(queue_.size()) - 1, priority);
+  }
+  while (busy_ || Next() != request) {
+    if (cancelled.empty()) {
+      cond_.wait(lock);
+      continue;
+    }
+    if (cancelled()) {
+      Drop(request);
+      matches->clear();
+      return true;
+    }
+    cond_.timed_wait(lock, boost::get_system_time() +
+                               boost::posix_time::milliseconds(kCancelPollMs));
+  }
+  queue_.erase(std::find(queue_.begin(), queue_.end(), request));
+  busy_ = true;
+  ++num_run_;
+
+  // If the search throws, the scheduler still moves on to the next request,
+  // and the requests that joined this one get whatever it had found.
+  lock.unlock();
+  try {
+    work(&request->matches);
+  } catch (...) {
+    lock.lock();
+    Finish(request);
+    throw;
+  }
+  lock.lock();
+
+  Finish(request);
+  *matches = request->matches;
+  return true;
+}
+
+int SearchScheduler::num_run() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return num_run_;
+}
+
+int SearchScheduler::num_coalesced() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return num_coalesced_;
+}
+
+int SearchScheduler::num_rejected() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return num_rejected_;
+}
+
+int SearchScheduler::num_cancelled() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return num_cancelled_;
+}
+
+void SearchScheduler::Finish(const boost::shared_ptr<Request>& request) {
+  busy_ = false;
+  request->done = true;
+  if (request->key != "") {
+    by_key_.erase(request->key);
+  }
+  cond_.notify_all();
+}
+
+void SearchScheduler::Drop(const boost::shared_ptr<Request>& request) {
+  queue_.erase(std::find(queue_.begin(), queue_.end(), request));
+  request->done = true;
+  if (request->key != "") {
+    by_key_.erase(request->key);
+  }
+  ++num_cancelled_;
+  ROS_INFO("Search cancelled while queued");
+  // The next request in line may be waiting for this one to leave.
+  cond_.notify_all();
+}
+
+boost::shared_ptr<SearchScheduler::Request> SearchScheduler::Next() const {
+  boost::shared_ptr<Request> next = queue_[0];
+  for (size_t i = 1; i < queue_.size(); ++i) {
+    const Request& request = *queue_[i];
+    if (request.priority > next->priority ||
+        (request.priority == next->priority &&
+         request.sequence < next->sequence)) {
+      next = queue_[i];
+    }
+  }
+  return next;
+}
+}  // namespace object_search
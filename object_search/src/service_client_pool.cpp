@@ -0,0 +1,37 @@
+#include "object_search/service_client_pool.h"
+
+#include <string>
+
+#include "boost/function.hpp"
+#include "boost/thread/mutex.hpp"
+#include "ros/ros.h"
+
+namespace object_search {
+ServiceClientPool::ServiceClientPool(
+    const boost::function<ros::ServiceClient()>& connect,
+    const std::string& service, const int size, const bool idempotent)
+    : connect_(connect),
+      service_(service),
+      idempotent_(idempotent),
+      mutex_(),
+      cond_(),
+      idle_(size) {}
+
+ros::ServiceClient ServiceClientPool::Acquire() {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (idle_.empty()) {
+    cond_.wait(lock);
+  }
+  ros::ServiceClient client = idle_.back();
+  idle_.pop_back();
+  return client;
+}
+
+void ServiceClientPool::Release(const ros::ServiceClient& client) {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    idle_.push_back(client);
+  }
+  cond_.notify_one();
+}
+}  // namespace object_search
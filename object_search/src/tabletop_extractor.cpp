@@ -0,0 +1,253 @@
+#include "object_search/tabletop_extractor.h"
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "Eigen/Core"
+#include "pcl/ModelCoefficients.h"
+#include "pcl/PointIndices.h"
+#include "pcl/common/io.h"
+#include "pcl/point_cloud.h"
+#include "pcl/point_types.h"
+#include "pcl/sample_consensus/method_types.h"
+#include "pcl/sample_consensus/model_types.h"
+#include "pcl/sample_consensus/sac_model_plane.h"
+#include "pcl/search/kdtree.h"
+#include "pcl/segmentation/extract_clusters.h"
+#include "pcl/segmentation/sac_segmentation.h"
+#include "rapid_perception/scene.h"
+#include "rapid_perception/scene_parsing.h"
+#include "ros/ros.h"
+
+typedef pcl::PointXYZRGB PointC;
+typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloudC;
+
+namespace object_search {
+TabletopExtractor::TabletopExtractor()
+    : use_cache_(true),
+      max_angle_change_(0.05),
+      max_offset_change_(0.02),
+      min_inlier_ratio_(0.7),
+      distance_threshold_(0.01),
+      max_object_height_(0.5),
+      cluster_tolerance_(0.01),
+      min_cluster_size_(50),
+      has_plane_(false),
+      plane_(Eigen::VectorXf::Zero(4)),
+      num_inliers_(0),
+      table_min_(Eigen::Vector3f::Zero()),
+      table_max_(Eigen::Vector3f::Zero()) {}
+
+void TabletopExtractor::set_use_cache(bool use_cache) {
+  use_cache_ = use_cache;
+}
+
+void TabletopExtractor::set_max_angle_change(double max_angle_change) {
+  max_angle_change_ = max_angle_change;
+}
+
+void TabletopExtractor::set_max_offset_change(double max_offset_change) {
+  max_offset_change_ = max_offset_change;
+}
+
+void TabletopExtractor::set_min_inlier_ratio(double min_inlier_ratio) {
+  min_inlier_ratio_ = min_inlier_ratio;
+}
+
+void TabletopExtractor::set_distance_threshold(double distance_threshold) {
+  distance_threshold_ = distance_threshold;
+}
+
+void TabletopExtractor::set_max_object_height(double max_object_height) {
+  max_object_height_ = max_object_height;
+}
+
+void TabletopExtractor::set_cluster_tolerance(double cluster_tolerance) {
+  cluster_tolerance_ = cluster_tolerance;
+}
+
+void TabletopExtractor::set_min_cluster_size(int min_cluster_size) {
+  min_cluster_size_ = min_cluster_size;
+}
+
+void TabletopExtractor::Extract(PointCloudC::Ptr cloud,
+                                std::vector<PointCloudC::Ptr>* clusters) {
+  clusters->clear();
+  pcl::PointIndices::Ptr inliers(new pcl::PointIndices);
+  if (use_cache_ && has_plane_ && Refine(cloud, inliers)) {
+    ROS_INFO("Reusing cached table plane (%d inliers)",
+             static_cast<int>(inliers->indices.size()));
+    ClusterAbovePlane(cloud, clusters);
+  } else {
+    ParseAndCache(cloud, clusters);
+  }
+  for (size_t i = 0; i < clusters->size(); ++i) {
+    clusters->at(i)->header.frame_id = cloud->header.frame_id;
+  }
+}
+
+void TabletopExtractor::Reset() { has_plane_ = false; }
+
+// Runs the full scene parser. If use_cache is set, also fits the plane of the
+// primary surface, caches it for later calls and clusters the points above it.
+// Otherwise, the parser's objects are used.
+void TabletopExtractor::ParseAndCache(PointCloudC::Ptr cloud,
+                                      std::vector<PointCloudC::Ptr>* clusters) {
+  has_plane_ = false;
+  rapid::perception::Scene scene;
+  rapid::perception::ParseScene(cloud, rapid::perception::Pr2Params(), &scene);
+  if (use_cache_) {
+    if (FitPlane(cloud, scene.primary_surface().GetCloud())) {
+      ClusterAbovePlane(cloud, clusters);
+      return;
+    }
+    ROS_WARN("Could not fit the table plane, using the scene parser's objects");
+  }
+
+  std::vector<rapid::perception::Object> objects =
+      scene.primary_surface().objects();
+  for (size_t i = 0; i < objects.size(); ++i) {
+    PointCloudC::Ptr cluster(new PointCloudC(*objects[i].GetCloud()));
+    clusters->push_back(cluster);
+  }
+}
+
+// Fits a plane to the surface points, which is cheap since the surface has
+// already been segmented. Returns false if there is no plane.
+bool TabletopExtractor::FitPlane(PointCloudC::Ptr cloud,
+                                 PointCloudC::Ptr surface) {
+  if (!surface || surface->empty()) {
+    return false;
+  }
+  pcl::SACSegmentation<PointC> seg;
+  seg.setOptimizeCoefficients(true);
+  seg.setModelType(pcl::SACMODEL_PLANE);
+  seg.setMethodType(pcl::SAC_RANSAC);
+  seg.setDistanceThreshold(distance_threshold_);
+  seg.setInputCloud(surface);
+  pcl::PointIndices surface_inliers;
+  pcl::ModelCoefficients coefficients;
+  seg.segment(surface_inliers, coefficients);
+  if (coefficients.values.size() != 4) {
+    return false;
+  }
+  for (int i = 0; i < 4; ++i) {
+    plane_[i] = coefficients.values[i];
+  }
+  if (plane_[2] < 0) {
+    plane_ = -plane_;
+  }
+
+  // Count inliers in the whole cloud, so that later frames are compared on the
+  // same terms.
+  pcl::SampleConsensusModelPlane<PointC> model(cloud);
+  std::vector<int> inliers;
+  model.selectWithinDistance(plane_, distance_threshold_, inliers);
+  if (inliers.empty()) {
+    return false;
+  }
+  num_inliers_ = inliers.size();
+  UpdateTableBounds(*cloud, inliers);
+  has_plane_ = true;
+  ROS_INFO("Fit table plane: %f %f %f %f (%d inliers)", plane_[0],
+           plane_[1], plane_[2], plane_[3], static_cast<int>(num_inliers_));
+  return true;
+}
+
+// Checks the cached plane against the new cloud and refines it. Returns false
+// if the plane has drifted, in which case the cache should be rebuilt.
+bool TabletopExtractor::Refine(PointCloudC::Ptr cloud,
+                               pcl::PointIndices::Ptr inliers) {
+  pcl::SampleConsensusModelPlane<PointC> model(cloud);
+  model.selectWithinDistance(plane_, distance_threshold_, inliers->indices);
+  if (inliers->indices.size() < min_inlier_ratio_ * num_inliers_) {
+    ROS_INFO("Table plane lost inliers (%d of %d), re-parsing scene",
+             static_cast<int>(inliers->indices.size()),
+             static_cast<int>(num_inliers_));
+    return false;
+  }
+
+  Eigen::VectorXf refined;
+  model.optimizeModelCoefficients(inliers->indices, plane_, refined);
+  if (refined.size() != 4) {
+    return false;
+  }
+  if (refined[2] < 0) {
+    refined = -refined;
+  }
+  double cos_angle = plane_.head<3>().normalized().dot(
+      refined.head<3>().normalized());
+  double angle = acos(std::min(1.0, std::max(-1.0, cos_angle)));
+  double offset = fabs(refined[3] / refined.head<3>().norm() -
+                       plane_[3] / plane_.head<3>().norm());
+  if (angle > max_angle_change_ || offset > max_offset_change_) {
+    ROS_INFO("Table plane moved (%f rad, %f m), re-parsing scene", angle,
+             offset);
+    return false;
+  }
+  plane_ = refined;
+  UpdateTableBounds(*cloud, inliers->indices);
+  return true;
+}
+
+// Finds the clusters of points above the cached plane, within the table's
+// horizontal extent.
+void TabletopExtractor::ClusterAbovePlane(
+    PointCloudC::Ptr cloud, std::vector<PointCloudC::Ptr>* clusters) {
+  Eigen::Vector3f normal = plane_.head<3>();
+  float norm = normal.norm();
+  normal /= norm;
+  float offset = plane_[3] / norm;
+
+  std::vector<int> above;
+  for (size_t i = 0; i < cloud->size(); ++i) {
+    const PointC& pt = cloud->points[i];
+    if (!pcl_isfinite(pt.x) || !pcl_isfinite(pt.y) || !pcl_isfinite(pt.z)) {
+      continue;
+    }
+    if (pt.x < table_min_.x() || pt.x > table_max_.x() ||
+        pt.y < table_min_.y() || pt.y > table_max_.y()) {
+      continue;
+    }
+    float height = normal.dot(pt.getVector3fMap()) + offset;
+    if (height > distance_threshold_ && height < max_object_height_) {
+      above.push_back(i);
+    }
+  }
+  PointCloudC::Ptr above_cloud(new PointCloudC);
+  pcl::copyPointCloud(*cloud, above, *above_cloud);
+  if (above_cloud->empty()) {
+    return;
+  }
+
+  pcl::search::KdTree<PointC>::Ptr tree(new pcl::search::KdTree<PointC>);
+  tree->setInputCloud(above_cloud);
+  pcl::EuclideanClusterExtraction<PointC> euclid;
+  euclid.setClusterTolerance(cluster_tolerance_);
+  euclid.setMinClusterSize(min_cluster_size_);
+  euclid.setMaxClusterSize(above_cloud->size());
+  euclid.setSearchMethod(tree);
+  euclid.setInputCloud(above_cloud);
+  std::vector<pcl::PointIndices> cluster_indices;
+  euclid.extract(cluster_indices);
+
+  for (size_t i = 0; i < cluster_indices.size(); ++i) {
+    PointCloudC::Ptr cluster(new PointCloudC);
+    pcl::copyPointCloud(*above_cloud, cluster_indices[i], *cluster);
+    clusters->push_back(cluster);
+  }
+}
+
+void TabletopExtractor::UpdateTableBounds(const PointCloudC& cloud,
+                                          const std::vector<int>& inliers) {
+  table_min_.setConstant(std::numeric_limits<float>::max());
+  table_max_.setConstant(-std::numeric_limits<float>::max());
+  for (size_t i = 0; i < inliers.size(); ++i) {
+    const Eigen::Vector3f pt = cloud.points[inliers[i]].getVector3fMap();
+    table_min_ = table_min_.cwiseMin(pt);
+    table_max_ = table_max_.cwiseMax(pt);
+  }
+}
+}  // namespace object_search
@@ -0,0 +1,108 @@
+#include "object_search/write_behind_queue.h"
+
+#include <string>
+#include <utility>
+
+#include "boost/bind.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/thread.hpp"
+#include "ros/ros.h"
+
+namespace object_search {
+WriteBehindQueue::WriteBehindQueue(const std::string& name,
+                                   const int max_attempts,
+                                   const ros::WallDuration& retry_delay)
+    : name_(name),
+      max_attempts_(max_attempts),
+      retry_delay_(retry_delay),
+      mutex_(),
+      cond_(),
+      writes_(),
+      busy_(false),
+      stopping_(false),
+      thread_() {
+  thread_ = boost::thread(&WriteBehindQueue::Run, this);
+}
+
+WriteBehindQueue::~WriteBehindQueue() {
+  size_t pending = num_pending();
+  if (pending > 0) {
+    ROS_INFO("Finishing %d queued writes to %s", static_cast<int>(pending),
+             name_.c_str());
+  }
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+void WriteBehindQueue::Push(const Write& write) { Push(write, GiveUp()); }
+
+void WriteBehindQueue::Push(const Write& write, const GiveUp& give_up) {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    writes_.push_back(std::make_pair(write, give_up));
+  }
+  cond_.notify_all();
+}
+
+void WriteBehindQueue::Flush() {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (!writes_.empty() || busy_) {
+    cond_.wait(lock);
+  }
+}
+
+size_t WriteBehindQueue::num_pending() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return writes_.size() + (busy_ ? 1 : 0);
+}
+
+void WriteBehindQueue::Run() {
+  while (true) {
+    Write write;
+    GiveUp give_up;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (writes_.empty() && !stopping_) {
+        cond_.wait(lock);
+      }
+      // Queued writes are finished before stopping.
+      if (writes_.empty()) {
+        return;
+      }
+      write = writes_.front().first;
+      give_up = writes_.front().second;
+      writes_.pop_front();
+      busy_ = true;
+    }
+
+    ros::WallDuration delay = retry_delay_;
+    bool success = false;
+    for (int attempt = 1; attempt <= max_attempts_ && !success; ++attempt) {
+      success = write();
+      if (!success && attempt < max_attempts_) {
+        ROS_WARN("Write to %s failed, retrying in %f seconds", name_.c_str(),
+                 delay.toSec());
+        delay.sleep();
+        delay = delay + delay;
+      }
+    }
+    if (!success) {
+      ROS_ERROR("Write to %s failed after %d attempts, giving up",
+                name_.c_str(), max_attempts_);
+      if (give_up) {
+        give_up();
+      }
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      busy_ = false;
+    }
+    cond_.notify_all();
+  }
+}
+}  // namespace object_search
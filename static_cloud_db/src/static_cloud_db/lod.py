@@ -0,0 +1,116 @@
+import numpy as np
+from sensor_msgs import point_cloud2
+from sensor_msgs.msg import PointField
+
+
+# Returns the rotation matrix of a geometry_msgs/Quaternion.
+def _rotation_matrix(q):
+    x, y, z, w = q.x, q.y, q.z, q.w
+    return np.array([[1 - 2 * (y * y + z * z), 2 * (x * y - z * w),
+                      2 * (x * z + y * w)],
+                     [2 * (x * y + z * w), 1 - 2 * (x * x + z * z),
+                      2 * (y * z - x * w)],
+                     [2 * (x * z - y * w), 2 * (y * z + x * w),
+                      1 - 2 * (x * x + y * y)]])
+
+
+# Returns, for each row of voxels, the index of its unique row, along with the
+# number of times each unique row occurs. Equivalent to np.unique with axis=0,
+# which needs numpy 1.13.
+def _unique_rows(voxels):
+    order = np.lexsort(voxels.T[::-1])
+    sorted_voxels = voxels[order]
+    is_new = np.ones(voxels.shape[0], dtype=bool)
+    is_new[1:] = np.any(sorted_voxels[1:] != sorted_voxels[:-1], axis=1)
+    inverse = np.empty(voxels.shape[0], dtype=np.int64)
+    inverse[order] = np.cumsum(is_new) - 1
+    return inverse, np.bincount(inverse)
+
+
+# Downsamples a PointCloud2 to the centroid of each occupied voxel.
+#
+# Matches pcl::VoxelGrid: voxels are aligned to the origin, and colors are
+# averaged per channel. NaN points are dropped. The output is unorganized and
+# only has x, y, z and (if the input has it) rgb fields.
+#
+# If base_to_camera (a geometry_msgs/Transform) is given, the voxels are
+# aligned to the base frame instead of the cloud's frame, so that they line up
+# with the voxels the cloud is searched with. The output stays in the cloud's
+# frame.
+def voxelize(cloud, leaf_size, base_to_camera=None):
+    offsets = dict((field.name, field.offset) for field in cloud.fields)
+    has_rgb = 'rgb' in offsets
+    endian = '>' if cloud.is_bigendian else '<'
+    names = ['x', 'y', 'z']
+    formats = [endian + 'f4'] * 3
+    if has_rgb:
+        # Read the packed color as an integer, since it may be a NaN pattern
+        # when viewed as a float.
+        names.append('rgb')
+        formats.append(endian + 'u4')
+    dtype = np.dtype({
+        'names': names,
+        'formats': formats,
+        'offsets': [offsets[name] for name in names],
+        'itemsize': cloud.point_step
+    })
+    points = np.frombuffer(
+        cloud.data, dtype=dtype, count=cloud.width * cloud.height)
+    xyz = np.column_stack([points['x'], points['y'],
+                           points['z']]).astype(np.float64)
+    finite = np.all(np.isfinite(xyz), axis=1)
+    xyz = xyz[finite]
+
+    fields = [
+        PointField('x', 0, PointField.FLOAT32, 1),
+        PointField('y', 4, PointField.FLOAT32, 1),
+        PointField('z', 8, PointField.FLOAT32, 1)
+    ]
+    if has_rgb:
+        fields.append(PointField('rgb', 12, PointField.FLOAT32, 1))
+    if xyz.shape[0] == 0:
+        return point_cloud2.create_cloud(cloud.header, fields, [])
+
+    grid_xyz = xyz
+    if base_to_camera is not None:
+        # base_to_camera maps base frame points into the camera frame.
+        t = base_to_camera.translation
+        rotation = _rotation_matrix(base_to_camera.rotation)
+        grid_xyz = np.dot(xyz - np.array([t.x, t.y, t.z]), rotation)
+    voxels = np.floor(grid_xyz / leaf_size).astype(np.int64)
+    inverse, counts = _unique_rows(voxels)
+    num_voxels = counts.shape[0]
+    centroids = np.zeros((num_voxels, 3))
+    for i in range(3):
+        centroids[:, i] = np.bincount(
+            inverse, weights=xyz[:, i], minlength=num_voxels) / counts
+    if not has_rgb:
+        return point_cloud2.create_cloud(cloud.header, fields,
+                                         centroids.tolist())
+
+    packed = points['rgb'][finite]
+    averaged = []
+    for shift in (16, 8, 0):
+        channel = (packed >> shift) & 0xff
+        averaged.append(
+            np.bincount(inverse, weights=channel, minlength=num_voxels) /
+            counts)
+    rgb = ((averaged[0].astype(np.uint32) << 16) |
+           (averaged[1].astype(np.uint32) << 8) |
+           averaged[2].astype(np.uint32)).view(np.float32)
+    out_points = [(centroids[i, 0], centroids[i, 1], centroids[i, 2], rgb[i])
+                  for i in range(num_voxels)]
+    return point_cloud2.create_cloud(cloud.header, fields, out_points)
+
+
+# Returns the coarsest leaf size that is no coarser than target, or None if
+# target is not positive or every level is too coarse, in which case the full
+# resolution cloud should be used.
+def pick_level(leaf_sizes, target):
+    if target <= 0:
+        return None
+    best = None
+    for leaf_size in leaf_sizes:
+        if leaf_size <= target and (best is None or leaf_size > best):
+            best = leaf_size
+    return best
@@ -1,21 +1,55 @@
 #!/usr/bin/env python
 
+import threading
+
 import rospy
 from pymongo import MongoClient
 from mongo_msg_db import MessageDb
 from mongo_msg_db_msgs.msg import Collection
 from rapid_msgs.msg import StaticCloud, StaticCloudInfo
+from static_cloud_db_msgs.msg import StaticCloudMetadata
 from static_cloud_db_msgs.srv import GetStaticCloud, GetStaticCloudResponse
+from static_cloud_db_msgs.srv import GetStaticCloudInfo, GetStaticCloudInfoResponse
+from static_cloud_db_msgs.srv import GetStaticClouds, GetStaticCloudsResponse
 from static_cloud_db_msgs.srv import ListStaticClouds, ListStaticCloudsResponse
 from static_cloud_db_msgs.srv import SaveStaticCloud, SaveStaticCloudResponse
 from static_cloud_db_msgs.srv import RemoveStaticCloud, RemoveStaticCloudResponse
 from rospy_message_converter import json_message_converter as jmc
 from sensor_msgs.msg import PointCloud2
 
+from static_cloud_db import lod
+
 
 class StaticCloudDb(object):
-    def __init__(self, db):
+    def __init__(self, db, mongo_client, lod_leaf_sizes=(), removed_pub=None):
         self._db = db
+        # Used directly for queries that only need a few fields of each
+        # document, which MessageDb can't do.
+        self._mongo_client = mongo_client
+        # If given, the ID and name of each removed cloud are published on it
+        # as a StaticCloudInfo, so that clients can drop cached copies.
+        self._removed_pub = removed_pub
+        # Voxelized copies of each cloud are stored at these leaf sizes, in a
+        # separate <collection>_lod collection. Each copy is named
+        # <cloud id>@<leaf size>.
+        self._lod_leaf_sizes = sorted(lod_leaf_sizes)
+        # Maps (db, collection, cloud id) to {leaf size: LOD id}. A collection's
+        # entries are loaded the first time it is used.
+        self._lod_index = {}
+        self._lod_loaded = set()
+        self._lod_lock = threading.Lock()
+        # Maps (db, collection, cloud id) to a lock held while the cloud's
+        # levels of detail are generated, so that concurrent requests for an
+        # old cloud don't each save a set.
+        self._lod_generation_locks = {}
+        # Maps (db, collection) to a list of StaticCloudMetadata. Filled on the
+        # first info request for a collection and dropped whenever the
+        # collection changes. Services run on separate threads, so a list that
+        # was read before a change is only cached if the collection's
+        # generation hasn't moved on since.
+        self._info_cache = {}
+        self._info_generation = {}
+        self._info_lock = threading.Lock()
 
     def serve_get_cloud(self, req):
         # Get by name if provided.
@@ -27,14 +61,209 @@ class StaticCloudDb(object):
         else:
             id = req.id
 
-        matched_count, cloud = self._db.find_msg(req.collection, id)
         response = GetStaticCloudResponse()
+        response.id = id
+        lod_cloud = self._find_lod(req.collection, id, req.leaf_size)
+        if lod_cloud is not None:
+            response.cloud = lod_cloud
+            response.cloud.name = self._cloud_name(req.collection, id)
+            return response
+
+        matched_count, cloud = self._db.find_msg(req.collection, id)
         if matched_count == 0:
             response.error = 'StaticCloud was not found.'
-        else:
-            response.cloud = cloud
+            return response
+        response.cloud = cloud
+
+        # Clouds saved before levels of detail were added get them on their
+        # first downsampled request.
+        if (req.leaf_size > 0 and len(self._lod_leaf_sizes) > 0
+                and not self._has_lods(req.collection, id)):
+            lods = self._generate_lods(req.collection, id, cloud)
+            leaf_size = lod.pick_level(lods.keys(), req.leaf_size)
+            if leaf_size is not None:
+                response.cloud = lods[leaf_size]
+        return response
+
+    def _cloud_name(self, collection, id):
+        for info in self._cloud_infos(collection):
+            if info.id == id:
+                return info.name
+        return ''
+
+    def _lod_collection(self, collection):
+        return Collection(db=collection.db,
+                          collection=collection.collection + '_lod')
+
+    def _load_lod_index(self, collection):
+        # Must be called without _lod_lock held. Only the names of the levels
+        # of detail are read, and not under the lock, since there may be many
+        # of them and each holds a cloud.
+        key = (collection.db, collection.collection)
+        with self._lod_lock:
+            if key in self._lod_loaded:
+                return
+        lod_collection = self._lod_collection(collection)
+        docs = self._mongo_client[lod_collection.db][
+            lod_collection.collection].find({}, {'name': True})
+        index = {}
+        for doc in docs:
+            source_id, _, leaf_size = doc['name'].rpartition('@')
+            index.setdefault(key + (source_id, ),
+                             {})[float(leaf_size)] = str(doc['_id'])
+        with self._lod_lock:
+            # Another request may have loaded the index, and changed it since.
+            if key in self._lod_loaded:
+                return
+            self._lod_index.update(index)
+            self._lod_loaded.add(key)
+
+    def _has_lods(self, collection, id):
+        self._load_lod_index(collection)
+        with self._lod_lock:
+            return (collection.db, collection.collection,
+                    id) in self._lod_index
+
+    def _find_lod(self, collection, id, target_leaf_size):
+        if target_leaf_size <= 0:
+            return None
+        self._load_lod_index(collection)
+        with self._lod_lock:
+            levels = self._lod_index.get(
+                (collection.db, collection.collection, id), {})
+            leaf_size = lod.pick_level(levels.keys(), target_leaf_size)
+            if leaf_size is None:
+                return None
+            lod_id = levels[leaf_size]
+        matched_count, cloud = self._db.find_msg(
+            self._lod_collection(collection), lod_id)
+        if matched_count == 0:
+            return None
+        return cloud
+
+    def _generate_lods(self, collection, id, cloud):
+        # Saves the levels of detail of a cloud that doesn't have them yet.
+        # Returns them by leaf size, with the cloud's own name.
+        key = (collection.db, collection.collection, id)
+        with self._lod_lock:
+            lock = self._lod_generation_locks.setdefault(key, threading.Lock())
+        with lock:
+            if self._has_lods(collection, id):
+                # Another request generated them while this one waited.
+                lods = {}
+                for leaf_size in self._lod_leaf_sizes:
+                    lod_cloud = self._find_lod(collection, id, leaf_size)
+                    if lod_cloud is not None:
+                        lod_cloud.name = cloud.name
+                        lods[leaf_size] = lod_cloud
+                return lods
+            lods = self._save_lods(collection, id, cloud)
+        with self._lod_lock:
+            self._lod_generation_locks.pop(key, None)
+        return lods
+
+    def _save_lods(self, collection, id, cloud):
+        lods = {}
+        ids = {}
+        for leaf_size in self._lod_leaf_sizes:
+            lod_cloud = StaticCloud()
+            lod_cloud.name = '{}@{}'.format(id, leaf_size)
+            lod_cloud.parent_frame_id = cloud.parent_frame_id
+            lod_cloud.base_to_camera = cloud.base_to_camera
+            lod_cloud.roi = cloud.roi
+            lod_cloud.cloud = lod.voxelize(cloud.cloud, leaf_size,
+                                           cloud.base_to_camera)
+            ids[leaf_size] = self._db.insert_msg(
+                self._lod_collection(collection), lod_cloud)
+            # The returned cloud keeps the original name.
+            lod_cloud.name = cloud.name
+            lods[leaf_size] = lod_cloud
+        self._load_lod_index(collection)
+        with self._lod_lock:
+            self._lod_index[(collection.db, collection.collection, id)] = ids
+        return lods
+
+    def _remove_lods(self, collection, id):
+        self._load_lod_index(collection)
+        with self._lod_lock:
+            levels = self._lod_index.pop(
+                (collection.db, collection.collection, id), {})
+        for lod_id in levels.values():
+            self._db.delete(self._lod_collection(collection), lod_id)
+
+    def serve_get_clouds(self, req):
+        # Only the requested clouds are read, each by its _id. Names are
+        # resolved with the cached metadata, so the collection isn't listed and
+        # converted for every batch.
+        response = GetStaticCloudsResponse()
+        missing = []
+        for id in req.ids:
+            matched_count, cloud = self._db.find_msg(req.collection, id)
+            if matched_count > 0:
+                response.clouds.append(cloud)
+            else:
+                missing.append(id)
+        ids_by_name = {}
+        for info in self._cloud_infos(req.collection):
+            ids_by_name.setdefault(info.name, info.id)
+        for name in req.names:
+            matched_count = 0
+            if name in ids_by_name:
+                matched_count, cloud = self._db.find_msg(
+                    req.collection, ids_by_name[name])
+            if matched_count > 0:
+                response.clouds.append(cloud)
+            else:
+                missing.append(name)
+        if len(missing) > 0:
+            response.clouds = []
+            response.error = 'StaticClouds were not found: {}'.format(
+                ', '.join(missing))
         return response
 
+    def serve_get_cloud_info(self, req):
+        infos = self._cloud_infos(req.collection)
+        response = GetStaticCloudInfoResponse()
+        for info in infos:
+            if req.name != '' and info.name == req.name:
+                response.info = info
+                return response
+        for info in infos:
+            if info.id == req.id:
+                response.info = info
+                return response
+        response.error = 'StaticCloud was not found.'
+        return response
+
+    def _cloud_infos(self, collection):
+        key = (collection.db, collection.collection)
+        with self._info_lock:
+            if key in self._info_cache:
+                return self._info_cache[key]
+            generation = self._info_generation.get(key, 0)
+        infos = []
+        for message in self._db.list(collection):
+            cloud = jmc.convert_json_to_ros_message(message.msg_type,
+                                                    message.json)
+            info = StaticCloudMetadata()
+            info.id = message.id
+            info.name = cloud.name
+            info.parent_frame_id = cloud.parent_frame_id
+            info.roi = cloud.roi
+            info.point_count = cloud.cloud.width * cloud.cloud.height
+            info.stamp = cloud.cloud.header.stamp
+            infos.append(info)
+        with self._info_lock:
+            if self._info_generation.get(key, 0) == generation:
+                self._info_cache[key] = infos
+        return infos
+
+    def _invalidate_info(self, collection):
+        key = (collection.db, collection.collection)
+        with self._info_lock:
+            self._info_cache.pop(key, None)
+            self._info_generation[key] = self._info_generation.get(key, 0) + 1
+
     def _get_id_by_name(self, name, cloud_names):
         for cloud_info in cloud_names:
             if cloud_info.name == name:
@@ -67,15 +296,29 @@ class StaticCloudDb(object):
         else:
             id = req.id
 
+        removed = StaticCloudInfo()
+        removed.id = id
+        removed.name = req.name
+        if removed.name == '' and self._removed_pub is not None:
+            for info in self._cloud_infos(req.collection):
+                if info.id == id:
+                    removed.name = info.name
+                    break
         deleted_count = self._db.delete(req.collection, id)
+        self._remove_lods(req.collection, id)
+        self._invalidate_info(req.collection)
         response = RemoveStaticCloudResponse()
         if deleted_count == 0:
             response.error = 'StaticCloud already not in collection.'
+        elif self._removed_pub is not None:
+            self._removed_pub.publish(removed)
         return response
 
     def serve_save_cloud(self, req):
         response = SaveStaticCloudResponse()
         response.id = self._db.insert_msg(req.collection, req.cloud)
+        self._save_lods(req.collection, response.id, req.cloud)
+        self._invalidate_info(req.collection)
         return response
 
 
@@ -83,8 +326,15 @@ def main():
     rospy.init_node('static_cloud_db')
     mongo_client = MongoClient()
     mongo_db = MessageDb(mongo_client)
-    db = StaticCloudDb(mongo_db)
+    lod_leaf_sizes = rospy.get_param('~lod_leaf_sizes', [0.005, 0.01, 0.02])
+    removed_pub = rospy.Publisher('static_cloud_removed', StaticCloudInfo,
+                                  queue_size=10)
+    db = StaticCloudDb(mongo_db, mongo_client, lod_leaf_sizes, removed_pub)
     get = rospy.Service('get_static_cloud', GetStaticCloud, db.serve_get_cloud)
+    get_info = rospy.Service('get_static_cloud_info', GetStaticCloudInfo,
+                             db.serve_get_cloud_info)
+    get_many = rospy.Service('get_static_clouds', GetStaticClouds,
+                             db.serve_get_clouds)
     list_clouds = rospy.Service('list_static_clouds', ListStaticClouds,
                                 db.serve_list_clouds)
     remove = rospy.Service('remove_static_cloud', RemoveStaticCloud,